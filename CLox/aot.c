@@ -0,0 +1,457 @@
+#include <stdlib.h>
+
+#include "aot.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// Each function becomes one C function with a label for every jump
+// target, and each instruction the C for what its handler in Run() does,
+// with the operands filled in. Like the JIT, the code keeps the value stack
+// in vm.stack exactly as the interpreter would, and calls the Jit*
+// functions in vm.c for calls, allocation and errors.
+//
+// The emitted program also carries the serialized script. Loading it at
+// startup gives every function its chunk back, with the constants, caches
+// and line table the emitted code and the runtime refer to, and the
+// functions are then bound to their code in the same order they were
+// written in.
+
+static int ReadShort(const uint8_t* operand)
+{
+    return (operand[0] << 8) | operand[1];
+}
+
+static int ReadLong(const uint8_t* operand)
+{
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// The first operand of an instruction with a wide form.
+static int Operand(const uint8_t* ip, OpCode longForm)
+{
+    return ip[0] == longForm ? ReadLong(ip + 1) : ip[1];
+}
+
+// Numbers the functions in script, itself first and then depth first
+// through its constants. RunAot walks loaded scripts in the same order.
+static void CollectFunctions(ObjFunction* function, ObjFunction*** functions,
+                             int* count, int* capacity)
+{
+    if (*capacity < *count + 1)
+    {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *functions = GROW_ARRAY(ObjFunction*, *functions,
+                                oldCapacity, *capacity);
+    }
+    (*functions)[(*count)++] = function;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_FUNCTION(constants->values[i]))
+        {
+            CollectFunctions(AS_FUNCTION(constants->values[i]),
+                             functions, count, capacity);
+        }
+    }
+}
+
+static void BindFunctions(ObjFunction* function, const AotFunction* functions,
+                          int functionCount, int* next)
+{
+    if (*next < functionCount) { function->aot = functions[*next]; }
+    (*next)++;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_FUNCTION(constants->values[i]))
+        {
+            BindFunctions(AS_FUNCTION(constants->values[i]), functions,
+                          functionCount, next);
+        }
+    }
+}
+
+// Offsets where some jump lands, which are the only ones given labels.
+static bool* FindJumpTargets(Chunk* chunk)
+{
+    bool* targets = calloc(chunk->count + 1, sizeof(bool));
+    for (int offset = 0; offset < chunk->count;
+         offset += InstructionLength(chunk, offset))
+    {
+        const uint8_t* ip = chunk->code + offset;
+        int next = offset + InstructionLength(chunk, offset);
+        switch (ip[0])
+        {
+            case OP_LOOP:
+                targets[next - ReadShort(ip + 1)] = true;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_EQUAL_JUMP_IF_FALSE:
+            case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_LESS_EQUAL_JUMP_IF_FALSE:
+            case OP_GREATER_JUMP_IF_FALSE:
+            case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+                targets[next + ReadShort(ip + 1)] = true;
+                break;
+            default:
+                break;
+        }
+    }
+    return targets;
+}
+
+static void EmitInstruction(Chunk* chunk, int offset, FILE* out)
+{
+    const uint8_t* ip = chunk->code + offset;
+    int next = offset + InstructionLength(chunk, offset);
+
+    switch (ip[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            fprintf(out, "    AOT_PUSH(constants[%d]);\n",
+                    Operand(ip, OP_CONSTANT_LONG));
+            break;
+        case OP_NIL:   fprintf(out, "    AOT_PUSH(NIL_VAL);\n"); break;
+        case OP_TRUE:  fprintf(out, "    AOT_PUSH(TRUE_VAL);\n"); break;
+        case OP_FALSE: fprintf(out, "    AOT_PUSH(FALSE_VAL);\n"); break;
+        case OP_POP:   fprintf(out, "    top--;\n"); break;
+
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            fprintf(out, "    AOT_PUSH(slots[%d]);\n",
+                    Operand(ip, OP_GET_LOCAL_LONG));
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            fprintf(out, "    slots[%d] = top[-1];\n",
+                    Operand(ip, OP_SET_LOCAL_LONG));
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            fprintf(out, "    AOT_GET_GLOBAL(%d, %d);\n",
+                    offset, Operand(ip, OP_GET_GLOBAL_LONG));
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            fprintf(out, "    AOT_DO(%d, JitDefineGlobal(%d));\n",
+                    offset, Operand(ip, OP_DEFINE_GLOBAL_LONG));
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            fprintf(out, "    AOT_TRY(%d, JitSetGlobal(%d));\n",
+                    offset, Operand(ip, OP_SET_GLOBAL_LONG));
+            break;
+
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+            fprintf(out,
+                    "    AOT_PUSH(*frame->closure->upvalues[%d]->location);\n",
+                    Operand(ip, OP_GET_UPVALUE_LONG));
+            break;
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+            fprintf(out, "    AOT_DO(%d, JitSetUpvalue(%d));\n",
+                    offset, Operand(ip, OP_SET_UPVALUE_LONG));
+            break;
+
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        {
+            int cache = ReadShort(ip + (ip[0] == OP_GET_PROPERTY ? 2 : 4));
+            fprintf(out,
+                    "    AOT_GET_PROPERTY(%d, AS_STRING(constants[%d]), "
+                    "&caches[%d]);\n",
+                    offset, Operand(ip, OP_GET_PROPERTY_LONG), cache);
+            break;
+        }
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        {
+            int cache = ReadShort(ip + (ip[0] == OP_SET_PROPERTY ? 2 : 4));
+            fprintf(out,
+                    "    AOT_TRY(%d, JitSetProperty(AS_STRING(constants[%d]), "
+                    "&caches[%d]));\n",
+                    offset, Operand(ip, OP_SET_PROPERTY_LONG), cache);
+            break;
+        }
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+            fprintf(out,
+                    "    AOT_TRY(%d, JitGetSuper(AS_STRING(constants[%d])));\n",
+                    offset, Operand(ip, OP_GET_SUPER_LONG));
+            break;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            fprintf(out,
+                    "    {\n"
+                    "        bool equal;\n"
+                    "        AOT_VALUES_EQUAL(%d, equal);\n"
+                    "        AOT_PUSH(BOOL_VAL(%sequal));\n"
+                    "    }\n",
+                    offset, ip[0] == OP_EQUAL ? "" : "!");
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            fprintf(out, "    AOT_COMPARE(%d, >, false);\n", offset);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            fprintf(out, "    AOT_COMPARE(%d, <, false);\n", offset);
+            break;
+        case OP_LESS_EQUAL:
+            fprintf(out, "    AOT_COMPARE(%d, >, true);\n", offset);
+            break;
+        case OP_GREATER_EQUAL:
+            fprintf(out, "    AOT_COMPARE(%d, <, true);\n", offset);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            fprintf(out, "    AOT_ADD(%d);\n", offset);
+            break;
+        case OP_SUBTRACT:
+            fprintf(out, "    AOT_ARITHMETIC(%d, -);\n", offset);
+            break;
+        case OP_MULTIPLY:
+            fprintf(out, "    AOT_ARITHMETIC(%d, *);\n", offset);
+            break;
+        case OP_DIVIDE:
+            fprintf(out, "    AOT_ARITHMETIC(%d, /);\n", offset);
+            break;
+
+        case OP_NOT:
+            fprintf(out, "    top[-1] = BOOL_VAL(AOT_FALSEY(top[-1]));\n");
+            break;
+        case OP_NEGATE:
+            fprintf(out,
+                    "    if (!IS_NUMBER(top[-1]))\n"
+                    "    {\n"
+                    "        AOT_ERROR(%d, \"Operand must be a number.\");\n"
+                    "    }\n"
+                    "    top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));\n",
+                    offset);
+            break;
+
+        case OP_PRINT:
+            fprintf(out, "    AOT_DO(%d, JitPrint());\n", offset);
+            break;
+
+        case OP_JUMP:
+            fprintf(out, "    goto i%d;\n", next + ReadShort(ip + 1));
+            break;
+        case OP_LOOP:
+            fprintf(out, "    goto i%d;\n", next - ReadShort(ip + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if (AOT_FALSEY(top[-1])) { goto i%d; }\n",
+                    next + ReadShort(ip + 1));
+            break;
+
+        case OP_ADD_LOCAL_CONST:
+            fprintf(out,
+                    "    if (!IS_NUMBER(slots[%d]))\n"
+                    "    {\n"
+                    "        AOT_ERROR(%d, "
+                    "\"Operands must be two numbers or two strings.\");\n"
+                    "    }\n"
+                    "    slots[%d] = NUMBER_VAL(AS_NUMBER(slots[%d]) + "
+                    "AS_NUMBER(constants[%d]));\n",
+                    ip[1], offset, ip[1], ip[1], ip[2]);
+            break;
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            fprintf(out,
+                    "    {\n"
+                    "        bool equal;\n"
+                    "        AOT_VALUES_EQUAL(%d, equal);\n"
+                    "        if (%sequal) { goto i%d; }\n"
+                    "    }\n",
+                    offset, ip[0] == OP_EQUAL_JUMP_IF_FALSE ? "!" : "",
+                    next + ReadShort(ip + 1));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            fprintf(out, "    AOT_COMPARE_JUMP(%d, <, false, i%d);\n",
+                    offset, next + ReadShort(ip + 1));
+            break;
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+            fprintf(out, "    AOT_COMPARE_JUMP(%d, >, true, i%d);\n",
+                    offset, next + ReadShort(ip + 1));
+            break;
+        case OP_GREATER_JUMP_IF_FALSE:
+            fprintf(out, "    AOT_COMPARE_JUMP(%d, >, false, i%d);\n",
+                    offset, next + ReadShort(ip + 1));
+            break;
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            fprintf(out, "    AOT_COMPARE_JUMP(%d, <, true, i%d);\n",
+                    offset, next + ReadShort(ip + 1));
+            break;
+
+        // The emitted function's frame is on the C stack, so a tail call
+        // is made as a plain call, marked so traces leave the frame out.
+        case OP_CALL:
+            fprintf(out, "    AOT_TRY(%d, JitCall(%d));\n", offset, ip[1]);
+            break;
+        case OP_TAIL_CALL:
+            fprintf(out, "    frame->tailCalling = true;\n");
+            fprintf(out, "    AOT_TRY(%d, JitCall(%d));\n", offset, ip[1]);
+            break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        {
+            bool isLong = ip[0] == OP_INVOKE_LONG;
+            fprintf(out,
+                    "    AOT_TRY(%d, JitInvoke(AS_STRING(constants[%d]), %d, "
+                    "&caches[%d]));\n",
+                    offset, Operand(ip, OP_INVOKE_LONG), ip[isLong ? 4 : 2],
+                    ReadShort(ip + (isLong ? 5 : 3)));
+            break;
+        }
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+            fprintf(out,
+                    "    AOT_TRY(%d, JitSuperInvoke(AS_STRING(constants[%d]), "
+                    "%d));\n",
+                    offset, Operand(ip, OP_SUPER_INVOKE_LONG),
+                    ip[ip[0] == OP_SUPER_INVOKE_LONG ? 4 : 2]);
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            fprintf(out, "    AOT_DO(%d, JitClosure(chunk->code + %d));\n",
+                    offset, offset);
+            break;
+        case OP_CLOSE_UPVALUE:
+            fprintf(out, "    AOT_DO(%d, JitCloseUpvalue());\n", offset);
+            break;
+        case OP_RETURN:
+            fprintf(out,
+                    "    AOT_SAVE(%d);\n"
+                    "    JitReturn();\n"
+                    "    return true;\n",
+                    offset);
+            break;
+
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            fprintf(out,
+                    "    AOT_DO(%d, JitClass(AS_STRING(constants[%d])));\n",
+                    offset, Operand(ip, OP_CLASS_LONG));
+            break;
+        case OP_INHERIT:
+            fprintf(out, "    AOT_TRY(%d, JitInherit());\n", offset);
+            break;
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+            fprintf(out,
+                    "    AOT_DO(%d, JitMethod(AS_STRING(constants[%d])));\n",
+                    offset, Operand(ip, OP_METHOD_LONG));
+            break;
+    }
+}
+
+static void EmitFunction(ObjFunction* function, int index, FILE* out)
+{
+    Chunk* chunk = &function->chunk;
+    bool* targets = FindJumpTargets(chunk);
+
+    fprintf(out,
+            "// %s\n"
+            "static bool Function%d()\n"
+            "{\n"
+            "    AOT_FRAME();\n",
+            function->name == NULL ? "script" : function->name->chars, index);
+
+    int line = -1;
+    for (int offset = 0; offset < chunk->count;
+         offset += InstructionLength(chunk, offset))
+    {
+        if (GetLine(chunk, offset) != line)
+        {
+            line = GetLine(chunk, offset);
+            fprintf(out, "\n    // line %d\n", line);
+        }
+        if (targets[offset]) { fprintf(out, "i%d:\n", offset); }
+        EmitInstruction(chunk, offset, out);
+    }
+
+    fprintf(out, "}\n\n");
+    free(targets);
+}
+
+void EmitC(ObjFunction* script, const char* path, FILE* out)
+{
+    ObjFunction** functions = NULL;
+    int count = 0;
+    int capacity = 0;
+    CollectFunctions(script, &functions, &count, &capacity);
+
+    fprintf(out,
+            "// Compiled by clox --emit-c from\n"
+            "// %s\n"
+            "// Build it together with the CLox sources, leaving out main.c.\n"
+            "#include \"aot.h\"\n\n",
+            path);
+
+    for (int i = 0; i < count; i++) { EmitFunction(functions[i], i, out); }
+
+    size_t size;
+    uint8_t* image = SerializeFunction(script, &size);
+    fprintf(out, "static const uint8_t image[] =\n{");
+    for (size_t i = 0; i < size; i++)
+    {
+        fprintf(out, i % 12 == 0 ? "\n    0x%02x," : " 0x%02x,", image[i]);
+    }
+    fprintf(out, "\n};\n\n");
+    free(image);
+
+    fprintf(out, "static const AotFunction functions[] =\n{\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "    Function%d,\n", i);
+    }
+    fprintf(out,
+            "};\n\n"
+            "int main()\n"
+            "{\n"
+            "    return RunAot(image, sizeof(image), functions, %d);\n"
+            "}\n",
+            count);
+
+    FREE_ARRAY(ObjFunction*, functions, capacity);
+}
+
+int RunAot(const uint8_t* image, size_t size, const AotFunction* functions,
+           int functionCount)
+{
+    InitVM();
+    // Everything already is machine code.
+    vm.useJit = false;
+
+    const char* error;
+    ObjFunction* script = DeserializeFunction(image, size, &error);
+    if (script == NULL)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 65;
+    }
+
+    int next = 0;
+    BindFunctions(script, functions, functionCount, &next);
+    if (next != functionCount)
+    {
+        fprintf(stderr, "Compiled code doesn't match the script.\n");
+        return 65;
+    }
+
+    InterpretResult result = InterpretFunction(script);
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
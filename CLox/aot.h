@@ -0,0 +1,160 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "object.h"
+#include "vm.h"
+
+typedef bool (*AotFunction)();
+
+// Writes script, and every function it defines, to out as C. Built
+// together with the rest of the runtime (every source file but main.c),
+// it is a program that runs the script with no bytecode dispatch. path is
+// only used in comments.
+void EmitC(ObjFunction* script, const char* path, FILE* out);
+
+// The main() of an emitted program. image is the serialized script, which
+// still supplies constants, inline caches and the line numbers runtime
+// errors report, and functions holds the code for each of its functions in
+// the order EmitC wrote them. Returns the exit code.
+int RunAot(const uint8_t* image, size_t size, const AotFunction* functions,
+           int functionCount);
+
+// What emitted functions are made of. Each keeps frame, chunk, constants,
+// caches, slots and the stack top in locals, like Run() does, and saves
+// them back before calling anything that can look at them, and picks them
+// up again after, since a call can move both stacks. offset is the
+// bytecode offset of the instruction; ip is left just past its opcode, so
+// errors report its line.
+#define AOT_FRAME() \
+    CallFrame* frame = &vm.frames[vm.frameCount - 1]; \
+    Chunk* chunk = &frame->closure->function->chunk; \
+    Value* constants = chunk->constants.values; \
+    InlineCache* caches = chunk->caches; \
+    Value* slots = frame->slots; \
+    Value* top = vm.stackTop; \
+    (void)constants; \
+    (void)caches; \
+    (void)slots
+
+#define AOT_PUSH(value) (*top++ = (value))
+#define AOT_SAVE(offset) \
+    (vm.stackTop = top, frame->ip = chunk->code + (offset) + 1)
+#define AOT_LOAD() \
+    (frame = &vm.frames[vm.frameCount - 1], top = vm.stackTop, \
+     slots = frame->slots)
+
+#define AOT_DO(offset, call) \
+    do { AOT_SAVE(offset); call; AOT_LOAD(); } while (false)
+#define AOT_TRY(offset, call) \
+    do \
+    { \
+        AOT_SAVE(offset); \
+        if (!(call)) { return false; } \
+        AOT_LOAD(); \
+    } while (false)
+#define AOT_ERROR(offset, message) \
+    do { AOT_SAVE(offset); return JitError(message); } while (false)
+
+#define AOT_GET_GLOBAL(offset, slot) \
+    do \
+    { \
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) \
+        { \
+            AOT_SAVE(offset); \
+            return JitUndefinedVariable(slot); \
+        } \
+        AOT_PUSH(vm.globalValues.values[slot]); \
+    } while (false)
+
+#define AOT_FALSEY(value) \
+    (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+#define AOT_NUMBERS() (IS_NUMBER(top[-1]) && IS_NUMBER(top[-2]))
+
+#define AOT_ARITHMETIC(offset, op) \
+    do \
+    { \
+        if (!AOT_NUMBERS()) \
+        { \
+            AOT_ERROR(offset, "Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(*--top); \
+        top[-1] = NUMBER_VAL(AS_NUMBER(top[-1]) op b); \
+    } while (false)
+
+// The negated forms keep the exact result of the NOT they stand for, NaN
+// included.
+#define AOT_COMPARE(offset, op, negated) \
+    do \
+    { \
+        if (!AOT_NUMBERS()) \
+        { \
+            AOT_ERROR(offset, "Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(*--top); \
+        top[-1] = BOOL_VAL((AS_NUMBER(top[-1]) op b) != (negated)); \
+    } while (false)
+#define AOT_COMPARE_JUMP(offset, op, negated, target) \
+    do \
+    { \
+        if (!AOT_NUMBERS()) \
+        { \
+            AOT_ERROR(offset, "Operands must be numbers."); \
+        } \
+        top -= 2; \
+        if ((AS_NUMBER(top[0]) op AS_NUMBER(top[1])) == (negated)) \
+        { \
+            goto target; \
+        } \
+    } while (false)
+
+// Pops two values into equal. Anything but numbers may flatten a rope.
+#define AOT_VALUES_EQUAL(offset, equal) \
+    do \
+    { \
+        if (AOT_NUMBERS()) \
+        { \
+            equal = AS_NUMBER(top[-2]) == AS_NUMBER(top[-1]); \
+            top -= 2; \
+        } \
+        else \
+        { \
+            AOT_SAVE(offset); \
+            equal = JitValuesEqual(); \
+            AOT_LOAD(); \
+        } \
+    } while (false)
+
+#define AOT_ADD(offset) \
+    do \
+    { \
+        if (AOT_NUMBERS()) \
+        { \
+            double b = AS_NUMBER(*--top); \
+            top[-1] = NUMBER_VAL(AS_NUMBER(top[-1]) + b); \
+        } \
+        else \
+        { \
+            AOT_TRY(offset, JitAdd()); \
+        } \
+    } while (false)
+
+// Reads a field straight out of the instance when the site's first cache
+// entry is a field of its shape.
+#define AOT_GET_PROPERTY(offset, name, cache) \
+    do \
+    { \
+        CacheEntry* entry = &(cache)->entries[0]; \
+        if (IS_INSTANCE(top[-1]) && (cache)->count > 0 && \
+            entry->shape == AS_INSTANCE(top[-1])->shape && entry->slot >= 0) \
+        { \
+            top[-1] = AS_INSTANCE(top[-1])->fields[entry->slot]; \
+        } \
+        else \
+        { \
+            AOT_TRY(offset, JitGetProperty(name, cache)); \
+        } \
+    } while (false)
+
+#endif
@@ -0,0 +1,553 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "vm.h"
+
+// Layout, all integers little-endian u32 unless noted:
+//
+//   "LOXC" version
+//   globalCount { string }          names of global slots 0..n-1
+//   function                        the top-level script
+//
+//   function = u8 hasName [string] arity upvalueCount slotCount
+//              codeCount { u8 }
+//              body
+//   body     = lineCount { offset line }
+//              cacheCount
+//              constantCount { u8 tag, payload }
+//   string   = length { u8 }
+//
+// A function constant's payload is the byte length of its record followed
+// by the record, so a loader can skip over a nested function's body without
+// parsing it.
+//
+// Global slots are baked into the code, so a loading VM has to resolve the
+// same names to the same slots. A fresh VM does, since it defines the same
+// natives in the same order before resolving the script's names.
+
+typedef enum
+{
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+// Deepest function nesting accepted from a file. Each level holds a slot
+// on the VM stack while it is being read.
+#define MAX_NESTING UINT8_COUNT
+
+typedef struct
+{
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+    int depth;
+    // Point chunks at the code in data and leave bodies to be read on the
+    // first call, instead of copying everything up front.
+    bool borrow;
+    bool hadError;
+} Reader;
+
+// The image LoadImage borrowed from. Pending function bodies point into it.
+static const uint8_t* image;
+static size_t imageSize;
+
+static void WriteBytes(Writer* writer, const void* bytes, size_t count)
+{
+    if (writer->capacity < writer->count + count)
+    {
+        while (writer->capacity < writer->count + count)
+        {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = (uint8_t*)realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL) { exit(1); }
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void WriteU8(Writer* writer, uint8_t value)
+{
+    WriteBytes(writer, &value, 1);
+}
+
+static void WriteU32(Writer* writer, uint32_t value)
+{
+    uint8_t bytes[4] =
+    {
+        value & 0xff,
+        (value >> 8) & 0xff,
+        (value >> 16) & 0xff,
+        (value >> 24) & 0xff
+    };
+    WriteBytes(writer, bytes, 4);
+}
+
+static void WriteNumber(Writer* writer, double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    WriteU32(writer, (uint32_t)(bits & 0xffffffff));
+    WriteU32(writer, (uint32_t)(bits >> 32));
+}
+
+static void WriteString(Writer* writer, ObjString* string)
+{
+    WriteU32(writer, (uint32_t)string->length);
+    WriteBytes(writer, string->chars, string->length);
+}
+
+static void WriteFunction(Writer* writer, ObjFunction* function)
+{
+    WriteU8(writer, function->name != NULL);
+    if (function->name != NULL) { WriteString(writer, function->name); }
+
+    WriteU32(writer, (uint32_t)function->arity);
+    WriteU32(writer, (uint32_t)function->upvalueCount);
+    WriteU32(writer, (uint32_t)function->slotCount);
+
+    Chunk* chunk = &function->chunk;
+    WriteU32(writer, (uint32_t)chunk->count);
+    WriteBytes(writer, chunk->code, chunk->count);
+
+    WriteU32(writer, (uint32_t)chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++)
+    {
+        WriteU32(writer, (uint32_t)chunk->lines[i].offset);
+        WriteU32(writer, (uint32_t)chunk->lines[i].line);
+    }
+
+    WriteU32(writer, (uint32_t)chunk->cacheCount);
+
+    WriteU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value value = chunk->constants.values[i];
+        if (IS_NIL(value))
+        {
+            WriteU8(writer, CONSTANT_NIL);
+        }
+        else if (IS_BOOL(value))
+        {
+            WriteU8(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        }
+        else if (IS_NUMBER(value))
+        {
+            WriteU8(writer, CONSTANT_NUMBER);
+            WriteNumber(writer, AS_NUMBER(value));
+        }
+        else if (IS_STRING(value))
+        {
+            WriteU8(writer, CONSTANT_STRING);
+            WriteString(writer, AS_STRING(value));
+        }
+        else
+        {
+            WriteU8(writer, CONSTANT_FUNCTION);
+            size_t start = writer->count;
+            WriteU32(writer, 0);
+            WriteFunction(writer, AS_FUNCTION(value));
+
+            uint32_t length = (uint32_t)(writer->count - start - 4);
+            for (int byte = 0; byte < 4; byte++)
+            {
+                writer->bytes[start + byte] = (length >> (8 * byte)) & 0xff;
+            }
+        }
+    }
+}
+
+uint8_t* SerializeFunction(ObjFunction* function, size_t* size)
+{
+    Writer writer = { NULL, 0, 0 };
+
+    WriteBytes(&writer, BYTECODE_MAGIC, 4);
+    WriteU32(&writer, BYTECODE_VERSION);
+
+    int globalCount = vm.globalValues.count;
+    ObjString** names = (ObjString**)calloc(globalCount + 1,
+                                            sizeof(ObjString*));
+    if (names == NULL) { exit(1); }
+    for (int i = 0; i < vm.globalNames.capacity; i++)
+    {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key == NULL) { continue; }
+        names[(int)AS_NUMBER(entry->value)] = entry->key;
+    }
+
+    WriteU32(&writer, (uint32_t)globalCount);
+    for (int i = 0; i < globalCount; i++)
+    {
+        WriteString(&writer, names[i]);
+    }
+    free(names);
+
+    WriteFunction(&writer, function);
+
+    *size = writer.count;
+    return writer.bytes;
+}
+
+static bool Require(Reader* reader, size_t count)
+{
+    if (reader->hadError || reader->size - reader->offset < count)
+    {
+        reader->hadError = true;
+        return false;
+    }
+    return true;
+}
+
+static uint8_t ReadU8(Reader* reader)
+{
+    if (!Require(reader, 1)) { return 0; }
+    return reader->data[reader->offset++];
+}
+
+static uint32_t ReadU32(Reader* reader)
+{
+    if (!Require(reader, 4)) { return 0; }
+    const uint8_t* bytes = reader->data + reader->offset;
+    reader->offset += 4;
+    return (uint32_t)bytes[0] |
+           ((uint32_t)bytes[1] << 8) |
+           ((uint32_t)bytes[2] << 16) |
+           ((uint32_t)bytes[3] << 24);
+}
+
+static double ReadNumber(Reader* reader)
+{
+    uint64_t low = ReadU32(reader);
+    uint64_t high = ReadU32(reader);
+    uint64_t bits = low | (high << 32);
+    double number;
+    memcpy(&number, &bits, sizeof(double));
+    return number;
+}
+
+// Reads a u32 element count and checks that at least that many elements
+// of elementSize bytes are left, so a corrupt count can't make us allocate
+// more than the file could describe.
+static int ReadCount(Reader* reader, size_t elementSize)
+{
+    uint32_t count = ReadU32(reader);
+    if (count > INT32_MAX || !Require(reader, count * elementSize))
+    {
+        reader->hadError = true;
+        return 0;
+    }
+    return (int)count;
+}
+
+static ObjString* ReadString(Reader* reader)
+{
+    int length = ReadCount(reader, 1);
+    if (reader->hadError) { return NULL; }
+
+    const char* chars = (const char*)reader->data + reader->offset;
+    reader->offset += length;
+    return CopyString(chars, length);
+}
+
+static ObjFunction* ReadFunction(Reader* reader);
+
+// The function may have been promoted by a collection while its earlier
+// constants were allocated, or long before if this is a pending body.
+static void AddFunctionConstant(ObjFunction* function, Value value)
+{
+    AddConstant(&function->chunk, value);
+    WRITE_BARRIER(function, value);
+}
+
+// Reads everything after the code into the function's chunk.
+static void ReadBody(Reader* reader, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+
+    int lineCount = ReadCount(reader, 8);
+    if (reader->hadError || (chunk->count > 0 && lineCount == 0))
+    {
+        reader->hadError = true;
+        return;
+    }
+    chunk->lines = GROW_ARRAY(LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = lineCount;
+    for (int i = 0; i < lineCount; i++)
+    {
+        chunk->lines[i].offset = (int)ReadU32(reader);
+        chunk->lines[i].line = (int)ReadU32(reader);
+    }
+    chunk->lineCount = lineCount;
+
+    // Inline caches only need to exist; they start out empty. Each belongs
+    // to an instruction in the code, since the compiler drops the caches of
+    // code it drops.
+    int cacheCount = ReadCount(reader, 0);
+    if (cacheCount > chunk->count) { reader->hadError = true; }
+    if (reader->hadError) { return; }
+    for (int i = 0; i < cacheCount; i++)
+    {
+        AddInlineCache(chunk);
+    }
+
+    int constantCount = ReadCount(reader, 1);
+    for (int i = 0; i < constantCount && !reader->hadError; i++)
+    {
+        switch (ReadU8(reader))
+        {
+            case CONSTANT_NIL:
+                AddFunctionConstant(function, NIL_VAL);
+                break;
+            case CONSTANT_FALSE:
+                AddFunctionConstant(function, BOOL_VAL(false));
+                break;
+            case CONSTANT_TRUE:
+                AddFunctionConstant(function, BOOL_VAL(true));
+                break;
+            case CONSTANT_NUMBER:
+                AddFunctionConstant(function,
+                                    NUMBER_VAL(ReadNumber(reader)));
+                break;
+            case CONSTANT_STRING:
+            {
+                ObjString* string = ReadString(reader);
+                if (string != NULL)
+                {
+                    AddFunctionConstant(function, OBJ_VAL(string));
+                }
+                break;
+            }
+            case CONSTANT_FUNCTION:
+            {
+                int length = ReadCount(reader, 1);
+                size_t end = reader->offset + length;
+                AddFunctionConstant(function, OBJ_VAL(ReadFunction(reader)));
+                Pop();
+
+                // A borrowed function stops after its code; the rest of
+                // its record is read when it is first called.
+                if (reader->borrow) { reader->offset = end; }
+                else if (reader->offset != end) { reader->hadError = true; }
+                break;
+            }
+            default:
+                reader->hadError = true;
+                break;
+        }
+    }
+}
+
+// Leaves the function on the VM stack so it stays reachable while its
+// constants are being allocated. The caller pops it.
+static ObjFunction* ReadFunction(Reader* reader)
+{
+    ObjFunction* function = NewFunction();
+    Push(OBJ_VAL(function));
+
+    if (++reader->depth > MAX_NESTING)
+    {
+        reader->hadError = true;
+        return function;
+    }
+
+    if (ReadU8(reader))
+    {
+        function->name = ReadString(reader);
+        if (function->name != NULL)
+        {
+            WRITE_BARRIER(function, OBJ_VAL(function->name));
+        }
+    }
+
+    function->arity = (int)ReadU32(reader);
+    function->upvalueCount = (int)ReadU32(reader);
+    function->slotCount = (int)ReadU32(reader);
+
+    Chunk* chunk = &function->chunk;
+    int codeCount = ReadCount(reader, 1);
+    if (reader->hadError) { return function; }
+    if (reader->borrow)
+    {
+        chunk->code = (uint8_t*)reader->data + reader->offset;
+        chunk->borrowsCode = true;
+    }
+    else
+    {
+        chunk->code = GROW_ARRAY(uint8_t, NULL, 0, codeCount);
+        memcpy(chunk->code, reader->data + reader->offset, codeCount);
+    }
+    chunk->capacity = codeCount;
+    chunk->count = codeCount;
+    reader->offset += codeCount;
+
+    if (reader->borrow)
+    {
+        function->pendingBody = reader->data + reader->offset;
+    }
+    else
+    {
+        ReadBody(reader, function);
+    }
+
+    reader->depth--;
+    return function;
+}
+
+// Walks a function record the way ReadFunction and ReadBody would, but
+// only checks it. A borrowed image reads its bodies on their first call,
+// which is too late to reject the file, so LoadImage checks them all
+// first.
+static void SkipFunction(Reader* reader)
+{
+    if (++reader->depth > MAX_NESTING)
+    {
+        reader->hadError = true;
+        return;
+    }
+
+    if (ReadU8(reader)) { reader->offset += ReadCount(reader, 1); }
+    ReadU32(reader);
+    ReadU32(reader);
+    ReadU32(reader);
+
+    int codeCount = ReadCount(reader, 1);
+    reader->offset += codeCount;
+
+    int lineCount = ReadCount(reader, 8);
+    if (codeCount > 0 && lineCount == 0) { reader->hadError = true; }
+    reader->offset += (size_t)lineCount * 8;
+
+    int cacheCount = ReadCount(reader, 0);
+    if (cacheCount > codeCount) { reader->hadError = true; }
+
+    int constantCount = ReadCount(reader, 1);
+    for (int i = 0; i < constantCount && !reader->hadError; i++)
+    {
+        switch (ReadU8(reader))
+        {
+            case CONSTANT_NIL:
+            case CONSTANT_FALSE:
+            case CONSTANT_TRUE:
+                break;
+            case CONSTANT_NUMBER:
+                if (Require(reader, 8)) { reader->offset += 8; }
+                break;
+            case CONSTANT_STRING:
+                reader->offset += ReadCount(reader, 1);
+                break;
+            case CONSTANT_FUNCTION:
+            {
+                int length = ReadCount(reader, 1);
+                size_t end = reader->offset + length;
+                SkipFunction(reader);
+                if (reader->offset != end) { reader->hadError = true; }
+                break;
+            }
+            default:
+                reader->hadError = true;
+                break;
+        }
+    }
+
+    reader->depth--;
+}
+
+bool IsBytecode(const uint8_t* data, size_t size)
+{
+    return size >= 4 && memcmp(data, BYTECODE_MAGIC, 4) == 0;
+}
+
+// Checks the header and resolves the globals. Returns false and sets error
+// if the data can't be loaded.
+static bool ReadHeader(Reader* reader, const char** error)
+{
+    if (!IsBytecode(reader->data, reader->size))
+    {
+        *error = "Not a compiled Lox file.";
+        return false;
+    }
+    reader->offset = 4;
+
+    if (ReadU32(reader) != BYTECODE_VERSION)
+    {
+        *error = "Compiled file is from a different version of clox.";
+        return false;
+    }
+
+    int globalCount = ReadCount(reader, 4);
+    for (int i = 0; i < globalCount && !reader->hadError; i++)
+    {
+        ObjString* name = ReadString(reader);
+        if (name != NULL && ResolveGlobal(name) != i)
+        {
+            *error = "Compiled file was built against different globals.";
+            return false;
+        }
+    }
+    return true;
+}
+
+static ObjFunction* ReadScript(Reader* reader, const char** error)
+{
+    if (!ReadHeader(reader, error)) { return NULL; }
+
+    if (reader->borrow)
+    {
+        Reader check = *reader;
+        SkipFunction(&check);
+        if (check.hadError)
+        {
+            *error = "Compiled file is truncated or corrupt.";
+            return NULL;
+        }
+    }
+
+    ObjFunction* function = ReadFunction(reader);
+    Pop();
+
+    if (reader->hadError)
+    {
+        *error = "Compiled file is truncated or corrupt.";
+        return NULL;
+    }
+    return function;
+}
+
+ObjFunction* DeserializeFunction(const uint8_t* data, size_t size,
+                                 const char** error)
+{
+    Reader reader = { data, size, 0, 0, false, false };
+    return ReadScript(&reader, error);
+}
+
+ObjFunction* LoadImage(uint8_t* data, size_t size, const char** error)
+{
+    image = data;
+    imageSize = size;
+
+    Reader reader = { data, size, 0, 0, true, false };
+    return ReadScript(&reader, error);
+}
+
+bool LoadPendingBody(ObjFunction* function)
+{
+    Reader reader = { image, imageSize, function->pendingBody - image, 0,
+                      true, false };
+    function->pendingBody = NULL;
+    ReadBody(&reader, function);
+    return !reader.hadError;
+}
@@ -0,0 +1,25 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "object.h"
+
+// Compiled scripts on disk. The format starts with BYTECODE_MAGIC and
+// BYTECODE_VERSION; bump the version whenever OpCode or the layout in
+// bytecode.c changes so stale files are rejected instead of misread.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 3
+
+bool IsBytecode(const uint8_t* data, size_t size);
+uint8_t* SerializeFunction(ObjFunction* function, size_t* size);
+// Returns NULL and sets error if the data can't be loaded.
+ObjFunction* DeserializeFunction(const uint8_t* data, size_t size,
+                                 const char** error);
+// Like DeserializeFunction, but runs the code in place: data must stay
+// mapped, and writable, for as long as the VM runs. Each function's lines,
+// caches and constants are only read when LoadPendingBody is called for
+// it, which the VM does on the function's first call.
+ObjFunction* LoadImage(uint8_t* data, size_t size, const char** error);
+// Returns false if the function's body in the image is corrupt.
+bool LoadPendingBody(ObjFunction* function);
+
+#endif
@@ -9,15 +9,31 @@ void InitChunk(Chunk* chunk)
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
-	chunk->lines = NULL;
+    chunk->borrowsCode = false;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines = NULL;
 	InitValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->registers.count = 0;
+    chunk->registers.capacity = 0;
+    chunk->registers.code = NULL;
+    chunk->registers.origins = NULL;
 }
 
 void FreeChunk(Chunk* chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->borrowsCode)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    }
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 	FreeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(uint32_t, chunk->registers.code, chunk->registers.capacity);
+    FREE_ARRAY(int, chunk->registers.origins, chunk->registers.capacity);
 	InitChunk(chunk);
 }
 
@@ -28,12 +44,29 @@ void WriteChunk(Chunk* chunk, uint8_t byte, int line)
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
+
+    // Still on the same line as the previous byte.
+    if (chunk->lineCount > 0 &&
+        chunk->lines[chunk->lineCount - 1].line == line)
+    {
+        return;
+    }
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+                                  oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
 }
 
 int AddConstant(Chunk* chunk, Value value)
@@ -43,3 +76,50 @@ int AddConstant(Chunk* chunk, Value value)
     Pop();
 	return chunk->constants.count - 1;
 }
+
+// Drops all code from count onward, along with its line runs.
+void TruncateChunk(Chunk* chunk, int count)
+{
+    chunk->count = count;
+    while (chunk->lineCount > 0 &&
+           chunk->lines[chunk->lineCount - 1].offset >= count)
+    {
+        chunk->lineCount--;
+    }
+}
+
+int GetLine(Chunk* chunk, int offset)
+{
+    // Binary search for the last run starting at or before offset.
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    while (start < end)
+    {
+        int mid = start + (end - start + 1) / 2;
+        if (chunk->lines[mid].offset <= offset)
+        {
+            start = mid;
+        }
+        else
+        {
+            end = mid - 1;
+        }
+    }
+
+    return chunk->lines[start].line;
+}
+
+int AddInlineCache(Chunk* chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                                   oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
@@ -35,6 +35,10 @@ typedef enum
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    // A call whose result the function returns straight away. The callee
+    // takes over the caller's frame; OP_RETURN still follows, for when it
+    // can't.
+    OP_TAIL_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
@@ -42,21 +46,170 @@ typedef enum
 	OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    // Wide forms taking a 24-bit big-endian operand in place of the
+    // one-byte index, for chunks with more than 256 constants, globals,
+    // locals or upvalues.
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_UPVALUE_LONG,
+    OP_SET_UPVALUE_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_SUPER_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    OP_CLOSURE_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    // Superinstructions. The compiler never emits these directly; the
+    // peephole pass in optimizer.c fuses them out of common sequences.
+    OP_NOT_EQUAL,
+    OP_LESS_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_ADD_LOCAL_CONST,
+    OP_EQUAL_JUMP_IF_FALSE,
+    OP_NOT_EQUAL_JUMP_IF_FALSE,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_LESS_EQUAL_JUMP_IF_FALSE,
+    OP_GREATER_JUMP_IF_FALSE,
+    OP_GREATER_EQUAL_JUMP_IF_FALSE,
+    // Quickened forms. Nothing emits these either: Run() rewrites a
+    // generic instruction into one in place once it has seen its operand
+    // types, and back again when a later run sees other types.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_LESS_NUM,
+    OP_GREATER_NUM
 } OpCode;
 
+// The register form of a chunk, run by the VM instead of the stack code
+// with --registers. Every instruction is a run of 32-bit units: the
+// opcode, then its operands. Registers are frame slots: the locals, and
+// above them the temporaries the stack code would have pushed, at the
+// same depths. Operands marked "rk" are a register, or a constant index
+// with RK_CONSTANT set. "top" is the number of registers that hold live
+// values, for instructions that can collect.
+typedef enum
+{
+    REG_MOVE,                     // dst, rk
+    REG_GET_GLOBAL,               // dst, slot
+    REG_DEFINE_GLOBAL,            // slot, rk
+    REG_SET_GLOBAL,               // slot, rk
+    REG_GET_UPVALUE,              // dst, index
+    REG_SET_UPVALUE,              // index, rk
+    REG_GET_PROPERTY,             // dst, rk object, name, cache, top
+    REG_SET_PROPERTY,             // dst, rk object, rk value, name, cache
+    REG_GET_SUPER,                // base, name
+    REG_EQUAL,                    // dst, rk, rk, top
+    REG_NOT_EQUAL,                // dst, rk, rk, top
+    REG_GREATER,                  // dst, rk, rk
+    REG_GREATER_EQUAL,            // dst, rk, rk
+    REG_LESS,                     // dst, rk, rk
+    REG_LESS_EQUAL,               // dst, rk, rk
+    REG_ADD,                      // dst, rk, rk, top
+    REG_SUBTRACT,                 // dst, rk, rk
+    REG_MULTIPLY,                 // dst, rk, rk
+    REG_DIVIDE,                   // dst, rk, rk
+    REG_NOT,                      // dst, rk
+    REG_NEGATE,                   // dst, rk
+    REG_PRINT,                    // rk
+    REG_JUMP,                     // target
+    REG_JUMP_IF_FALSE,            // rk, target
+    REG_EQUAL_JUMP_IF_FALSE,      // rk, rk, target, top
+    REG_NOT_EQUAL_JUMP_IF_FALSE,  // rk, rk, target, top
+    REG_LESS_JUMP_IF_FALSE,       // rk, rk, target
+    REG_LESS_EQUAL_JUMP_IF_FALSE, // rk, rk, target
+    REG_GREATER_JUMP_IF_FALSE,    // rk, rk, target
+    REG_GREATER_EQUAL_JUMP_IF_FALSE, // rk, rk, target
+    REG_CALL,                     // base, argCount
+    REG_TAIL_CALL,                // base, argCount
+    REG_INVOKE,                   // base, name, argCount, cache
+    REG_SUPER_INVOKE,             // base, name, argCount
+    REG_CLOSURE,                  // dst, function, { isLocal, index }
+    REG_CLOSE_UPVALUE,            // register
+    REG_RETURN,                   // rk
+    REG_CLASS,                    // dst, name
+    REG_INHERIT,                  // base
+    REG_METHOD                    // base, name
+} RegisterOpCode;
+
+#define RK_CONSTANT 0x80000000u
+
+typedef struct
+{
+    int count;
+    int capacity;
+    uint32_t* code;
+    // Offset of the stack instruction each unit came from, for line
+    // numbers in runtime errors.
+    int* origins;
+} RegisterCode;
+
+#define INLINE_CACHE_WAYS 4
+
+typedef struct
+{
+    // Receiver shape the entry was filled for.
+    ObjShape* shape;
+    // OP_SET_PROPERTY only: the shape after adding the field, or NULL if
+    // the field already existed.
+    ObjShape* transition;
+    // ObjClass.version the method was looked up in.
+    uint32_t version;
+    // Field slot in the instance, or -1 for a method.
+    int slot;
+    Value method;
+} CacheEntry;
+
+// One per property access or invoke site. Entries are filled in the order
+// the site sees new receivers, so a monomorphic site always hits the first
+// one; once all ways are taken the oldest entry is replaced.
+typedef struct
+{
+    CacheEntry entries[INLINE_CACHE_WAYS];
+    int count;
+} InlineCache;
+
+// Start of a run of bytecode that came from the same source line. Lines
+// are stored run-length encoded: a new entry is only added when the line
+// changes, so a statement costs one entry instead of one int per byte.
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct
 {
 	int count;
 	int capacity;
 	uint8_t* code;
-	int* lines;
+    // Set when code points into a mapped bytecode image instead of a
+    // buffer we allocated, so FreeChunk leaves it alone and Run() never
+    // quickens it: the image is mapped read-only.
+    bool borrowsCode;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
 	ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    // Empty until the function is first called in register mode.
+    RegisterCode registers;
 } Chunk;
 
 void InitChunk(Chunk* chunk);
 void FreeChunk(Chunk* chunk);
 void WriteChunk(Chunk* chunk, uint8_t byte, int line);
 int AddConstant(Chunk* chunk, Value value);
+void TruncateChunk(Chunk* chunk, int count);
+int GetLine(Chunk* chunk, int offset);
+int AddInlineCache(Chunk* chunk);
 
 #endif
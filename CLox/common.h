@@ -6,12 +6,64 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+
+// Threaded dispatch in Run() needs the labels-as-values extension, so only
+// GCC and Clang get it. Everything else uses the portable switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// Probe hash tables sixteen control bytes at a time with SSE2 where the
+// target has it. Elsewhere the bytes are checked one at a time.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TABLE_SSE2
+#endif
+
+// Collect objects allocated since the last collection on their own most
+// of the time, instead of tracing the whole heap. See WRITE_BARRIER.
+#define GENERATIONAL_GC
+
+// Run full collections a step at a time, interleaved with the program,
+// instead of in one long pause. A step stops once it has run for
+// GC_PAUSE_BUDGET_US microseconds.
+#define INCREMENTAL_GC
+#ifndef GC_PAUSE_BUDGET_US
+#define GC_PAUSE_BUDGET_US 1000
+#endif
+
+// Let the parts of a collection that stop the program trace the heap on
+// several threads at once. vm.markThreads says how many; it starts at the
+// processor count, up to GC_MAX_MARK_THREADS.
+#define PARALLEL_MARKING
+#define GC_MAX_MARK_THREADS 16
+
+// Let Run() rewrite arithmetic and comparison instructions into forms
+// specialized for the operand types each one has seen.
+#define QUICKENING
+
+// Compile hot functions to x86-64 machine code. The compiled code works on
+// the bits of NaN-boxed values and follows the System V calling
+// convention, so everywhere else everything stays interpreted.
+#if defined(NAN_BOXING) && defined(__x86_64__) && !defined(_WIN32)
+#define JIT
+#endif
+
+// Carve objects out of large slabs, one free list per size, instead of
+// asking malloc for each. Turn it off to let ASan see objects one by one.
+#define POOL_ALLOCATOR
+
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 
+// Count the instructions the VM runs and print the total on exit.
+//#define DEBUG_COUNT_INSTRUCTIONS
+
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
 
 #endif
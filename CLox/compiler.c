@@ -5,7 +5,9 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -52,7 +54,7 @@ typedef struct
 
 typedef struct
 {
-    uint8_t index;
+    int index;
     bool isLocal;
 } Upvalue;
 
@@ -70,10 +72,18 @@ typedef struct Compiler
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int scopeDepth;
+    // Offset of the literal the last expression compiled to, or -1. Only
+    // meaningful while that literal is still the last thing in the chunk.
+    int constantStart;
+    // Offset of the last OP_CALL emitted, or -1. A return whose value is
+    // that call turns it into a tail call.
+    int callStart;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -178,12 +188,28 @@ static void EmitLoop(int loopStart)
     EmitByte(OP_LOOP);
 
     int offset = CurrentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) { Error("loop body too large."); }
+    if (offset > UINT16_MAX) { Error("Loop body too large."); }
 
     EmitByte((offset >> 8) & 0xff);
     EmitByte(offset & 0xff);
 }
 
+// Emits op with a one-byte operand when it fits, otherwise longOp with a
+// 24-bit big-endian operand.
+static void EmitOperand(uint8_t op, uint8_t longOp, int operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        EmitBytes(op, (uint8_t)operand);
+        return;
+    }
+
+    EmitByte(longOp);
+    EmitByte((operand >> 16) & 0xff);
+    EmitByte((operand >> 8) & 0xff);
+    EmitByte(operand & 0xff);
+}
+
 static int EmitJump(uint8_t instruction)
 {
     EmitByte(instruction);
@@ -206,21 +232,134 @@ static void EmitReturn()
 	EmitByte(OP_RETURN);
 }
 
-static uint8_t MakeConstant(Value value)
+static int MakeConstant(Value value)
 {
 	int constant = AddConstant(CurrentChunk(), value);
-	if (constant > UINT8_MAX)
+	WRITE_BARRIER(current->function, value);
+	if (constant > UINT24_MAX)
 	{
 		Error("Too many constants in one chunk.");
 		return 0;
 	}
 
-	return (uint8_t)constant;
+	return constant;
 }
 
 static void EmitConstant(Value value)
 {
-	EmitBytes(OP_CONSTANT, MakeConstant(value));
+	EmitOperand(OP_CONSTANT, OP_CONSTANT_LONG, MakeConstant(value));
+}
+
+// Emits a value known at compile time and remembers it as a candidate for
+// constant folding.
+static void EmitValue(Value value)
+{
+    int start = CurrentChunk()->count;
+    if (IS_NIL(value))
+    {
+        EmitByte(OP_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        EmitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        EmitConstant(value);
+    }
+    current->constantStart = start;
+}
+
+// True if the code just emitted ends with a single literal instruction
+// that nothing jumps past, in which case its offset and value are
+// returned.
+static bool TrailingConstant(int* start, Value* value)
+{
+    int offset = current->constantStart;
+    Chunk* chunk = CurrentChunk();
+    if (offset == -1 || offset >= chunk->count) { return false; }
+
+    int end;
+    switch (chunk->code[offset])
+    {
+        case OP_NIL:   *value = NIL_VAL; end = offset + 1; break;
+        case OP_TRUE:  *value = BOOL_VAL(true); end = offset + 1; break;
+        case OP_FALSE: *value = BOOL_VAL(false); end = offset + 1; break;
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[offset + 1]];
+            end = offset + 2;
+            break;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants.values[
+                (chunk->code[offset + 1] << 16) |
+                (chunk->code[offset + 2] << 8) |
+                chunk->code[offset + 3]];
+            end = offset + 4;
+            break;
+        default:
+            return false;
+    }
+
+    if (end != chunk->count) { return false; }
+
+    *start = offset;
+    return true;
+}
+
+// Where the operand naming an instruction's inline cache starts, or 0 if
+// it has none.
+static int CacheOperand(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 2;
+        case OP_INVOKE:
+            return 3;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+            return 4;
+        case OP_INVOKE_LONG:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+// Throws away everything emitted from offset on. Used for folded operands
+// and statically dead code, which is still compiled for its errors.
+static void DiscardCode(int offset)
+{
+    // Caches are handed out in code order, so the discarded code's are the
+    // last ones, from the first it uses on.
+    Chunk* chunk = CurrentChunk();
+    for (int at = offset; at < chunk->count;
+         at += InstructionLength(chunk, at))
+    {
+        int operand = CacheOperand(chunk->code[at]);
+        if (operand != 0)
+        {
+            chunk->cacheCount = (chunk->code[at + operand] << 8) |
+                                chunk->code[at + operand + 1];
+            break;
+        }
+    }
+
+    TruncateChunk(chunk, offset);
+    current->constantStart = -1;
+    current->callStart = -1;
+}
+
+static void EmitInlineCache()
+{
+    int cache = AddInlineCache(CurrentChunk());
+    if (cache > UINT16_MAX)
+    {
+        Error("Too many property accesses in one chunk.");
+    }
+
+    EmitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void PatchJump(int offset)
@@ -235,6 +374,23 @@ static void PatchJump(int offset)
 
     CurrentChunk()->code[offset] = (jump >> 8) & 0xff;
     CurrentChunk()->code[offset + 1] = jump & 0xff;
+
+    // Something now lands after the last instruction, so whatever value it
+    // left behind is no longer the only one that can be on the stack.
+    current->constantStart = -1;
+}
+
+static Local* PushLocal()
+{
+    if (current->localCapacity < current->localCount + 1)
+    {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals,
+                                     oldCapacity, current->localCapacity);
+    }
+
+    return &current->locals[current->localCount++];
 }
 
 static void InitCompiler(Compiler* compiler, FunctionType type)
@@ -242,8 +398,14 @@ static void InitCompiler(Compiler* compiler, FunctionType type)
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->constantStart = -1;
+    compiler->callStart = -1;
     compiler->function = NewFunction();
     current = compiler;
 
@@ -251,9 +413,10 @@ static void InitCompiler(Compiler* compiler, FunctionType type)
     {
         current->function->name = CopyString(parser.previous.start,
                                              parser.previous.length);
+        WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = PushLocal();
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION)
@@ -273,6 +436,13 @@ static ObjFunction* EndCompiler()
 	EmitReturn();
     ObjFunction* function = current->function;
 
+    if (!parser.hadError)
+    {
+        OptimizeChunk(CurrentChunk());
+        function->slotCount = MaxStackDepth(CurrentChunk(),
+                                            function->arity + 1);
+    }
+
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError)
 	{
@@ -281,6 +451,7 @@ static ObjFunction* EndCompiler()
 	}
 #endif
 
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
     current = current->enclosing;
     return function;
 }
@@ -316,11 +487,23 @@ static void Declaration();
 static ParseRule* GetRule(TokenType type);
 static void ParsePrecedence(Precedence precedence);
 
-static uint8_t IdentifierConstant(Token* name)
+static int IdentifierConstant(Token* name)
 {
     return MakeConstant(OBJ_VAL(CopyString(name->start, name->length)));
 }
 
+static int GlobalVariable(Token* name)
+{
+    int slot = ResolveGlobal(CopyString(name->start, name->length));
+    if (slot > UINT24_MAX)
+    {
+        Error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 static bool IdentifiersEqual(Token* a, Token* b)
 {
     if (a->length != b->length) { return false; }
@@ -345,7 +528,7 @@ static int ResolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int AddUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int AddUpvalue(Compiler* compiler, int index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -358,12 +541,21 @@ static int AddUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
         }
     }
 
-    if (upvalueCount == UINT8_COUNT)
+    if (upvalueCount == UINT24_COUNT)
     {
         Error("Too many closure variables in function.");
         return 0;
     }
 
+    if (compiler->upvalueCapacity < upvalueCount + 1)
+    {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity,
+                                        compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -377,13 +569,13 @@ static int ResolveUpvalue(Compiler* compiler, Token* name)
     if (local != -1)
     {
         compiler->enclosing->locals[local].isCaptured = true;
-        return AddUpvalue(compiler, (uint8_t)local, true);
+        return AddUpvalue(compiler, local, true);
     }
 
     int upvalue = ResolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return AddUpvalue(compiler, (uint8_t)upvalue, false);
+        return AddUpvalue(compiler, upvalue, false);
     }
 
     return -1;
@@ -391,13 +583,13 @@ static int ResolveUpvalue(Compiler* compiler, Token* name)
 
 static void AddLocal(Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (current->localCount == UINT24_COUNT)
     {
         Error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = PushLocal();
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -425,14 +617,14 @@ static void DeclareVariable()
     AddLocal(*name);
 }
 
-static uint8_t ParseVariable(const char* errorMessage)
+static int ParseVariable(const char* errorMessage)
 {
     Consume(TOKEN_IDENTIFIER, errorMessage);
 
     DeclareVariable();
     if (current->scopeDepth > 0) { return 0; }
 
-    return IdentifierConstant(&parser.previous);
+    return GlobalVariable(&parser.previous);
 }
 
 static void MarkInitialized()
@@ -441,7 +633,7 @@ static void MarkInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void DefineVariable(uint8_t global)
+static void DefineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
@@ -449,7 +641,7 @@ static void DefineVariable(uint8_t global)
         return;
     }
 
-    EmitBytes(OP_DEFINE_GLOBAL, global);
+    EmitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static uint8_t ArgumentList()
@@ -473,8 +665,91 @@ static uint8_t ArgumentList()
     return argCount;
 }
 
+static bool IsFalsey(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Computes a binary operator on two literals the way the VM would. Leaves
+// anything that would be a runtime error to the VM.
+static bool FoldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result)
+{
+    switch (operatorType)
+    {
+        case TOKEN_EQUAL_EQUAL:
+            *result = BOOL_VAL(ValuesEqual(a, b));
+            return true;
+        case TOKEN_BANG_EQUAL:
+            *result = BOOL_VAL(!ValuesEqual(a, b));
+            return true;
+        default:
+            break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+    {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+
+        // Folded at compile time, so interned like any other literal.
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+
+        *result = OBJ_VAL(CopyString(chars, length));
+        FREE_ARRAY(char, chars, length);
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { return false; }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType)
+    {
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        default:
+            return false;
+    }
+}
+
+// With a literal on the left, "and" and "or" are decided at compile time:
+// either the result is the left operand and the right one is dead, or it
+// is the right operand alone.
+static bool FoldLogical(bool shortCircuitsOnFalse, Precedence precedence)
+{
+    int leftStart;
+    Value left;
+    if (!TrailingConstant(&leftStart, &left)) { return false; }
+
+    if (IsFalsey(left) == shortCircuitsOnFalse)
+    {
+        int rightStart = CurrentChunk()->count;
+        ParsePrecedence(precedence);
+        DiscardCode(rightStart);
+        current->constantStart = leftStart;
+    }
+    else
+    {
+        DiscardCode(leftStart);
+        ParsePrecedence(precedence);
+    }
+    return true;
+}
+
 static void And(bool canAssign)
 {
+    if (FoldLogical(true, PREC_AND)) { return; }
+
     int endJump = EmitJump(OP_JUMP_IF_FALSE);
 
     EmitByte(OP_POP);
@@ -488,17 +763,34 @@ static void Binary(bool canAssign)
 	// Remember the operator.
 	TokenType operatorType = parser.previous.type;
 
+    int leftStart;
+    Value left;
+    bool isLeftConstant = TrailingConstant(&leftStart, &left);
+    int rightStart = CurrentChunk()->count;
+
 	// Compile the right operand.
 	ParseRule* rule = GetRule(operatorType);
 	ParsePrecedence((Precedence)(rule->precedence + 1));
 
+    int start;
+    Value right;
+    Value result;
+    if (isLeftConstant && TrailingConstant(&start, &right) &&
+        start == rightStart &&
+        FoldBinary(operatorType, left, right, &result))
+    {
+        DiscardCode(leftStart);
+        EmitValue(result);
+        return;
+    }
+
 	// Emit the operator instruction.
 	switch (operatorType)
 	{
 		case TOKEN_BANG_EQUAL:    EmitBytes(OP_EQUAL, OP_NOT); break;
 		case TOKEN_EQUAL_EQUAL:   EmitByte(OP_EQUAL); break;
 		case TOKEN_GREATER:       EmitByte(OP_GREATER); break;
-		case TOKEN_GREATER_EQUAL: EmitBytes(OP_LESS, OP_NEGATE); break;
+		case TOKEN_GREATER_EQUAL: EmitBytes(OP_LESS, OP_NOT); break;
 		case TOKEN_LESS:          EmitByte(OP_LESS); break;
 		case TOKEN_LESS_EQUAL:    EmitBytes(OP_GREATER, OP_NOT); break;
 		case TOKEN_PLUS:          EmitByte(OP_ADD); break;
@@ -513,28 +805,32 @@ static void Binary(bool canAssign)
 static void Call(bool canAssign)
 {
     uint8_t argCount = ArgumentList();
+    current->callStart = CurrentChunk()->count;
     EmitBytes(OP_CALL, argCount);
 }
 
 static void Dot(bool canAssign)
 {
     Consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = IdentifierConstant(&parser.previous);
+    int name = IdentifierConstant(&parser.previous);
 
     if (canAssign && Match(TOKEN_EQUAL))
     {
         Expression();
-        EmitBytes(OP_SET_PROPERTY, name);
+        EmitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+        EmitInlineCache();
     }
     else if (Match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = ArgumentList();
-        EmitBytes(OP_INVOKE, name);
+        EmitOperand(OP_INVOKE, OP_INVOKE_LONG, name);
         EmitByte(argCount);
+        EmitInlineCache();
     }
     else
     {
-        EmitBytes(OP_GET_PROPERTY, name);
+        EmitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        EmitInlineCache();
     }
 }
 
@@ -542,9 +838,9 @@ static void Literal(bool canAssign)
 {
 	switch (parser.previous.type)
 	{
-		case TOKEN_FALSE: EmitByte(OP_FALSE); break;
-		case TOKEN_NIL: EmitByte(OP_NIL); break;
-		case TOKEN_TRUE: EmitByte(OP_TRUE); break;
+		case TOKEN_FALSE: EmitValue(BOOL_VAL(false)); break;
+		case TOKEN_NIL: EmitValue(NIL_VAL); break;
+		case TOKEN_TRUE: EmitValue(BOOL_VAL(true)); break;
 		default:
 			return; // Unreachable.
 	}
@@ -559,11 +855,13 @@ static void Grouping(bool canAssign)
 static void Number(bool canAssign)
 {
 	double value = strtod(parser.previous.start, NULL);
-	EmitConstant(NUMBER_VAL(value));
+	EmitValue(NUMBER_VAL(value));
 }
 
 static void Or(bool canAssign)
 {
+    if (FoldLogical(false, PREC_OR)) { return; }
+
     int elseJump = EmitJump(OP_JUMP_IF_FALSE);
     int endJump = EmitJump(OP_JUMP);
 
@@ -576,39 +874,45 @@ static void Or(bool canAssign)
 
 static void String(bool canAssign)
 {
-    EmitConstant(OBJ_VAL(CopyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+    EmitValue(OBJ_VAL(CopyString(parser.previous.start + 1,
+                                 parser.previous.length - 2)));
 }
 
 static void NamedVariable(Token name, bool canAssign)
 {
-    uint8_t getOp, setOp;
+    uint8_t getOp, setOp, getLongOp, setLongOp;
     int arg = ResolveLocal(current, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
     }
     else if ((arg = ResolveUpvalue(current, &name)) != -1)
     {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
+        getLongOp = OP_GET_UPVALUE_LONG;
+        setLongOp = OP_SET_UPVALUE_LONG;
     }
     else
     {
-        arg = IdentifierConstant(&name);
+        arg = GlobalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
     if (canAssign && Match(TOKEN_EQUAL))
     {
         Expression();
-        EmitBytes(setOp, arg);
+        EmitOperand(setOp, setLongOp, arg);
     }
     else
     {
-        EmitBytes(getOp, arg);
+        EmitOperand(getOp, getLongOp, arg);
     }
 }
 
@@ -638,20 +942,20 @@ static void Super(bool canAssign)
 
     Consume(TOKEN_DOT, "Expect '.' after 'super'.");
     Consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = IdentifierConstant(&parser.previous);
+    int name = IdentifierConstant(&parser.previous);
 
     NamedVariable(SynthethicToken("this"), false);
     if (Match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = ArgumentList();
         NamedVariable(SynthethicToken("super"), false);
-        EmitBytes(OP_SUPER_INVOKE, name);
+        EmitOperand(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         EmitByte(argCount);
     }
     else
     {
         NamedVariable(SynthethicToken("super"), false);
-        EmitBytes(OP_GET_SUPER, name);
+        EmitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -668,10 +972,29 @@ static void This(bool canAssign)
 static void Unary(bool canAssign)
 {
 	TokenType operatorType = parser.previous.type;
+    int operandStart = CurrentChunk()->count;
 
 	// Compile the operand.
 	ParsePrecedence(PREC_UNARY);
 
+    int start;
+    Value operand;
+    if (TrailingConstant(&start, &operand) && start == operandStart)
+    {
+        if (operatorType == TOKEN_BANG)
+        {
+            DiscardCode(start);
+            EmitValue(BOOL_VAL(IsFalsey(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand))
+        {
+            DiscardCode(start);
+            EmitValue(NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
 	// Emit the oeprator instruction.
 	switch (operatorType)
 	{
@@ -790,7 +1113,7 @@ static void Function(FunctionType type)
                 ErrorAtCurrent("Can't have more than 255 parameters.");
             }
 
-            uint8_t paramConstant = ParseVariable(
+            int paramConstant = ParseVariable(
                     "Expect parameter name.");
             DefineVariable(paramConstant);
         } while (Match(TOKEN_COMMA));
@@ -803,19 +1126,46 @@ static void Function(FunctionType type)
 
     // Create the function object.
     ObjFunction* function = EndCompiler();
-    EmitBytes(OP_CLOSURE, MakeConstant(OBJ_VAL(function)));
+    int constant = MakeConstant(OBJ_VAL(function));
+
+    // The upvalue indexes share the width of the function constant.
+    bool isLong = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        if (compiler.upvalues[i].index > UINT8_MAX) { isLong = true; }
+    }
+
+    if (isLong)
+    {
+        EmitByte(OP_CLOSURE_LONG);
+        EmitByte((constant >> 16) & 0xff);
+        EmitByte((constant >> 8) & 0xff);
+        EmitByte(constant & 0xff);
+    }
+    else
+    {
+        EmitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
+        int index = compiler.upvalues[i].index;
         EmitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        EmitByte(compiler.upvalues[i].index);
+        if (isLong)
+        {
+            EmitByte((index >> 16) & 0xff);
+            EmitByte((index >> 8) & 0xff);
+        }
+        EmitByte(index & 0xff);
     }
+
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 static void Method()
 {
     Consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = IdentifierConstant(&parser.previous);
+    int constant = IdentifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
@@ -825,18 +1175,18 @@ static void Method()
     }
 
     Function(type);
-    EmitBytes(OP_METHOD, constant);
+    EmitOperand(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void ClassDeclaration()
 {
     Consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = IdentifierConstant(&parser.previous);
+    int nameConstant = IdentifierConstant(&parser.previous);
     DeclareVariable();
 
-    EmitBytes(OP_CLASS, nameConstant);
-    DefineVariable(nameConstant);
+    EmitOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    DefineVariable(current->scopeDepth > 0 ? 0 : GlobalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -881,7 +1231,7 @@ static void ClassDeclaration()
 
 static void FunDeclaration()
 {
-    uint8_t global = ParseVariable("Expect function name.");
+    int global = ParseVariable("Expect function name.");
     MarkInitialized();
     Function(TYPE_FUNCTION);
     DefineVariable(global);
@@ -889,7 +1239,7 @@ static void FunDeclaration()
 
 static void VarDeclaration()
 {
-	uint8_t global = ParseVariable("Expect variable name.");
+	int global = ParseVariable("Expect variable name.");
 
 	if (Match(TOKEN_EQUAL))
 	{
@@ -975,6 +1325,28 @@ static void IfStatement()
     Expression();
     Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    int conditionStart;
+    Value condition;
+    if (TrailingConstant(&conditionStart, &condition))
+    {
+        // Only one branch can ever run. The other is still compiled so
+        // its errors get reported, then thrown away.
+        DiscardCode(conditionStart);
+        bool isTrue = !IsFalsey(condition);
+
+        int thenStart = CurrentChunk()->count;
+        Statement();
+        if (!isTrue) { DiscardCode(thenStart); }
+
+        if (Match(TOKEN_ELSE))
+        {
+            int elseStart = CurrentChunk()->count;
+            Statement();
+            if (isTrue) { DiscardCode(elseStart); }
+        }
+        return;
+    }
+
     int thenJump = EmitJump(OP_JUMP_IF_FALSE);
     EmitByte(OP_POP);
     Statement();
@@ -1015,6 +1387,15 @@ static void ReturnStatement()
 
         Expression();
         Consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // Anything that jumps past the call lands on the OP_RETURN, so
+        // the call is only ever followed by the return.
+        Chunk* chunk = CurrentChunk();
+        if (current->callStart == chunk->count - 2 &&
+            chunk->code[current->callStart] == OP_CALL)
+        {
+            chunk->code[current->callStart] = OP_TAIL_CALL;
+        }
         EmitByte(OP_RETURN);
     }
 }
@@ -1027,6 +1408,25 @@ static void WhileStatement()
     Expression();
     Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    int conditionStart;
+    Value condition;
+    if (TrailingConstant(&conditionStart, &condition))
+    {
+        // The condition is never tested: the body either loops forever
+        // or never runs at all.
+        DiscardCode(conditionStart);
+        Statement();
+        if (IsFalsey(condition))
+        {
+            DiscardCode(loopStart);
+        }
+        else
+        {
+            EmitLoop(loopStart);
+        }
+        return;
+    }
+
     int exitJump = EmitJump(OP_JUMP_IF_FALSE);
 
     EmitByte(OP_POP);
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void DisassembleChunk(Chunk* chunk, const char* name)
 {
@@ -14,6 +15,13 @@ void DisassembleChunk(Chunk* chunk, const char* name)
 	}
 }
 
+static int ReadLong(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 16) |
+           (chunk->code[offset + 1] << 8) |
+           chunk->code[offset + 2];
+}
+
 static int ConstantInstruction(const char* name, Chunk* chunk, int offset)
 {
 	uint8_t constant = chunk->code[offset + 1];
@@ -23,6 +31,16 @@ static int ConstantInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 2;
 }
 
+static int ConstantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset)
+{
+    int constant = ReadLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    PrintValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int InvokeInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -33,6 +51,40 @@ static int InvokeInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int InvokeLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = ReadLong(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    PrintValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5;
+}
+
+static int CachedInstruction(int(*instruction)(const char*, Chunk*, int),
+                             const char* name, Chunk* chunk, int offset)
+{
+    int next = instruction(name, chunk, offset);
+    uint16_t cache = (uint16_t)(chunk->code[next] << 8);
+    cache |= chunk->code[next + 1];
+    printf("%04d      |                     cache %d\n", next, cache);
+    return next + 2;
+}
+
+static int GlobalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d '%s'\n", name, slot, GlobalName(slot)->chars);
+    return offset + 2;
+}
+
+static int GlobalLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int slot = ReadLong(chunk, offset + 1);
+    printf("%-16s %4d '%s'\n", name, slot, GlobalName(slot)->chars);
+    return offset + 4;
+}
+
 static int SimpleInstruction(const char* name, int offset)
 {
 	printf("%s\n", name);
@@ -46,6 +98,48 @@ static int ByteInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int LongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int slot = ReadLong(chunk, offset + 1);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 4;
+}
+
+static int ClosureInstruction(const char* name, bool isLong,
+                              Chunk* chunk, int offset)
+{
+    int constant = isLong ? ReadLong(chunk, offset + 1)
+                          : chunk->code[offset + 1];
+    offset += isLong ? 4 : 2;
+    printf("%-16s %4d ", name, constant);
+    PrintValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++)
+    {
+        int start = offset;
+        int isLocal = chunk->code[offset++];
+        int index = isLong ? ReadLong(chunk, offset) : chunk->code[offset];
+        offset += isLong ? 3 : 1;
+        printf("%04d      |                     %s %d\n",
+            start, isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+}
+
+static int AddLocalConstInstruction(const char* name, Chunk* chunk,
+                                    int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d += '", name, slot);
+    PrintValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int JumpInstruction(const char* name, int sign,
                            Chunk* chunk, int offset)
 {
@@ -59,13 +153,14 @@ static int JumpInstruction(const char* name, int sign,
 int DisassembleInstruction(Chunk* chunk, int offset)
 {
 	printf("%04d ", offset);
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = GetLine(chunk, offset);
+	if (offset > 0 && line == GetLine(chunk, offset - 1))
 	{
 		printf("   | ");
 	}
 	else
 	{
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -86,19 +181,21 @@ int DisassembleInstruction(Chunk* chunk, int offset)
         case OP_SET_LOCAL:
             return ByteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return GlobalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return GlobalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return GlobalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return ByteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return ByteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return ConstantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return CachedInstruction(ConstantInstruction,
+                                     "OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return ConstantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return CachedInstruction(ConstantInstruction,
+                                     "OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return ConstantInstruction("OP_GET_SUPER", chunk, offset);
 		case OP_EQUAL:
@@ -129,30 +226,15 @@ int DisassembleInstruction(Chunk* chunk, int offset)
             return JumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return ByteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return ByteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return InvokeInstruction("OP_INVOKE", chunk, offset);
+            return CachedInstruction(InvokeInstruction,
+                                     "OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return InvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE:
-        {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            PrintValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(
-                chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++)
-            {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",
-                    offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
-        }
+            return ClosureInstruction("OP_CLOSURE", false, chunk, offset);
         case OP_CLOSE_UPVALUE:
             return SimpleInstruction("OP_CLOSE_UPVALUE", offset);
 		case OP_RETURN:
@@ -163,8 +245,219 @@ int DisassembleInstruction(Chunk* chunk, int offset)
             return SimpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return ConstantInstruction("OP_METHOD", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return ConstantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return LongInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return LongInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return GlobalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return GlobalLongInstruction("OP_DEFINE_GLOBAL_LONG",
+                                         chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return GlobalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_UPVALUE_LONG:
+            return LongInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return LongInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return CachedInstruction(ConstantLongInstruction,
+                                     "OP_GET_PROPERTY_LONG", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return CachedInstruction(ConstantLongInstruction,
+                                     "OP_SET_PROPERTY_LONG", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return ConstantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_INVOKE_LONG:
+            return CachedInstruction(InvokeLongInstruction,
+                                     "OP_INVOKE_LONG", chunk, offset);
+        case OP_SUPER_INVOKE_LONG:
+            return InvokeLongInstruction("OP_SUPER_INVOKE_LONG",
+                                         chunk, offset);
+        case OP_CLOSURE_LONG:
+            return ClosureInstruction("OP_CLOSURE_LONG", true, chunk, offset);
+        case OP_CLASS_LONG:
+            return ConstantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return ConstantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_NOT_EQUAL:
+            return SimpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return SimpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return SimpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_ADD_LOCAL_CONST:
+            return AddLocalConstInstruction("OP_ADD_LOCAL_CONST",
+                                            chunk, offset);
+        case OP_EQUAL_JUMP_IF_FALSE:
+            return JumpInstruction("OP_EQUAL_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            return JumpInstruction("OP_NOT_EQUAL_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return JumpInstruction("OP_LESS_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+            return JumpInstruction("OP_LESS_EQUAL_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_GREATER_JUMP_IF_FALSE:
+            return JumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            return JumpInstruction("OP_GREATER_EQUAL_JUMP_IF_FALSE", 1,
+                                   chunk, offset);
+        case OP_ADD_NUM:
+            return SimpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return SimpleInstruction("OP_ADD_STR", offset);
+        case OP_LESS_NUM:
+            return SimpleInstruction("OP_LESS_NUM", offset);
+        case OP_GREATER_NUM:
+            return SimpleInstruction("OP_GREATER_NUM", offset);
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
 	}
 }
+
+
+void DisassembleRegisters(Chunk* chunk, const char* name)
+{
+    printf("== %s (registers) ==\n", name);
+
+    for (int offset = 0; offset < chunk->registers.count;)
+    {
+        offset = DisassembleRegisterInstruction(chunk, offset);
+    }
+}
+
+static void PrintOperand(Chunk* chunk, uint32_t operand)
+{
+    if (operand & RK_CONSTANT)
+    {
+        printf(" k%u '", operand & ~RK_CONSTANT);
+        PrintValue(chunk->constants.values[operand & ~RK_CONSTANT]);
+        printf("'");
+    }
+    else
+    {
+        printf(" r%u", operand);
+    }
+}
+
+static void PrintName(Chunk* chunk, uint32_t constant)
+{
+    printf(" '");
+    PrintValue(chunk->constants.values[constant]);
+    printf("'");
+}
+
+// Operand kinds, one letter each: r a register, k a register or constant,
+// n a constant shown by value, i a plain number, j a jump target.
+static int RegisterInstruction(const char* name, const char* operands,
+                               Chunk* chunk, int offset)
+{
+    uint32_t* code = chunk->registers.code;
+    printf("%-32s", name);
+    int unit = offset + 1;
+    for (const char* kind = operands; *kind != '\0'; kind++, unit++)
+    {
+        switch (*kind)
+        {
+            case 'r': printf(" r%u", code[unit]); break;
+            case 'k': PrintOperand(chunk, code[unit]); break;
+            case 'n': PrintName(chunk, code[unit]); break;
+            case 'i': printf(" %u", code[unit]); break;
+            case 'j': printf(" -> %04u", code[unit]); break;
+        }
+    }
+    printf("\n");
+    return unit;
+}
+
+static int RegisterClosure(Chunk* chunk, int offset)
+{
+    uint32_t* code = chunk->registers.code;
+    int next = RegisterInstruction("REG_CLOSURE", "rn", chunk, offset);
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[offset + 2]]);
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        printf("%04d      |                     %s %u\n", next,
+               code[next] ? "local" : "upvalue", code[next + 1]);
+        next += 2;
+    }
+    return next;
+}
+
+int DisassembleRegisterInstruction(Chunk* chunk, int offset)
+{
+    printf("%04d ", offset);
+    int* origins = chunk->registers.origins;
+    int line = GetLine(chunk, origins[offset]);
+    if (offset > 0 && line == GetLine(chunk, origins[offset - 1]))
+    {
+        printf("   | ");
+    }
+    else
+    {
+        printf("%4d ", line);
+    }
+
+#define OPERANDS(op, operands) \
+    case op: return RegisterInstruction(#op, operands, chunk, offset)
+
+    uint32_t instruction = chunk->registers.code[offset];
+    switch (instruction)
+    {
+        OPERANDS(REG_MOVE, "rk");
+        OPERANDS(REG_GET_GLOBAL, "ri");
+        OPERANDS(REG_DEFINE_GLOBAL, "ik");
+        OPERANDS(REG_SET_GLOBAL, "ik");
+        OPERANDS(REG_GET_UPVALUE, "ri");
+        OPERANDS(REG_SET_UPVALUE, "ik");
+        OPERANDS(REG_GET_PROPERTY, "rknii");
+        OPERANDS(REG_SET_PROPERTY, "rkkni");
+        OPERANDS(REG_GET_SUPER, "rn");
+        OPERANDS(REG_EQUAL, "rkki");
+        OPERANDS(REG_NOT_EQUAL, "rkki");
+        OPERANDS(REG_GREATER, "rkk");
+        OPERANDS(REG_GREATER_EQUAL, "rkk");
+        OPERANDS(REG_LESS, "rkk");
+        OPERANDS(REG_LESS_EQUAL, "rkk");
+        OPERANDS(REG_ADD, "rkki");
+        OPERANDS(REG_SUBTRACT, "rkk");
+        OPERANDS(REG_MULTIPLY, "rkk");
+        OPERANDS(REG_DIVIDE, "rkk");
+        OPERANDS(REG_NOT, "rk");
+        OPERANDS(REG_NEGATE, "rk");
+        OPERANDS(REG_PRINT, "k");
+        OPERANDS(REG_JUMP, "j");
+        OPERANDS(REG_JUMP_IF_FALSE, "kj");
+        OPERANDS(REG_EQUAL_JUMP_IF_FALSE, "kkji");
+        OPERANDS(REG_NOT_EQUAL_JUMP_IF_FALSE, "kkji");
+        OPERANDS(REG_LESS_JUMP_IF_FALSE, "kkj");
+        OPERANDS(REG_LESS_EQUAL_JUMP_IF_FALSE, "kkj");
+        OPERANDS(REG_GREATER_JUMP_IF_FALSE, "kkj");
+        OPERANDS(REG_GREATER_EQUAL_JUMP_IF_FALSE, "kkj");
+        OPERANDS(REG_CALL, "ri");
+        OPERANDS(REG_TAIL_CALL, "ri");
+        OPERANDS(REG_INVOKE, "rnii");
+        OPERANDS(REG_SUPER_INVOKE, "rni");
+        OPERANDS(REG_CLOSE_UPVALUE, "r");
+        OPERANDS(REG_RETURN, "k");
+        OPERANDS(REG_CLASS, "rn");
+        OPERANDS(REG_INHERIT, "r");
+        OPERANDS(REG_METHOD, "rn");
+        case REG_CLOSURE:
+            return RegisterClosure(chunk, offset);
+        default:
+            printf("Unknown opcode %u\n", instruction);
+            return offset + 1;
+    }
+
+#undef OPERANDS
+}
\ No newline at end of file
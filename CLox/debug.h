@@ -5,5 +5,7 @@
 
 void DisassembleChunk(Chunk* chunk, const char* name);
 int DisassembleInstruction(Chunk* chunk, int offset);
+void DisassembleRegisters(Chunk* chunk, const char* name);
+int DisassembleRegisterInstruction(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
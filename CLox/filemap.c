@@ -0,0 +1,61 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "filemap.h"
+
+uint8_t* MapFile(const char* path, size_t* size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return NULL; }
+
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+	{
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	CloseHandle(file);
+	if (mapping == NULL) { return NULL; }
+
+	// The view keeps the mapping alive on its own.
+	uint8_t* data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*size = (size_t)fileSize.QuadPart;
+	return data;
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0) { return NULL; }
+
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE,
+					file, 0);
+	}
+	close(file);
+	if (data == MAP_FAILED) { return NULL; }
+
+	*size = (size_t)info.st_size;
+	return (uint8_t*)data;
+#endif
+}
+
+void UnmapFile(uint8_t* data, size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
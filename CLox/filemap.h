@@ -0,0 +1,12 @@
+#ifndef clox_filemap_h
+#define clox_filemap_h
+
+#include "common.h"
+
+// Maps a file read-only, so its pages are shared with every other process
+// mapping the same file. Returns NULL if the file can't be mapped,
+// including when it is empty.
+uint8_t* MapFile(const char* path, size_t* size);
+void UnmapFile(uint8_t* data, size_t size);
+
+#endif
@@ -0,0 +1,1258 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// A baseline compiler: each instruction becomes a fixed template of
+// machine code, with no analysis across instructions. The value stack
+// stays in vm.stack exactly as the interpreter would have it, so at the
+// start of every instruction the compiled code and the interpreter agree
+// on the whole state of the frame. That is what lets the interpreter pick
+// a frame up where the compiled code stops, and lets a hot loop move into
+// compiled code halfway through a call.
+//
+// Numbers are handled inline, behind a check that the operands are
+// numbers. Calls, property access, allocation and errors go through the
+// Jit* functions in vm.c.
+
+// Machine registers, numbered as in their encodings.
+typedef enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// Kept in callee-saved registers for the whole run of the code. RAX, RCX,
+// RDX and the XMM registers are scratch, lost across calls to helpers.
+#define SLOTS     RBX // frame->slots
+#define STACK_TOP R12 // vm.stackTop, stored back before each helper call
+#define CONSTANTS R13 // chunk->constants.values
+#define FRAME     R14 // The CallFrame being run.
+#define NAN_MASK  R15 // QNAN, for checking for numbers.
+
+typedef enum
+{
+    CC_ALWAYS = -1,
+    CC_ABOVE_EQUAL = 0x3,
+    CC_EQUAL = 0x4,
+    CC_NOT_EQUAL = 0x5,
+    CC_BELOW_EQUAL = 0x6,
+    CC_ABOVE = 0x7,
+    CC_SIGN = 0x8,
+    CC_NOT_SIGN = 0x9
+} Condition;
+
+// Two-operand instructions of the form "op r/m64, r64".
+#define X86_ADD 0x01
+#define X86_AND 0x21
+#define X86_XOR 0x31
+#define X86_CMP 0x39
+#define X86_TEST 0x85
+#define X86_MOV 0x89
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+#define SET_ABOVE       0x97
+#define SET_BELOW_EQUAL 0x96
+
+typedef int (*JitEntry)(CallFrame* frame, uint8_t* start);
+
+// Compiled functions are packed together into blocks of executable memory
+// rather than mapped a page each: a program's small functions, each at the
+// start of its own page, fetch far slower than the same code side by side.
+#define CODE_BLOCK_SIZE (256 * 1024)
+// Each function starts on a cache line.
+#define CODE_ALIGNMENT 64
+
+typedef struct CodeBlock
+{
+    uint8_t* memory;
+    size_t size;
+    size_t used;
+    // Functions with code in the block that haven't been freed. Their
+    // space isn't reused; the block is unmapped once there are none.
+    int liveCount;
+} CodeBlock;
+
+// Where new code goes, while it has room.
+static CodeBlock* currentBlock = NULL;
+
+// A jump to the code for a bytecode offset that hasn't been compiled yet.
+typedef struct
+{
+    int at;
+    int target;
+} JumpPatch;
+
+typedef struct
+{
+    Chunk* chunk;
+    uint8_t* code;
+    int count;
+    int capacity;
+    JumpPatch* patches;
+    int patchCount;
+    int patchCapacity;
+    // Where compiled callers enter; see Prologue().
+    int directEntry;
+    // Shared exits, compiled right after the prologue.
+    int epilogue;
+    int errorExit;
+    int returnExit;
+} Assembler;
+
+static void Byte(Assembler* as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void Int32(Assembler* as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) { Byte(as, (uint8_t)(value >> (i * 8))); }
+}
+
+static void Int64(Assembler* as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) { Byte(as, (uint8_t)(value >> (i * 8))); }
+}
+
+static void Rex(Assembler* as, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) |
+                  ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) { Byte(as, rex); }
+}
+
+// ModRM for a register operand.
+static void Direct(Assembler* as, int reg, int rm)
+{
+    Byte(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// ModRM for a [base + disp] operand.
+static void Memory(Assembler* as, int reg, int base, int32_t disp)
+{
+    bool small = disp >= -128 && disp <= 127;
+    Byte(as, (small ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) { Byte(as, 0x24); }
+    if (small) { Byte(as, (uint8_t)disp); }
+    else { Int32(as, (uint32_t)disp); }
+}
+
+static void Load(Assembler* as, int dst, int base, int32_t disp)
+{
+    Rex(as, true, dst, base);
+    Byte(as, 0x8b);
+    Memory(as, dst, base, disp);
+}
+
+static void Store(Assembler* as, int base, int32_t disp, int src)
+{
+    Rex(as, true, src, base);
+    Byte(as, 0x89);
+    Memory(as, src, base, disp);
+}
+
+// movsxd dst, dword [base + disp]
+static void LoadInt32(Assembler* as, int dst, int base, int32_t disp)
+{
+    Rex(as, true, dst, base);
+    Byte(as, 0x63);
+    Memory(as, dst, base, disp);
+}
+
+// cmp byte [base + disp], value
+static void CompareByte(Assembler* as, int base, int32_t disp, uint8_t value)
+{
+    Rex(as, false, 0, base);
+    Byte(as, 0x80);
+    Memory(as, 7, base, disp);
+    Byte(as, value);
+}
+
+// mov byte [base + disp], value
+static void StoreByte(Assembler* as, int base, int32_t disp, uint8_t value)
+{
+    Rex(as, false, 0, base);
+    Byte(as, 0xc6);
+    Memory(as, 0, base, disp);
+    Byte(as, value);
+}
+
+// cmp dword [base + disp], value
+static void CompareInt32(Assembler* as, int base, int32_t disp, int8_t value)
+{
+    Rex(as, false, 0, base);
+    Byte(as, 0x83);
+    Memory(as, 7, base, disp);
+    Byte(as, (uint8_t)value);
+}
+
+// inc or dec dword [base + disp]
+static void StepInt32(Assembler* as, int base, int32_t disp, bool up)
+{
+    Rex(as, false, 0, base);
+    Byte(as, 0xff);
+    Memory(as, up ? 0 : 1, base, disp);
+}
+
+static void ShiftLeft(Assembler* as, int reg, uint8_t count)
+{
+    Rex(as, true, 0, reg);
+    Byte(as, 0xc1);
+    Direct(as, 4, reg);
+    Byte(as, count);
+}
+
+// imul reg, reg, value
+static void MultiplyImmediate(Assembler* as, int reg, int32_t value)
+{
+    Rex(as, true, reg, reg);
+    Byte(as, 0x69);
+    Direct(as, reg, reg);
+    Int32(as, (uint32_t)value);
+}
+
+static void MoveImmediate(Assembler* as, int reg, uint64_t value)
+{
+    // A 32-bit move clears the upper half, and is half the size.
+    bool small = value <= UINT32_MAX;
+    Rex(as, !small, 0, reg);
+    Byte(as, 0xb8 + (reg & 7));
+    if (small) { Int32(as, (uint32_t)value); }
+    else { Int64(as, value); }
+}
+
+static void Arith(Assembler* as, uint8_t opcode, int rm, int reg)
+{
+    Rex(as, true, reg, rm);
+    Byte(as, opcode);
+    Direct(as, reg, rm);
+}
+
+static void AddImmediate(Assembler* as, int reg, int32_t value)
+{
+    Rex(as, true, 0, reg);
+    if (value >= -128 && value <= 127)
+    {
+        Byte(as, 0x83);
+        Direct(as, 0, reg);
+        Byte(as, (uint8_t)value);
+    }
+    else
+    {
+        Byte(as, 0x81);
+        Direct(as, 0, reg);
+        Int32(as, (uint32_t)value);
+    }
+}
+
+static void PushRegister(Assembler* as, int reg)
+{
+    Rex(as, false, 0, reg);
+    Byte(as, 0x50 + (reg & 7));
+}
+
+static void PopRegister(Assembler* as, int reg)
+{
+    Rex(as, false, 0, reg);
+    Byte(as, 0x58 + (reg & 7));
+}
+
+static void MoveToXmm(Assembler* as, int xmm, int reg)
+{
+    Byte(as, 0x66);
+    Rex(as, true, xmm, reg);
+    Byte(as, 0x0f);
+    Byte(as, 0x6e);
+    Direct(as, xmm, reg);
+}
+
+static void MoveFromXmm(Assembler* as, int reg, int xmm)
+{
+    Byte(as, 0x66);
+    Rex(as, true, xmm, reg);
+    Byte(as, 0x0f);
+    Byte(as, 0x7e);
+    Direct(as, xmm, reg);
+}
+
+static void ScalarDouble(Assembler* as, uint8_t opcode, int dst, int src)
+{
+    Byte(as, 0xf2);
+    Byte(as, 0x0f);
+    Byte(as, opcode);
+    Direct(as, dst, src);
+}
+
+// ucomisd a, b. "Above" then means a > b, and is never set for NaN.
+static void CompareDouble(Assembler* as, int a, int b)
+{
+    Byte(as, 0x66);
+    Byte(as, 0x0f);
+    Byte(as, 0x2e);
+    Direct(as, a, b);
+}
+
+// Turns the flags into a Value: setcc al, movzx eax, al, then adds
+// FALSE_VAL, since TRUE_VAL is FALSE_VAL + 1.
+static void FlagToBool(Assembler* as, uint8_t setcc)
+{
+    Byte(as, 0x0f);
+    Byte(as, setcc);
+    Byte(as, 0xc0);
+    Byte(as, 0x0f);
+    Byte(as, 0xb6);
+    Byte(as, 0xc0);
+    MoveImmediate(as, RCX, FALSE_VAL);
+    Arith(as, X86_ADD, RAX, RCX);
+}
+
+// Emits a jump with its displacement left for later and returns where the
+// displacement is.
+static int JumpForward(Assembler* as, Condition condition)
+{
+    if (condition == CC_ALWAYS)
+    {
+        Byte(as, 0xe9);
+    }
+    else
+    {
+        Byte(as, 0x0f);
+        Byte(as, 0x80 | condition);
+    }
+    int at = as->count;
+    Int32(as, 0);
+    return at;
+}
+
+static void PatchJump(Assembler* as, int at, int destination)
+{
+    uint32_t displacement = (uint32_t)(destination - (at + 4));
+    for (int i = 0; i < 4; i++)
+    {
+        as->code[at + i] = (uint8_t)(displacement >> (i * 8));
+    }
+}
+
+static void BindHere(Assembler* as, int at)
+{
+    PatchJump(as, at, as->count);
+}
+
+static void JumpTo(Assembler* as, Condition condition, int destination)
+{
+    PatchJump(as, JumpForward(as, condition), destination);
+}
+
+static void JumpToInstruction(Assembler* as, Condition condition, int target)
+{
+    if (as->patchCapacity < as->patchCount + 1)
+    {
+        int oldCapacity = as->patchCapacity;
+        as->patchCapacity = GROW_CAPACITY(oldCapacity);
+        as->patches = GROW_ARRAY(JumpPatch, as->patches,
+                                 oldCapacity, as->patchCapacity);
+    }
+
+    JumpPatch* patch = &as->patches[as->patchCount++];
+    patch->at = JumpForward(as, condition);
+    patch->target = target;
+}
+
+static void PushValue(Assembler* as, int reg)
+{
+    Store(as, STACK_TOP, 0, reg);
+    AddImmediate(as, STACK_TOP, 8);
+}
+
+// Gets the frame ready for a helper: the stack top where the helper will
+// look for it, and ip inside the instruction so an error reports its line.
+static void BeforeCall(Assembler* as, const uint8_t* ip)
+{
+    MoveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    Store(as, RAX, 0, STACK_TOP);
+    MoveImmediate(as, RAX, (uint64_t)(uintptr_t)ip);
+    Store(as, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+static void CallRegister(Assembler* as, int reg)
+{
+    Rex(as, false, 0, reg);
+    Byte(as, 0xff);
+    Direct(as, 2, reg);
+}
+
+static void CallHelper(Assembler* as, uint64_t address)
+{
+    MoveImmediate(as, RAX, address);
+    CallRegister(as, RAX);
+}
+
+// Picks the stack top back up after a helper. The helper's result stays
+// in RAX.
+static void AfterCall(Assembler* as, bool canFail)
+{
+    if (canFail)
+    {
+        Byte(as, 0x84); // test al, al
+        Byte(as, 0xc0);
+        JumpTo(as, CC_EQUAL, as->errorExit);
+    }
+
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    Load(as, STACK_TOP, RCX, 0);
+    Load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+// After a helper that calls into Lox. The call may have grown the frame
+// array and moved the frame, which is the top one again once it returns.
+static void AfterLoxCall(Assembler* as)
+{
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+    LoadInt32(as, RDX, RCX, 0);
+    MultiplyImmediate(as, RDX, (int32_t)sizeof(CallFrame));
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frames);
+    Load(as, FRAME, RCX, 0);
+    Arith(as, X86_ADD, FRAME, RDX);
+    AddImmediate(as, FRAME, -(int32_t)sizeof(CallFrame));
+    AfterCall(as, true);
+}
+
+#define HELPER(function) ((uint64_t)(uintptr_t)(function))
+
+static void Helper(Assembler* as, const uint8_t* ip, uint64_t address,
+                   bool canFail)
+{
+    BeforeCall(as, ip + 1);
+    CallHelper(as, address);
+    AfterCall(as, canFail);
+}
+
+static void RaiseError(Assembler* as, const uint8_t* ip, const char* message)
+{
+    BeforeCall(as, ip + 1);
+    MoveImmediate(as, RDI, (uint64_t)(uintptr_t)message);
+    CallHelper(as, HELPER(JitError));
+    JumpTo(as, CC_ALWAYS, as->errorExit);
+}
+
+// Returns a jump, taken unless the value in reg is a number.
+static int GuardNumber(Assembler* as, int reg)
+{
+    Arith(as, X86_MOV, RDX, reg);
+    Arith(as, X86_AND, RDX, NAN_MASK);
+    Arith(as, X86_CMP, RDX, NAN_MASK);
+    return JumpForward(as, CC_EQUAL);
+}
+
+// Loads the two operands of a binary instruction into RAX and RCX, and
+// checks both are numbers. Returns the jumps taken if they aren't.
+static void LoadNumbers(Assembler* as, int slow[2])
+{
+    Load(as, RAX, STACK_TOP, -16);
+    Load(as, RCX, STACK_TOP, -8);
+    slow[0] = GuardNumber(as, RAX);
+    slow[1] = GuardNumber(as, RCX);
+    MoveToXmm(as, 0, RAX);
+    MoveToXmm(as, 1, RCX);
+}
+
+// slowHelper handles whatever isn't two numbers. With none, that's an
+// error.
+static void Arithmetic(Assembler* as, const uint8_t* ip, uint8_t opcode,
+                       uint64_t slowHelper)
+{
+    int slow[2];
+    LoadNumbers(as, slow);
+    ScalarDouble(as, opcode, 0, 1);
+    MoveFromXmm(as, RAX, 0);
+    AddImmediate(as, STACK_TOP, -8);
+    Store(as, STACK_TOP, -8, RAX);
+    int done = JumpForward(as, CC_ALWAYS);
+
+    BindHere(as, slow[0]);
+    BindHere(as, slow[1]);
+    if (slowHelper == 0)
+    {
+        RaiseError(as, ip, "Operands must be numbers.");
+    }
+    else
+    {
+        Helper(as, ip, slowHelper, true);
+    }
+    BindHere(as, done);
+}
+
+// swap compares b with a instead, for < and >=. setcc is SET_ABOVE for the
+// plain comparisons and SET_BELOW_EQUAL for the negated ones, which keeps
+// NaN giving the same answers as in the interpreter.
+static void Compare(Assembler* as, const uint8_t* ip, bool swap,
+                    uint8_t setcc)
+{
+    int slow[2];
+    LoadNumbers(as, slow);
+    if (swap) { CompareDouble(as, 1, 0); }
+    else { CompareDouble(as, 0, 1); }
+    FlagToBool(as, setcc);
+    AddImmediate(as, STACK_TOP, -8);
+    Store(as, STACK_TOP, -8, RAX);
+    int done = JumpForward(as, CC_ALWAYS);
+
+    BindHere(as, slow[0]);
+    BindHere(as, slow[1]);
+    RaiseError(as, ip, "Operands must be numbers.");
+    BindHere(as, done);
+}
+
+static void CompareJump(Assembler* as, const uint8_t* ip, int target,
+                        bool swap, Condition condition)
+{
+    int slow[2];
+    LoadNumbers(as, slow);
+    AddImmediate(as, STACK_TOP, -16);
+    if (swap) { CompareDouble(as, 1, 0); }
+    else { CompareDouble(as, 0, 1); }
+    JumpToInstruction(as, condition, target);
+    int done = JumpForward(as, CC_ALWAYS);
+
+    BindHere(as, slow[0]);
+    BindHere(as, slow[1]);
+    RaiseError(as, ip, "Operands must be numbers.");
+    BindHere(as, done);
+}
+
+// Jumps to target if the value in RAX is nil or false.
+static void JumpIfFalsey(Assembler* as, int target)
+{
+    MoveImmediate(as, RCX, NIL_VAL);
+    Arith(as, X86_CMP, RAX, RCX);
+    JumpToInstruction(as, CC_EQUAL, target);
+    MoveImmediate(as, RCX, FALSE_VAL);
+    Arith(as, X86_CMP, RAX, RCX);
+    JumpToInstruction(as, CC_EQUAL, target);
+}
+
+// Checks that the value in RAX is an object of the given type and leaves
+// the pointer to it in RAX. Returns the jumps taken if it isn't.
+static void GuardObject(Assembler* as, ObjType type, int slow[2])
+{
+    MoveImmediate(as, RCX, SIGN_BIT | QNAN);
+    Arith(as, X86_MOV, RDX, RAX);
+    Arith(as, X86_AND, RDX, RCX);
+    Arith(as, X86_CMP, RDX, RCX);
+    slow[0] = JumpForward(as, CC_NOT_EQUAL);
+    Arith(as, X86_XOR, RAX, RCX);
+    CompareByte(as, RAX, offsetof(Obj, type), (uint8_t)type);
+    slow[1] = JumpForward(as, CC_NOT_EQUAL);
+}
+
+// Reads a field straight out of the instance on top of the stack when the
+// site's first cache entry is a field of the instance's shape. Returns the
+// jumps taken otherwise, to the helper, which does the full lookup.
+static void GetField(Assembler* as, InlineCache* cache, int slow[5])
+{
+    Load(as, RAX, STACK_TOP, -8);
+    GuardObject(as, OBJ_INSTANCE, slow);
+
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)cache);
+    CompareInt32(as, RCX, offsetof(InlineCache, count), 0);
+    slow[2] = JumpForward(as, CC_EQUAL);
+    Load(as, RDX, RAX, offsetof(ObjInstance, shape));
+    Load(as, RSI, RCX, offsetof(InlineCache, entries[0].shape));
+    Arith(as, X86_CMP, RDX, RSI);
+    slow[3] = JumpForward(as, CC_NOT_EQUAL);
+    LoadInt32(as, RDX, RCX, offsetof(InlineCache, entries[0].slot));
+    Arith(as, X86_TEST, RDX, RDX);
+    slow[4] = JumpForward(as, CC_SIGN);
+
+    Load(as, RAX, RAX, offsetof(ObjInstance, fields));
+    ShiftLeft(as, RDX, 3);
+    Arith(as, X86_ADD, RAX, RDX);
+    Load(as, RAX, RAX, 0);
+    Store(as, STACK_TOP, -8, RAX);
+}
+
+// Puts the method an invoke site's first cache entry holds for the
+// receiver's shape, as an ObjClosure*, in RAX. Returns the jumps taken if
+// the entry doesn't apply, to the helper, which does the full lookup.
+static void GetCachedMethod(Assembler* as, int argCount, InlineCache* cache,
+                            int slow[6])
+{
+    Load(as, RAX, STACK_TOP, -(argCount + 1) * (int)sizeof(Value));
+    GuardObject(as, OBJ_INSTANCE, slow);
+
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)cache);
+    CompareInt32(as, RCX, offsetof(InlineCache, count), 0);
+    slow[2] = JumpForward(as, CC_EQUAL);
+    Load(as, RDX, RAX, offsetof(ObjInstance, shape));
+    Load(as, RSI, RCX, offsetof(InlineCache, entries[0].shape));
+    Arith(as, X86_CMP, RDX, RSI);
+    slow[3] = JumpForward(as, CC_NOT_EQUAL);
+    LoadInt32(as, RDX, RCX, offsetof(InlineCache, entries[0].slot));
+    Arith(as, X86_TEST, RDX, RDX);
+    slow[4] = JumpForward(as, CC_NOT_SIGN);
+    Load(as, RDX, RAX, offsetof(ObjInstance, klass));
+    LoadInt32(as, RDX, RDX, offsetof(ObjClass, version));
+    LoadInt32(as, RSI, RCX, offsetof(InlineCache, entries[0].version));
+    Arith(as, X86_CMP, RDX, RSI);
+    slow[5] = JumpForward(as, CC_NOT_EQUAL);
+
+    Load(as, RAX, RCX, offsetof(InlineCache, entries[0].method));
+    MoveImmediate(as, RCX, SIGN_BIT | QNAN);
+    Arith(as, X86_XOR, RAX, RCX);
+}
+
+// Calls the ObjClosure* in RAX straight from compiled code when it is
+// compiled too and the call needs nothing from Call(): no arity error, no
+// growing either stack and no falling back to the interpreter for depth.
+// The callee's frame is pushed here and its code called directly. An
+// error in it goes to errorExit; otherwise AL is left as a helper's would
+// be, false only if the interpreter, finishing a callee that deoptimized,
+// reported one. Returns the jumps taken when the call isn't that simple,
+// to the helper, which makes it the long way.
+static void CallCompiled(Assembler* as, int argCount, int slow[5])
+{
+    int32_t callee = -(argCount + 1) * (int)sizeof(Value);
+
+    Arith(as, X86_MOV, R10, RAX);
+    Load(as, R11, R10, offsetof(ObjClosure, function));
+    Load(as, RAX, R11, offsetof(ObjFunction, jit));
+    Arith(as, X86_TEST, RAX, RAX);
+    slow[0] = JumpForward(as, CC_EQUAL);
+    LoadInt32(as, RDX, R11, offsetof(ObjFunction, arity));
+    MoveImmediate(as, RCX, (uint64_t)argCount);
+    Arith(as, X86_CMP, RDX, RCX);
+    slow[1] = JumpForward(as, CC_NOT_EQUAL);
+
+    MoveImmediate(as, R8, (uint64_t)(uintptr_t)&vm);
+    LoadInt32(as, RDX, R8, offsetof(VM, nativeDepth));
+    MoveImmediate(as, RCX, NATIVE_DEPTH_MAX);
+    Arith(as, X86_CMP, RDX, RCX);
+    slow[2] = JumpForward(as, CC_ABOVE_EQUAL);
+    LoadInt32(as, RDX, R8, offsetof(VM, frameCount));
+    LoadInt32(as, RCX, R8, offsetof(VM, frameCapacity));
+    Arith(as, X86_CMP, RDX, RCX);
+    slow[3] = JumpForward(as, CC_ABOVE_EQUAL);
+    // The same room Call() makes for the callee's frame.
+    LoadInt32(as, RSI, R11, offsetof(ObjFunction, slotCount));
+    ShiftLeft(as, RSI, 3);
+    Arith(as, X86_ADD, RSI, STACK_TOP);
+    AddImmediate(as, RSI, callee + STACK_HEADROOM * (int)sizeof(Value));
+    Load(as, RDI, R8, offsetof(VM, stack));
+    LoadInt32(as, RCX, R8, offsetof(VM, stackCapacity));
+    ShiftLeft(as, RCX, 3);
+    Arith(as, X86_ADD, RDI, RCX);
+    Arith(as, X86_CMP, RSI, RDI);
+    slow[4] = JumpForward(as, CC_ABOVE);
+
+    // frameCount is still in RDX.
+    MultiplyImmediate(as, RDX, (int32_t)sizeof(CallFrame));
+    Load(as, RDI, R8, offsetof(VM, frames));
+    Arith(as, X86_ADD, RDI, RDX);
+    StepInt32(as, R8, offsetof(VM, frameCount), true);
+    StepInt32(as, R8, offsetof(VM, nativeDepth), true);
+    Store(as, RDI, offsetof(CallFrame, closure), R10);
+    Load(as, RCX, R11, offsetof(ObjFunction, chunk.code));
+    Store(as, RDI, offsetof(CallFrame, ip), RCX);
+    Load(as, RCX, R11, offsetof(ObjFunction, chunk.registers.code));
+    Store(as, RDI, offsetof(CallFrame, rip), RCX);
+    Arith(as, X86_MOV, RCX, STACK_TOP);
+    AddImmediate(as, RCX, callee);
+    Store(as, RDI, offsetof(CallFrame, slots), RCX);
+    StoreByte(as, RDI, offsetof(CallFrame, tailCalling), 0);
+
+    // RunJit(frame, 0), through the direct entry. The callee keeps only
+    // NAN_MASK; AfterLoxCall() reloads FRAME, SLOTS and STACK_TOP.
+    Load(as, RSI, RAX, offsetof(JitCode, entries));
+    LoadInt32(as, RSI, RSI, 0);
+    Load(as, RCX, RAX, offsetof(JitCode, code));
+    Arith(as, X86_ADD, RSI, RCX);
+    Load(as, RCX, RAX, offsetof(JitCode, directEntry));
+    CallRegister(as, RCX);
+    MoveImmediate(as, CONSTANTS,
+                  (uint64_t)(uintptr_t)as->chunk->constants.values);
+
+    MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.nativeDepth);
+    StepInt32(as, RCX, 0, false);
+    MoveImmediate(as, RCX, JIT_ERROR);
+    Arith(as, X86_CMP, RAX, RCX);
+    JumpTo(as, CC_EQUAL, as->errorExit);
+    Arith(as, X86_TEST, RAX, RAX); // JIT_RETURNED
+    int returned = JumpForward(as, CC_EQUAL);
+    CallHelper(as, HELPER(JitFinishFrame));
+    int done = JumpForward(as, CC_ALWAYS);
+    BindHere(as, returned);
+    MoveImmediate(as, RAX, 1);
+    BindHere(as, done);
+}
+
+// Hands the frame back to the interpreter at this instruction.
+static void Deoptimize(Assembler* as, const uint8_t* ip)
+{
+    BeforeCall(as, ip);
+    MoveImmediate(as, RAX, JIT_DEOPTIMIZED);
+    JumpTo(as, CC_ALWAYS, as->epilogue);
+}
+
+// The code starts with the entry C calls, which saves the registers C
+// expects kept and calls the direct entry after it. Compiled callers call
+// the direct entry themselves, as they keep nothing in those registers
+// across a call that they can't reload.
+static void Prologue(Assembler* as)
+{
+    PushRegister(as, RBP);
+    PushRegister(as, RBX);
+    PushRegister(as, R12);
+    PushRegister(as, R13);
+    PushRegister(as, R14);
+    PushRegister(as, R15);
+    // Six pushes and the return address leave the stack 8 bytes off the
+    // 16-byte alignment calls need.
+    AddImmediate(as, RSP, -8);
+    Byte(as, 0xe8); // call the direct entry
+    int direct = as->count;
+    Int32(as, 0);
+    AddImmediate(as, RSP, 8);
+    PopRegister(as, R15);
+    PopRegister(as, R14);
+    PopRegister(as, R13);
+    PopRegister(as, R12);
+    PopRegister(as, RBX);
+    PopRegister(as, RBP);
+    Byte(as, 0xc3); // ret
+
+    // Called with the stack 8 bytes off again.
+    as->directEntry = as->count;
+    PatchJump(as, direct, as->directEntry);
+    AddImmediate(as, RSP, -8);
+    Arith(as, X86_MOV, FRAME, RDI);
+    AfterCall(as, false);
+    MoveImmediate(as, CONSTANTS,
+                  (uint64_t)(uintptr_t)as->chunk->constants.values);
+    MoveImmediate(as, NAN_MASK, QNAN);
+    Byte(as, 0xff); // jmp rsi
+    Byte(as, 0xe6);
+
+    as->epilogue = as->count;
+    AddImmediate(as, RSP, 8);
+    Byte(as, 0xc3); // ret
+
+    as->errorExit = as->count;
+    MoveImmediate(as, RAX, JIT_ERROR);
+    JumpTo(as, CC_ALWAYS, as->epilogue);
+
+    as->returnExit = as->count;
+    MoveImmediate(as, RAX, JIT_RETURNED);
+    JumpTo(as, CC_ALWAYS, as->epilogue);
+}
+
+static int ReadShort(const uint8_t* operand)
+{
+    return (operand[0] << 8) | operand[1];
+}
+
+static int ReadLong(const uint8_t* operand)
+{
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static void CompileInstruction(Assembler* as, int offset)
+{
+    Chunk* chunk = as->chunk;
+    const uint8_t* ip = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+    int next = offset + InstructionLength(chunk, offset);
+
+    switch (ip[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        {
+            int index = ip[0] == OP_CONSTANT ? ip[1] : ReadLong(ip + 1);
+            Load(as, RAX, CONSTANTS, index * (int)sizeof(Value));
+            PushValue(as, RAX);
+            break;
+        }
+        case OP_NIL:
+            MoveImmediate(as, RAX, NIL_VAL);
+            PushValue(as, RAX);
+            break;
+        case OP_TRUE:
+            MoveImmediate(as, RAX, TRUE_VAL);
+            PushValue(as, RAX);
+            break;
+        case OP_FALSE:
+            MoveImmediate(as, RAX, FALSE_VAL);
+            PushValue(as, RAX);
+            break;
+        case OP_POP:
+            AddImmediate(as, STACK_TOP, -8);
+            break;
+
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        {
+            int slot = ip[0] == OP_GET_LOCAL ? ip[1] : ReadLong(ip + 1);
+            Load(as, RAX, SLOTS, slot * (int)sizeof(Value));
+            PushValue(as, RAX);
+            break;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        {
+            int slot = ip[0] == OP_SET_LOCAL ? ip[1] : ReadLong(ip + 1);
+            Load(as, RAX, STACK_TOP, -8);
+            Store(as, SLOTS, slot * (int)sizeof(Value), RAX);
+            break;
+        }
+
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        {
+            int slot = ip[0] == OP_GET_GLOBAL ? ip[1] : ReadLong(ip + 1);
+            // The array moves as globals are added, so go through vm.
+            MoveImmediate(as, RAX,
+                          (uint64_t)(uintptr_t)&vm.globalValues.values);
+            Load(as, RAX, RAX, 0);
+            Load(as, RAX, RAX, slot * (int)sizeof(Value));
+            MoveImmediate(as, RCX, UNDEFINED_VAL);
+            Arith(as, X86_CMP, RAX, RCX);
+            int defined = JumpForward(as, CC_NOT_EQUAL);
+            BeforeCall(as, ip + 1);
+            MoveImmediate(as, RDI, (uint64_t)slot);
+            CallHelper(as, HELPER(JitUndefinedVariable));
+            JumpTo(as, CC_ALWAYS, as->errorExit);
+            BindHere(as, defined);
+            PushValue(as, RAX);
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        {
+            bool isLong = ip[0] == OP_DEFINE_GLOBAL_LONG ||
+                          ip[0] == OP_SET_GLOBAL_LONG;
+            bool isSet = ip[0] == OP_SET_GLOBAL || ip[0] == OP_SET_GLOBAL_LONG;
+            BeforeCall(as, ip + 1);
+            MoveImmediate(as, RDI, (uint64_t)(isLong ? ReadLong(ip + 1)
+                                                     : ip[1]));
+            CallHelper(as, isSet ? HELPER(JitSetGlobal)
+                                 : HELPER(JitDefineGlobal));
+            AfterCall(as, isSet);
+            break;
+        }
+
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        {
+            int index = ip[0] == OP_GET_UPVALUE ? ip[1] : ReadLong(ip + 1);
+            Load(as, RAX, FRAME, offsetof(CallFrame, closure));
+            Load(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+            Load(as, RAX, RAX, index * (int)sizeof(ObjUpvalue*));
+            Load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            Load(as, RAX, RAX, 0);
+            PushValue(as, RAX);
+            break;
+        }
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        {
+            int index = ip[0] == OP_SET_UPVALUE ? ip[1] : ReadLong(ip + 1);
+            BeforeCall(as, ip + 1);
+            MoveImmediate(as, RDI, (uint64_t)index);
+            CallHelper(as, HELPER(JitSetUpvalue));
+            AfterCall(as, false);
+            break;
+        }
+
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        {
+            bool isLong = ip[0] == OP_GET_PROPERTY_LONG ||
+                          ip[0] == OP_SET_PROPERTY_LONG;
+            bool isGet = ip[0] == OP_GET_PROPERTY ||
+                         ip[0] == OP_GET_PROPERTY_LONG;
+            ObjString* name = AS_STRING(constants[isLong ? ReadLong(ip + 1)
+                                                         : ip[1]]);
+            InlineCache* cache =
+                &chunk->caches[ReadShort(ip + (isLong ? 4 : 2))];
+
+            int slow[5];
+            int done = -1;
+            if (isGet)
+            {
+                GetField(as, cache, slow);
+                done = JumpForward(as, CC_ALWAYS);
+                for (int i = 0; i < 5; i++) { BindHere(as, slow[i]); }
+            }
+
+            BeforeCall(as, ip + 1);
+            MoveImmediate(as, RDI, (uint64_t)(uintptr_t)name);
+            MoveImmediate(as, RSI, (uint64_t)(uintptr_t)cache);
+            CallHelper(as, isGet ? HELPER(JitGetProperty)
+                                 : HELPER(JitSetProperty));
+            AfterCall(as, true);
+            if (done != -1) { BindHere(as, done); }
+            break;
+        }
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            Helper(as, ip, HELPER(JitValuesEqual), false);
+            MoveImmediate(as, RCX, ip[0] == OP_EQUAL ? 0 : 1);
+            Byte(as, 0x0f); // movzx eax, al
+            Byte(as, 0xb6);
+            Byte(as, 0xc0);
+            Arith(as, X86_XOR, RAX, RCX);
+            MoveImmediate(as, RCX, FALSE_VAL);
+            Arith(as, X86_ADD, RAX, RCX);
+            PushValue(as, RAX);
+            break;
+
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            Compare(as, ip, false, SET_ABOVE);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            Compare(as, ip, true, SET_ABOVE);
+            break;
+        case OP_LESS_EQUAL:
+            Compare(as, ip, false, SET_BELOW_EQUAL);
+            break;
+        case OP_GREATER_EQUAL:
+            Compare(as, ip, true, SET_BELOW_EQUAL);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            Arithmetic(as, ip, SSE_ADD, HELPER(JitAdd));
+            break;
+        case OP_SUBTRACT: Arithmetic(as, ip, SSE_SUB, 0); break;
+        case OP_MULTIPLY: Arithmetic(as, ip, SSE_MUL, 0); break;
+        case OP_DIVIDE:   Arithmetic(as, ip, SSE_DIV, 0); break;
+
+        case OP_NOT:
+        {
+            Load(as, RAX, STACK_TOP, -8);
+            MoveImmediate(as, RCX, NIL_VAL);
+            Arith(as, X86_CMP, RAX, RCX);
+            int isNil = JumpForward(as, CC_EQUAL);
+            MoveImmediate(as, RCX, FALSE_VAL);
+            Arith(as, X86_CMP, RAX, RCX);
+            int isFalse = JumpForward(as, CC_EQUAL);
+            MoveImmediate(as, RAX, FALSE_VAL);
+            int done = JumpForward(as, CC_ALWAYS);
+            BindHere(as, isNil);
+            BindHere(as, isFalse);
+            MoveImmediate(as, RAX, TRUE_VAL);
+            BindHere(as, done);
+            Store(as, STACK_TOP, -8, RAX);
+            break;
+        }
+        case OP_NEGATE:
+        {
+            Load(as, RAX, STACK_TOP, -8);
+            int slow = GuardNumber(as, RAX);
+            MoveImmediate(as, RCX, SIGN_BIT);
+            Arith(as, X86_XOR, RAX, RCX);
+            Store(as, STACK_TOP, -8, RAX);
+            int done = JumpForward(as, CC_ALWAYS);
+            BindHere(as, slow);
+            RaiseError(as, ip, "Operand must be a number.");
+            BindHere(as, done);
+            break;
+        }
+
+        case OP_PRINT:
+            Helper(as, ip, HELPER(JitPrint), false);
+            break;
+
+        case OP_JUMP:
+            JumpToInstruction(as, CC_ALWAYS, next + ReadShort(ip + 1));
+            break;
+        case OP_LOOP:
+            JumpToInstruction(as, CC_ALWAYS, next - ReadShort(ip + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            Load(as, RAX, STACK_TOP, -8);
+            JumpIfFalsey(as, next + ReadShort(ip + 1));
+            break;
+
+        case OP_ADD_LOCAL_CONST:
+        {
+            int32_t slot = ip[1] * (int)sizeof(Value);
+            Load(as, RAX, SLOTS, slot);
+            int slow = GuardNumber(as, RAX);
+            MoveToXmm(as, 0, RAX);
+            MoveImmediate(as, RCX, constants[ip[2]]);
+            MoveToXmm(as, 1, RCX);
+            ScalarDouble(as, SSE_ADD, 0, 1);
+            MoveFromXmm(as, RAX, 0);
+            Store(as, SLOTS, slot, RAX);
+            int done = JumpForward(as, CC_ALWAYS);
+            BindHere(as, slow);
+            RaiseError(as, ip, "Operands must be two numbers or two strings.");
+            BindHere(as, done);
+            break;
+        }
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            Helper(as, ip, HELPER(JitValuesEqual), false);
+            Byte(as, 0x84); // test al, al
+            Byte(as, 0xc0);
+            JumpToInstruction(as, ip[0] == OP_EQUAL_JUMP_IF_FALSE
+                                  ? CC_EQUAL : CC_NOT_EQUAL,
+                              next + ReadShort(ip + 1));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            CompareJump(as, ip, next + ReadShort(ip + 1), true,
+                        CC_BELOW_EQUAL);
+            break;
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+            CompareJump(as, ip, next + ReadShort(ip + 1), false, CC_ABOVE);
+            break;
+        case OP_GREATER_JUMP_IF_FALSE:
+            CompareJump(as, ip, next + ReadShort(ip + 1), false,
+                        CC_BELOW_EQUAL);
+            break;
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            CompareJump(as, ip, next + ReadShort(ip + 1), true, CC_ABOVE);
+            break;
+
+        // Compiled frames live on the C stack and can't hand theirs over,
+        // so a tail call is an ordinary call and the OP_RETURN after it
+        // returns, marked so traces leave the frame out. Calls to compiled
+        // closures skip the helper.
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            int slow[7];
+            if (ip[0] == OP_TAIL_CALL)
+            {
+                StoreByte(as, FRAME, offsetof(CallFrame, tailCalling), 1);
+            }
+            BeforeCall(as, ip + 1);
+            Load(as, RAX, STACK_TOP, -(ip[1] + 1) * (int)sizeof(Value));
+            GuardObject(as, OBJ_CLOSURE, slow);
+            CallCompiled(as, ip[1], slow + 2);
+            int done = JumpForward(as, CC_ALWAYS);
+            for (int i = 0; i < 7; i++) { BindHere(as, slow[i]); }
+            MoveImmediate(as, RDI, ip[1]);
+            CallHelper(as, HELPER(JitCall));
+            BindHere(as, done);
+            AfterLoxCall(as);
+            break;
+        }
+
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        {
+            bool isLong = ip[0] == OP_INVOKE_LONG;
+            ObjString* name = AS_STRING(constants[isLong ? ReadLong(ip + 1)
+                                                         : ip[1]]);
+            int argCount = ip[isLong ? 4 : 2];
+            InlineCache* cache =
+                &chunk->caches[ReadShort(ip + (isLong ? 5 : 3))];
+            int slow[11];
+            BeforeCall(as, ip + 1);
+            GetCachedMethod(as, argCount, cache, slow);
+            CallCompiled(as, argCount, slow + 6);
+            int done = JumpForward(as, CC_ALWAYS);
+            for (int i = 0; i < 11; i++) { BindHere(as, slow[i]); }
+            MoveImmediate(as, RDI, (uint64_t)(uintptr_t)name);
+            MoveImmediate(as, RSI, (uint64_t)argCount);
+            MoveImmediate(as, RDX, (uint64_t)(uintptr_t)cache);
+            CallHelper(as, HELPER(JitInvoke));
+            BindHere(as, done);
+            AfterLoxCall(as);
+            break;
+        }
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            BeforeCall(as, ip + 1);
+            MoveImmediate(as, RDI, (uint64_t)(uintptr_t)ip);
+            CallHelper(as, HELPER(JitClosure));
+            AfterCall(as, false);
+            break;
+
+        case OP_CLOSE_UPVALUE:
+            Helper(as, ip, HELPER(JitCloseUpvalue), false);
+            break;
+
+        case OP_RETURN:
+        {
+            // Only closing upvalues needs the helper.
+            MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+            Load(as, RDX, RCX, 0);
+            Arith(as, X86_TEST, RDX, RDX);
+            int close = JumpForward(as, CC_NOT_EQUAL);
+
+            Load(as, RAX, STACK_TOP, -8);
+            Store(as, SLOTS, 0, RAX);
+            Arith(as, X86_MOV, STACK_TOP, SLOTS);
+            AddImmediate(as, STACK_TOP, 8);
+            MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+            Store(as, RCX, 0, STACK_TOP);
+            MoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+            Byte(as, 0xff); // dec dword [rcx]
+            Memory(as, 1, RCX, 0);
+            JumpTo(as, CC_ALWAYS, as->returnExit);
+
+            BindHere(as, close);
+            BeforeCall(as, ip + 1);
+            CallHelper(as, HELPER(JitReturn));
+            JumpTo(as, CC_ALWAYS, as->returnExit);
+            break;
+        }
+
+        default:
+            // Classes, methods and super are left to the interpreter. They
+            // mostly run once, at startup.
+            Deoptimize(as, ip);
+            break;
+    }
+}
+
+// Copies code into the current block, starting a new one if it doesn't
+// fit, and returns where it went, or NULL if the memory couldn't be had.
+// Only the pages being written are made writable, and only while they
+// are, so no page is ever both writable and executable. Nothing runs on
+// them meanwhile: compiled code calls in here only through helpers, and
+// is returned to after they are executable again.
+static uint8_t* InstallCode(const uint8_t* code, size_t size,
+                            CodeBlock** owner)
+{
+    size_t aligned = (size + CODE_ALIGNMENT - 1) &
+                     ~(size_t)(CODE_ALIGNMENT - 1);
+    CodeBlock* block = currentBlock;
+    if (block == NULL || block->size - block->used < aligned)
+    {
+        block = ALLOCATE(CodeBlock, 1);
+        block->size = aligned > CODE_BLOCK_SIZE ? aligned : CODE_BLOCK_SIZE;
+        block->memory = mmap(NULL, block->size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block->memory == MAP_FAILED)
+        {
+            FREE(CodeBlock, block);
+            return NULL;
+        }
+        block->used = 0;
+        block->liveCount = 0;
+        // The block it replaces is unmapped with the last of its code.
+        currentBlock = block;
+    }
+
+    uint8_t* start = block->memory + block->used;
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uint8_t* firstPage = (uint8_t*)((uintptr_t)start & ~(pageSize - 1));
+    size_t length = (size_t)(start + size - firstPage);
+    if (mprotect(firstPage, length, PROT_READ | PROT_WRITE) != 0)
+    {
+        return NULL;
+    }
+    memcpy(start, code, size);
+    if (mprotect(firstPage, length, PROT_READ | PROT_EXEC) != 0)
+    {
+        return NULL;
+    }
+
+    block->used += aligned;
+    block->liveCount++;
+    *owner = block;
+    return start;
+}
+
+bool CompileJit(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Assembler as;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.patches = NULL;
+    as.patchCount = 0;
+    as.patchCapacity = 0;
+
+    Prologue(&as);
+
+    int* entries = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0; offset < chunk->count;
+         offset += InstructionLength(chunk, offset))
+    {
+        entries[offset] = as.count;
+        CompileInstruction(&as, offset);
+    }
+    entries[chunk->count] = as.count;
+
+    for (int i = 0; i < as.patchCount; i++)
+    {
+        PatchJump(&as, as.patches[i].at, entries[as.patches[i].target]);
+    }
+    FREE_ARRAY(JumpPatch, as.patches, as.patchCapacity);
+
+    size_t size = (size_t)as.count;
+    CodeBlock* block;
+    uint8_t* code = InstallCode(as.code, size, &block);
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+
+    if (code == NULL)
+    {
+        FREE_ARRAY(int, entries, chunk->count + 1);
+        return false;
+    }
+
+    JitCode* jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->directEntry = code + as.directEntry;
+    jit->size = size;
+    jit->block = block;
+    jit->entries = entries;
+    jit->entryCount = chunk->count + 1;
+    function->jit = jit;
+    return true;
+}
+
+JitStatus RunJit(CallFrame* frame, int offset)
+{
+    JitCode* jit = frame->closure->function->jit;
+    JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+    return (JitStatus)entry(frame, jit->code + jit->entries[offset]);
+}
+
+void FreeJit(JitCode* jit)
+{
+    CodeBlock* block = jit->block;
+    if (--block->liveCount == 0)
+    {
+        if (block == currentBlock) { currentBlock = NULL; }
+        munmap(block->memory, block->size);
+        FREE(CodeBlock, block);
+    }
+    FREE_ARRAY(int, jit->entries, jit->entryCount);
+    FREE(JitCode, jit);
+}
+
+#endif
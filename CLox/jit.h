@@ -0,0 +1,52 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls plus loop back-edges a function runs in the interpreter before it
+// is compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+typedef enum
+{
+    // The frame returned and its result is where the callee was.
+    JIT_RETURNED,
+    // The code reached something it doesn't compile. frame->ip and
+    // vm.stackTop say where the interpreter should carry on.
+    JIT_DEOPTIMIZED,
+    // A runtime error was reported.
+    JIT_ERROR
+} JitStatus;
+
+typedef struct JitCode
+{
+    // The function's machine code, in executable memory it shares with
+    // other functions'.
+    uint8_t* code;
+    // Where compiled callers call it; see Prologue() in jit.c.
+    uint8_t* directEntry;
+    size_t size;
+    // Where the code for each instruction starts, by bytecode offset. Only
+    // instruction starts are filled in.
+    int* entries;
+    int entryCount;
+    // The block of executable memory the code is in.
+    struct CodeBlock* block;
+} JitCode;
+
+// Compiles the function's bytecode to machine code and sets function->jit.
+// Returns false if it couldn't, in which case it stays interpreted.
+bool CompileJit(ObjFunction* function);
+// Runs frame, which must be the top frame, starting at the instruction at
+// the given bytecode offset.
+JitStatus RunJit(CallFrame* frame, int offset);
+void FreeJit(JitCode* jit);
+
+#endif
+
+#endif
@@ -3,8 +3,13 @@
 #include <string.h>
 
 #include "common.h"
+#include "aot.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "filemap.h"
+#include "memory.h"
 #include "vm.h"
 
 static void Repl()
@@ -24,7 +29,7 @@ static void Repl()
 	}
 }
 
-static char* ReadFile(const char* path)
+static char* ReadFile(const char* path, size_t* size)
 {
 	/*FILE* file = fopen(path, "rb");
 	if (file == NULL)*/
@@ -57,22 +62,260 @@ static char* ReadFile(const char* path)
 	buffer[bytesRead] = '\0';
 
 	fclose(file);
+	*size = bytesRead;
 	return buffer;
 }
 
-static void RunFile(const char* path)
+// Writes through a temporary file and renames it into place, so a process
+// that has the old file mapped never sees it change underneath it.
+static bool WriteFile(const char* path, const uint8_t* bytes, size_t size)
 {
-	char* source = ReadFile(path);
-	InterpretResult result = Interpret(source);
+	char tempPath[FILENAME_MAX];
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+	FILE* file;
+	if (fopen_s(&file, tempPath, "wb") != 0) { return false; }
+
+	size_t bytesWritten = fwrite(bytes, 1, size, file);
+	bool closed = fclose(file) == 0;
+	if (bytesWritten != size || !closed)
+	{
+		remove(tempPath);
+		return false;
+	}
+
+	// Windows won't rename over an existing file; drop the old one first.
+	if (rename(tempPath, path) != 0 &&
+		(remove(path) != 0 || rename(tempPath, path) != 0))
+	{
+		remove(tempPath);
+		return false;
+	}
+	return true;
+}
+
+// FNV-1a over the source. Only used to name cache entries; the bytecode
+// version is checked when an entry is loaded.
+static uint64_t HashSource(const char* source, size_t size)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (uint8_t)source[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+static ObjFunction* CompileToFile(const char* source, const char* path)
+{
+	ObjFunction* function = Compile(source);
+	if (function == NULL) { return NULL; }
+
+	Push(OBJ_VAL(function));
+	size_t size;
+	uint8_t* bytes = SerializeFunction(function, &size);
+	bool written = WriteFile(path, bytes, size);
+	free(bytes);
+	Pop();
+
+	if (!written)
+	{
+		fprintf(stderr, "Could not write file \"%s\".\n", path);
+	}
+	return function;
+}
+
+// Runs source through a cache directory of compiled scripts named by the
+// hash of their source, so an unchanged script skips compilation.
+static InterpretResult InterpretCached(const char* source, size_t size,
+									   const char* cacheDir)
+{
+	char cachePath[FILENAME_MAX];
+	snprintf(cachePath, sizeof(cachePath), "%s/%016llx.loxc", cacheDir,
+			 (unsigned long long)HashSource(source, size));
+
+	size_t cachedSize;
+	uint8_t* cached = MapFile(cachePath, &cachedSize);
+	if (cached != NULL)
+	{
+		// The mapping is left in place: the loaded code runs from it.
+		const char* error;
+		ObjFunction* function = LoadImage(cached, cachedSize, &error);
+		if (function != NULL) { return InterpretFunction(function); }
+
+		// A stale or damaged entry is simply recompiled over.
+		UnmapFile(cached, cachedSize);
+	}
+
+	ObjFunction* function = CompileToFile(source, cachePath);
+	if (function == NULL) { return INTERPRET_COMPILE_ERROR; }
+	return InterpretFunction(function);
+}
+
+static InterpretResult RunSource(const char* path, const char* cacheDir)
+{
+	size_t size;
+	char* source = ReadFile(path, &size);
+
+	InterpretResult result;
+	if (IsBytecode((uint8_t*)source, size))
+	{
+		// Only reached if the file couldn't be mapped.
+		const char* error;
+		ObjFunction* function = DeserializeFunction(
+			(uint8_t*)source, size, &error);
+		if (function == NULL)
+		{
+			fprintf(stderr, "%s\n", error);
+			result = INTERPRET_COMPILE_ERROR;
+		}
+		else
+		{
+			result = InterpretFunction(function);
+		}
+	}
+	else if (cacheDir != NULL)
+	{
+		result = InterpretCached(source, size, cacheDir);
+	}
+	else
+	{
+		result = Interpret(source);
+	}
 	free(source);
+	return result;
+}
+
+static void RunFile(const char* path, const char* cacheDir)
+{
+	InterpretResult result;
+
+	// Compiled files run straight from a mapping of the file, which stays
+	// in place until the process exits.
+	size_t size;
+	uint8_t* image = MapFile(path, &size);
+	if (image != NULL && IsBytecode(image, size))
+	{
+		const char* error;
+		ObjFunction* function = LoadImage(image, size, &error);
+		if (function == NULL)
+		{
+			fprintf(stderr, "%s\n", error);
+			result = INTERPRET_COMPILE_ERROR;
+		}
+		else
+		{
+			result = InterpretFunction(function);
+		}
+	}
+	else
+	{
+		if (image != NULL) { UnmapFile(image, size); }
+		result = RunSource(path, cacheDir);
+	}
 
 	if (result == INTERPRET_COMPILE_ERROR) { exit(65); }
 	if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
 }
 
+static void CompileFile(const char* path, const char* outPath)
+{
+	size_t size;
+	char* source = ReadFile(path, &size);
+	ObjFunction* function = CompileToFile(source, outPath);
+	free(source);
+
+	if (function == NULL) { exit(65); }
+}
+
+static void EmitCFile(const char* path, const char* outPath)
+{
+	size_t size;
+	char* source = ReadFile(path, &size);
+	ObjFunction* function = Compile(source);
+	free(source);
+	if (function == NULL) { exit(65); }
+
+	FILE* file;
+	if (fopen_s(&file, outPath, "w") != 0)
+	{
+		fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+		exit(74);
+	}
+
+	Push(OBJ_VAL(function));
+	EmitC(function, path, file);
+	Pop();
+	fclose(file);
+}
+
+static void Usage()
+{
+	fprintf(stderr, "Usage: clox [options] [path]\n"
+					"       clox --compile out.loxc path\n"
+					"       clox --emit-c out.c path\n"
+					"       clox [options] --cache dir path\n"
+					"Options:\n"
+					"  --gc-stats      print collection pauses on exit\n"
+					"  --registers     run the register form of the bytecode\n"
+#ifdef JIT
+					"  --no-jit        interpret everything\n"
+#endif
+#ifdef PARALLEL_MARKING
+					"  --gc-threads n  mark the heap on n threads\n"
+#endif
+					);
+	exit(64);
+}
+
 int main(int argc, char* argv[])
 {
 	InitVM();
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+	atexit(PrintInstructionCount);
+#endif
+
+	for (;;)
+	{
+		if (argc > 1 && strcmp(argv[1], "--gc-stats") == 0)
+		{
+			// Registered with atexit so it also covers scripts that fail.
+			atexit(PrintGCPauses);
+			argc--;
+			argv++;
+		}
+		else if (argc > 1 && strcmp(argv[1], "--registers") == 0)
+		{
+			vm.useRegisters = true;
+			// The compiler works from the stack code.
+			vm.useJit = false;
+			argc--;
+			argv++;
+		}
+		else if (argc > 1 && strcmp(argv[1], "--no-jit") == 0)
+		{
+			vm.useJit = false;
+			argc--;
+			argv++;
+		}
+#ifdef PARALLEL_MARKING
+		else if (argc > 2 && strcmp(argv[1], "--gc-threads") == 0)
+		{
+			vm.markThreads = atoi(argv[2]);
+			if (vm.markThreads < 1 || vm.markThreads > GC_MAX_MARK_THREADS)
+			{
+				Usage();
+			}
+			argc -= 2;
+			argv += 2;
+		}
+#endif
+		else
+		{
+			break;
+		}
+	}
 
 	if (argc == 1)
 	{
@@ -80,12 +323,23 @@ int main(int argc, char* argv[])
 	}
 	else if (argc == 2)
 	{
-		RunFile(argv[1]);
+		RunFile(argv[1], NULL);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--compile") == 0)
+	{
+		CompileFile(argv[3], argv[2]);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--emit-c") == 0)
+	{
+		EmitCFile(argv[3], argv[2]);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--cache") == 0)
+	{
+		RunFile(argv[3], argv[2]);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		Usage();
 	}
 	return 0;
 }
\ No newline at end of file
@@ -1,30 +1,127 @@
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
+// Log lines from several marking threads would interleave.
+#undef PARALLEL_MARKING
+#endif
+
+#ifdef PARALLEL_MARKING
+#include "thread.h"
+#endif
+
+#ifdef JIT
+#include "jit.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
+#ifdef GENERATIONAL_GC
+// Bytes allocated between minor collections. Large enough that most
+// short-lived objects are dead by the time it is collected; smaller sizes
+// promoted enough medium-lived ones to make major collections frequent.
+#define GC_NURSERY_SIZE (1024 * 1024)
+#endif
+
+#ifdef INCREMENTAL_GC
+// Bytes allocated between steps of a full collection. Together with
+// GC_PAUSE_BUDGET_US this sets how fast a collection keeps up with the
+// program; if the heap still reaches GC_HEAP_GROW_FACTOR times nextGC
+// before it finishes, the rest is done in one go.
+#define GC_STEP_SIZE (256 * 1024)
+// Objects marked or swept between checks of the clock.
+#define GC_STEP_WORK 256
+#endif
+
+#ifdef POOL_ALLOCATOR
+// Objects up to POOL_MAX_SIZE bytes come from a pool for their size,
+// rounded up to a multiple of POOL_GRANULARITY. A pool reuses freed cells
+// first, and otherwise hands out its newest slab in address order, so
+// objects of one size allocated together end up next to each other.
+#define POOL_GRANULARITY 8
+#define POOL_MAX_SIZE 256
+#define POOL_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+#define POOL_INDEX(size) \
+    (((size) + POOL_GRANULARITY - 1) / POOL_GRANULARITY - 1)
+#define SLAB_SIZE (64 * 1024)
+// Each slab starts with a link to the previous one, padded to keep the
+// cells as aligned as malloc's blocks.
+#define SLAB_HEADER 16
+
+typedef struct FreeCell
+{
+    struct FreeCell* next;
+} FreeCell;
+
+typedef struct
+{
+    FreeCell* freeCells;
+    // The part of the newest slab that hasn't been handed out yet.
+    uint8_t* unused;
+    uint8_t* end;
+} Pool;
+
+// Slabs are only given back to the system by FreeObjects.
+static Pool pools[POOL_COUNT];
+static uint8_t* slabs;
+#endif
+
+#ifdef PARALLEL_MARKING
+// Full collections of a heap smaller than this mark on one thread; it
+// isn't worth starting the others for. Minor collections always do.
+#ifndef GC_PARALLEL_MIN_HEAP
+#define GC_PARALLEL_MIN_HEAP (16 * 1024 * 1024)
+#endif
+
+// Each marking thread pushes and pops its own gray stack without locking.
+// Objects move between threads only through shared, a batch at a time,
+// under lock.
+typedef struct
+{
+    Obj** gray;
+    int grayCount;
+    int grayCapacity;
+
+    long lock;
+    long sharedCount;
+    int sharedCapacity;
+    Obj** shared;
+} Marker;
+
+static Marker markers[GC_MAX_MARK_THREADS];
+static int markerCount;
+// Markers that have work or are taking some. Once it reaches 0, none
+// have any left and none can get more.
+static long activeMarkers;
+static bool markingInParallel;
+static THREAD_LOCAL Marker* currentMarker;
+#endif
+
+// Pause times, in powers of two microseconds: bucket i counts pauses under
+// 2^(i + 1) microseconds, and the last one everything longer.
+#define GC_PAUSE_BUCKETS 18
+
+static long pauseCounts[GC_PAUSE_BUCKETS];
+static double pauseTotal;
+static double pauseLongest;
+
+static void CollectOnAllocation(size_t size);
+
 void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
     vm.bytesAllocated += newSize - oldSize;
 
     if (newSize > oldSize)
     {
-#ifdef DEBUG_STRESS_GC
-        CollectGarbage();
-#endif
-
-        if (vm.bytesAllocated > vm.nextGC)
-        {
-            CollectGarbage();
-        }
+        CollectOnAllocation(newSize - oldSize);
     }
 
 	if (newSize == 0)
@@ -38,18 +135,84 @@ void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 	return result;
 }
 
-void MarkObject(Obj* object)
+#ifdef POOL_ALLOCATOR
+static void* AllocateCell(Pool* pool, size_t size)
 {
-    if (object == NULL) { return; }
-    if (object->isMarked) { return; }
+    if (pool->freeCells != NULL)
+    {
+        FreeCell* cell = pool->freeCells;
+        pool->freeCells = cell->next;
+        return cell;
+    }
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    PrintValue(OBJ_VAL(object));
-    printf("\n");
+    if ((size_t)(pool->end - pool->unused) < size)
+    {
+        uint8_t* slab = (uint8_t*)malloc(SLAB_SIZE);
+        if (slab == NULL) { exit(1); }
+
+        *(uint8_t**)slab = slabs;
+        slabs = slab;
+        pool->unused = slab + SLAB_HEADER;
+        pool->end = slab + SLAB_SIZE;
+    }
+
+    void* cell = pool->unused;
+    pool->unused += size;
+    return cell;
+}
+
+static void FreePools()
+{
+    while (slabs != NULL)
+    {
+        uint8_t* previous = *(uint8_t**)slabs;
+        free(slabs);
+        slabs = previous;
+    }
+
+    for (int i = 0; i < POOL_COUNT; i++)
+    {
+        pools[i].freeCells = NULL;
+        pools[i].unused = NULL;
+        pools[i].end = NULL;
+    }
+}
 #endif
-    object->isMarked = true;
 
+void* AllocateObjectMemory(size_t size)
+{
+#ifdef POOL_ALLOCATOR
+    if (size <= POOL_MAX_SIZE)
+    {
+        vm.bytesAllocated += size;
+        CollectOnAllocation(size);
+
+        int index = POOL_INDEX(size);
+        return AllocateCell(&pools[index], (index + 1) * POOL_GRANULARITY);
+    }
+#endif
+    return Reallocate(NULL, 0, size);
+}
+
+void FreeObjectMemory(void* pointer, size_t size)
+{
+#ifdef POOL_ALLOCATOR
+    if (size <= POOL_MAX_SIZE)
+    {
+        vm.bytesAllocated -= size;
+
+        Pool* pool = &pools[POOL_INDEX(size)];
+        FreeCell* cell = (FreeCell*)pointer;
+        cell->next = pool->freeCells;
+        pool->freeCells = cell;
+        return;
+    }
+#endif
+    Reallocate(pointer, size, 0);
+}
+
+static void PushGray(Obj* object)
+{
     if (vm.grayCapacity < vm.grayCount + 1)
     {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -62,6 +225,93 @@ void MarkObject(Obj* object)
     vm.grayStack[vm.grayCount++] = object;
 }
 
+#ifdef PARALLEL_MARKING
+static void PushMarkerGray(Marker* marker, Obj* object)
+{
+    if (marker->grayCapacity < marker->grayCount + 1)
+    {
+        marker->grayCapacity = GROW_CAPACITY(marker->grayCapacity);
+        marker->gray = (Obj**)realloc(marker->gray,
+                                      sizeof(Obj*) * marker->grayCapacity);
+
+        if (marker->gray == NULL) { exit(1); }
+    }
+
+    marker->gray[marker->grayCount++] = object;
+}
+#endif
+
+void MarkObject(Obj* object)
+{
+    if (object == NULL) { return; }
+
+#ifdef PARALLEL_MARKING
+    if (markingInParallel)
+    {
+        // Another thread may reach the object at the same time. Only the
+        // one whose mark lands grays it.
+        if (ATOMIC_LOAD_BYTE(&object->isMarked) != vm.markValue &&
+            ATOMIC_CAS_BYTE(&object->isMarked, !vm.markValue, vm.markValue))
+        {
+            PushMarkerGray(currentMarker, object);
+        }
+        return;
+    }
+#endif
+
+    if (object->isMarked == vm.markValue) { return; }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    PrintValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = vm.markValue;
+    PushGray(object);
+}
+
+#if defined(GENERATIONAL_GC) || defined(INCREMENTAL_GC)
+void RememberObject(Obj* object)
+{
+#ifdef INCREMENTAL_GC
+    if (vm.gcPhase == GC_MARKING)
+    {
+        PushGray(object);
+        return;
+    }
+#endif
+
+#ifdef GENERATIONAL_GC
+    object->isRemembered = true;
+
+    // Grown with the system allocator, like the gray stack, so that a
+    // write barrier never triggers a collection.
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered,
+                                       sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) { exit(1); }
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+#endif
+}
+#endif
+
+#ifdef GENERATIONAL_GC
+static void ForgetRemembered()
+{
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+    vm.globalsRemembered = false;
+}
+#endif
+
 void MarkValue(Value value)
 {
     if (!IS_OBJ(value)) { return; }
@@ -122,7 +372,29 @@ static void BlackenObject(Obj* object)
         {
             ObjInstance* instance = (ObjInstance*)object;
             MarkObject((Obj*)instance->klass);
-            MarkTable(&instance->fields);
+            MarkObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->slotCount; i++)
+            {
+                MarkValue(instance->fields[i]);
+            }
+            break;
+        }
+
+        case OBJ_ROPE:
+        {
+            ObjRope* rope = (ObjRope*)object;
+            MarkObject(rope->left);
+            MarkObject(rope->right);
+            MarkObject((Obj*)rope->flat);
+            break;
+        }
+
+        case OBJ_SHAPE:
+        {
+            ObjShape* shape = (ObjShape*)object;
+            MarkObject((Obj*)shape->parent);
+            MarkObject((Obj*)shape->name);
+            MarkTable(&shape->transitions);
             break;
         }
 
@@ -145,13 +417,13 @@ static void FreeObject(Obj* object)
     switch (object->type)
     {
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(ObjBoundMethod, object);
             break;
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass*)object;
             FreeTable(&klass->methods);
-            FREE(ObjClass, object);
+            FREE_OBJ(ObjClass, object);
             break;
         }
 
@@ -159,40 +431,59 @@ static void FreeObject(Obj* object)
         {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_OBJ(ObjClosure, object);
             break;
         }
 
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+            if (function->jit != NULL) { FreeJit(function->jit); }
+#endif
             FreeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJ(ObjFunction, object);
             break;
         }
 
         case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
-            FreeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields)
+            {
+                FREE_ARRAY(Value, instance->fields, instance->capacity);
+            }
+            FreeObjectMemory(object, sizeof(ObjInstance) +
+                             sizeof(Value) * instance->inlineCapacity);
             break;
         }
 
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            FREE_OBJ(ObjNative, object);
             break;
 
+        case OBJ_ROPE:
+            FREE_OBJ(ObjRope, object);
+            break;
+
+        case OBJ_SHAPE:
+        {
+            ObjShape* shape = (ObjShape*)object;
+            FreeTable(&shape->transitions);
+            FREE_OBJ(ObjShape, object);
+            break;
+        }
+
         case OBJ_STRING:
         {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FreeObjectMemory(object,
+                             sizeof(ObjString) + string->length + 1);
             break;
         }
 
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
     }
 }
@@ -216,10 +507,177 @@ static void MarkRoots()
         MarkObject((Obj*)upvalue);
     }
 
-    MarkTable(&vm.globals);
     MarkCompilerRoots();
     MarkObject((Obj*)vm.initString);
+    MarkObject((Obj*)vm.rootShape);
+}
+
+#ifdef PARALLEL_MARKING
+static void LockMarker(Marker* marker)
+{
+    while (!ATOMIC_CAS_LONG(&marker->lock, 0, 1)) { YieldThread(); }
+}
+
+static void UnlockMarker(Marker* marker)
+{
+    ATOMIC_STORE(&marker->lock, 0);
+}
+
+// Moves the bottom half of the marker's gray stack, which is nearest the
+// roots and so likely to lead to the most work, to where others can take
+// it.
+static void ShareGray(Marker* marker)
+{
+    LockMarker(marker);
+    if (marker->sharedCount == 0)
+    {
+        int count = marker->grayCount / 2;
+        if (marker->sharedCapacity < count)
+        {
+            marker->sharedCapacity = marker->grayCapacity;
+            marker->shared = (Obj**)realloc(marker->shared,
+                                            sizeof(Obj*) * marker->sharedCapacity);
+
+            if (marker->shared == NULL) { exit(1); }
+        }
+
+        memcpy(marker->shared, marker->gray, sizeof(Obj*) * count);
+        memmove(marker->gray, marker->gray + count,
+                sizeof(Obj*) * (marker->grayCount - count));
+        marker->grayCount -= count;
+        ATOMIC_STORE(&marker->sharedCount, count);
+    }
+    UnlockMarker(marker);
+}
+
+// Takes what from has shared: all of it if it is the thief's own, else
+// half, rounded up.
+static bool TakeShared(Marker* thief, Marker* from)
+{
+    if (ATOMIC_LOAD(&from->sharedCount) == 0) { return false; }
+
+    LockMarker(from);
+    int count = (int)from->sharedCount;
+    if (from != thief) { count -= count / 2; }
+    for (int i = 0; i < count; i++)
+    {
+        PushMarkerGray(thief, from->shared[from->sharedCount - count + i]);
+    }
+    ATOMIC_STORE(&from->sharedCount, from->sharedCount - count);
+    UnlockMarker(from);
+    return count > 0;
+}
+
+static bool FindWork(Marker* marker)
+{
+    if (TakeShared(marker, marker)) { return true; }
+
+    int self = (int)(marker - markers);
+    for (int i = 1; i < markerCount; i++)
+    {
+        if (TakeShared(marker, &markers[(self + i) % markerCount]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool AnyShared()
+{
+    for (int i = 0; i < markerCount; i++)
+    {
+        if (ATOMIC_LOAD(&markers[i].sharedCount) > 0) { return true; }
+    }
+    return false;
+}
+
+static void RunMarker(void* arg)
+{
+    Marker* marker = (Marker*)arg;
+    currentMarker = marker;
+
+    for (;;)
+    {
+        while (marker->grayCount > 0 || FindWork(marker))
+        {
+            Obj* object = marker->gray[--marker->grayCount];
+            BlackenObject(object);
+
+            // Share as soon as another marker is waiting for work.
+            if (marker->grayCount > 1 &&
+                ATOMIC_LOAD(&marker->sharedCount) == 0 &&
+                ATOMIC_LOAD(&activeMarkers) < markerCount)
+            {
+                ShareGray(marker);
+            }
+        }
+
+        // Out of work. Wait for some to be shared, or for every other
+        // marker to run out too. Only active markers share, and a marker
+        // counts itself active again before it takes anything, so there
+        // is nothing left to find once the count reaches 0.
+        ATOMIC_DECREMENT(&activeMarkers);
+        for (;;)
+        {
+            if (ATOMIC_LOAD(&activeMarkers) == 0) { return; }
+
+            if (AnyShared())
+            {
+                ATOMIC_INCREMENT(&activeMarkers);
+                if (FindWork(marker)) { break; }
+                ATOMIC_DECREMENT(&activeMarkers);
+            }
+            YieldThread();
+        }
+    }
+}
+
+// Drains the gray stack with vm.markThreads threads, this one included.
+static void TraceInParallel()
+{
+    markerCount = vm.markThreads;
+    activeMarkers = markerCount;
+
+    // This thread is the first marker and starts with all the gray
+    // objects. The others take them from there.
+    Marker* first = &markers[0];
+    Obj** stack = first->gray;
+    int capacity = first->grayCapacity;
+    first->gray = vm.grayStack;
+    first->grayCount = vm.grayCount;
+    first->grayCapacity = vm.grayCapacity;
+    ShareGray(first);
+
+    markingInParallel = true;
+    Thread threads[GC_MAX_MARK_THREADS];
+    int started = 1;
+    for (int i = 1; i < markerCount; i++)
+    {
+        if (StartThread(&threads[started], RunMarker, &markers[i]))
+        {
+            started++;
+        }
+        else
+        {
+            ATOMIC_DECREMENT(&activeMarkers);
+        }
+    }
+
+    RunMarker(first);
+    for (int i = 1; i < started; i++)
+    {
+        JoinThread(&threads[i]);
+    }
+    markingInParallel = false;
+
+    vm.grayStack = first->gray;
+    vm.grayCount = 0;
+    vm.grayCapacity = first->grayCapacity;
+    first->gray = stack;
+    first->grayCapacity = capacity;
 }
+#endif
 
 static void TraceReferences()
 {
@@ -230,15 +688,34 @@ static void TraceReferences()
     }
 }
 
+// Like TraceReferences, for when the whole heap may be left to trace.
+static void TraceHeap()
+{
+#ifdef PARALLEL_MARKING
+    if (vm.markThreads > 1 && vm.bytesAllocated >= GC_PARALLEL_MIN_HEAP)
+    {
+        TraceInParallel();
+        return;
+    }
+#endif
+    TraceReferences();
+}
+
+static void MarkGlobals()
+{
+    MarkTable(&vm.globalNames);
+    MarkArray(&vm.globalValues);
+}
+
+#ifndef INCREMENTAL_GC
 static void Sweep()
 {
     Obj* previous = NULL;
     Obj* object = vm.objects;
     while (object != NULL)
     {
-        if (object->isMarked)
+        if (object->isMarked == vm.markValue)
         {
-            object->isMarked = false;
             previous = object;
             object = object->next;
         }
@@ -259,38 +736,422 @@ static void Sweep()
         }
     }
 }
+#endif
 
-void CollectGarbage()
+static double NowMicros()
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+static void RecordPause(double start)
+{
+    double pause = NowMicros() - start;
+    pauseTotal += pause;
+    if (pause > pauseLongest) { pauseLongest = pause; }
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= (2 << bucket))
+    {
+        bucket++;
+    }
+    pauseCounts[bucket]++;
+}
+
+#ifdef DEBUG_LOG_GC
+static size_t bytesBeforeGC;
+#endif
+
+// Begins a full collection by graying the roots. Everything reachable is
+// marked once the gray stack has been drained.
+static void StartMarking()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    bytesBeforeGC = vm.bytesAllocated;
+#endif
+
+#ifdef GENERATIONAL_GC
+    // Trace the whole heap. Flipping the mark sense unmarks every old
+    // object, and the nursery joins them, unmarked as well.
+    vm.markValue = !vm.markValue;
+    while (vm.youngObjects != NULL)
+    {
+        Obj* object = vm.youngObjects;
+        vm.youngObjects = object->next;
+        object->isMarked = !vm.markValue;
+        object->next = vm.objects;
+        vm.objects = object;
+    }
+    ForgetRemembered();
+    vm.nurseryBytes = 0;
 #endif
 
     MarkRoots();
+    MarkGlobals();
+
+#ifdef INCREMENTAL_GC
+    vm.gcPhase = GC_MARKING;
+#endif
+}
+
+// Called once the gray stack is empty.
+static void FinishMarking()
+{
+#ifdef INCREMENTAL_GC
+    // The write barrier covers stores into objects, but not into the
+    // roots, which the program has been changing since they were marked.
+    MarkRoots();
+    MarkGlobals();
     TraceReferences();
+
+    vm.gcPhase = GC_SWEEPING;
+    vm.sweepLink = &vm.objects;
+#endif
+
     TableRemoveWhite(&vm.strings);
-    Sweep();
+}
 
+static void FinishSweeping()
+{
+#ifndef GENERATIONAL_GC
+    // Survivors keep their mark; this unmarks them for the next cycle.
+    vm.markValue = !vm.markValue;
+#endif
+#ifdef INCREMENTAL_GC
+    vm.gcPhase = GC_IDLE;
+    vm.sweepLink = NULL;
+#endif
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated,
-           vm.nextGC);
+    // Not a difference: the program may have allocated since it began.
+    printf("   heap went from %zu to %zu bytes, next at %zu\n",
+           bytesBeforeGC, vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
-void FreeObjects()
+#ifdef INCREMENTAL_GC
+// Blackens up to count gray objects. Returns true once none are left.
+static bool MarkSome(int count)
+{
+    while (vm.grayCount > 0 && count-- > 0)
+    {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        BlackenObject(object);
+    }
+    return vm.grayCount == 0;
+}
+
+// Sweeps up to count objects. Returns true once the whole list is done.
+// Objects added to the front of the list meanwhile are marked, so they
+// are simply passed over if the sweep hasn't got past the front yet.
+static bool SweepSome(int count)
+{
+    while (count-- > 0)
+    {
+        Obj* object = *vm.sweepLink;
+        if (object == NULL) { return true; }
+
+        if (object->isMarked == vm.markValue)
+        {
+            vm.sweepLink = &object->next;
+        }
+        else
+        {
+            *vm.sweepLink = object->next;
+            FreeObject(object);
+        }
+    }
+    return *vm.sweepLink == NULL;
+}
+
+// Does the work of one pause: marking, then sweeping, until the budget
+// runs out or the collection is finished.
+static void CollectStep()
+{
+    double start = NowMicros();
+    double deadline = start + GC_PAUSE_BUDGET_US;
+    do
+    {
+        if (vm.gcPhase == GC_MARKING)
+        {
+            if (MarkSome(GC_STEP_WORK)) { FinishMarking(); }
+        }
+        else if (SweepSome(GC_STEP_WORK))
+        {
+            FinishSweeping();
+            break;
+        }
+    } while (NowMicros() < deadline);
+    RecordPause(start);
+}
+#endif
+
+// Runs the collection in progress to the end.
+static void FinishCollection()
+{
+#ifdef INCREMENTAL_GC
+    if (vm.gcPhase == GC_MARKING)
+    {
+        TraceHeap();
+        FinishMarking();
+    }
+    SweepSome(INT_MAX);
+#else
+    TraceHeap();
+    FinishMarking();
+    Sweep();
+#endif
+    FinishSweeping();
+}
+
+#ifdef GENERATIONAL_GC
+// Frees unreached young objects and promotes the rest, which keep their
+// mark.
+static void SweepNursery()
+{
+    Obj* object = vm.youngObjects;
+    while (object != NULL)
+    {
+        Obj* next = object->next;
+        if (object->isMarked == vm.markValue)
+        {
+            object->next = vm.objects;
+            vm.objects = object;
+        }
+        else
+        {
+            FreeObject(object);
+        }
+        object = next;
+    }
+    vm.youngObjects = NULL;
+}
+
+// Traces only the young objects reachable from the roots and from old
+// objects they were stored in. Old objects are already marked, so marking
+// stops as soon as it reaches one.
+static void CollectNursery()
+{
+    double start = NowMicros();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    MarkRoots();
+    if (vm.globalsRemembered) { MarkGlobals(); }
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        BlackenObject(vm.remembered[i]);
+    }
+    TraceReferences();
+    TableRemoveWhite(&vm.strings);
+    SweepNursery();
+
+    // Every survivor is old now, so no old object refers to a young one.
+    ForgetRemembered();
+    vm.nurseryBytes = 0;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+
+    RecordPause(start);
+}
+#endif
+
+void CollectGarbage()
+{
+    double start = NowMicros();
+
+#ifdef INCREMENTAL_GC
+    if (vm.gcPhase != GC_IDLE) { FinishCollection(); }
+#endif
+    StartMarking();
+    FinishCollection();
+
+    RecordPause(start);
+}
+
+#ifdef DEBUG_STRESS_GC
+static void StressCollect()
+{
+    static int stressCount = 0;
+    stressCount++;
+
+#ifdef INCREMENTAL_GC
+    // Keep a collection going, a few objects per allocation, so the
+    // program runs between steps and exercises the write barriers.
+    if (vm.gcPhase == GC_IDLE)
+    {
+        StartMarking();
+    }
+    else if (vm.gcPhase == GC_MARKING)
+    {
+        if (MarkSome(2)) { FinishMarking(); }
+    }
+    else if (SweepSome(64))
+    {
+        FinishSweeping();
+    }
+#endif
+
+    // With a full collection now and then, which catches any object that
+    // is only referenced from C.
+    if (stressCount % 8 == 0)
+    {
+        CollectGarbage();
+        return;
+    }
+
+#ifdef GENERATIONAL_GC
+#ifdef INCREMENTAL_GC
+    if (vm.gcPhase == GC_MARKING) { return; }
+#endif
+    // Minor collections in between, to exercise the generational barriers.
+    CollectNursery();
+#elif !defined(INCREMENTAL_GC)
+    CollectGarbage();
+#endif
+}
+#endif
+
+static void StartCollection()
+{
+#ifdef INCREMENTAL_GC
+    StartMarking();
+    CollectStep();
+#else
+    CollectGarbage();
+#endif
+}
+
+static void CollectOnAllocation(size_t size)
+{
+#ifdef DEBUG_STRESS_GC
+    StressCollect();
+#endif
+
+#ifdef GENERATIONAL_GC
+    vm.nurseryBytes += size;
+#endif
+
+#ifdef INCREMENTAL_GC
+    if (vm.gcPhase != GC_IDLE)
+    {
+        vm.stepBytes += size;
+        if (vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR)
+        {
+            // The program is allocating faster than the collection can
+            // keep up with.
+            double start = NowMicros();
+            FinishCollection();
+            RecordPause(start);
+        }
+        else if (vm.stepBytes > GC_STEP_SIZE)
+        {
+            vm.stepBytes = 0;
+            CollectStep();
+        }
+
+#ifdef GENERATIONAL_GC
+        // Minor collections wait while a full one is marking, since they
+        // rely on marked meaning old.
+        if (vm.gcPhase == GC_SWEEPING && vm.nurseryBytes > GC_NURSERY_SIZE)
+        {
+            CollectNursery();
+        }
+#endif
+        return;
+    }
+#endif
+
+#ifdef GENERATIONAL_GC
+    // The old generation only grows when the nursery is promoted, so
+    // that is the only time it can outgrow nextGC.
+    if (vm.nurseryBytes > GC_NURSERY_SIZE)
+    {
+        if (vm.bytesAllocated > vm.nextGC + vm.nurseryBytes)
+        {
+            StartCollection();
+        }
+        else
+        {
+            CollectNursery();
+        }
+    }
+#else
+    if (vm.bytesAllocated > vm.nextGC)
+    {
+        StartCollection();
+    }
+#endif
+}
+
+void PrintGCPauses()
+{
+    long count = 0;
+    int first = GC_PAUSE_BUCKETS;
+    int last = -1;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        count += pauseCounts[i];
+        if (pauseCounts[i] == 0) { continue; }
+        if (first > i) { first = i; }
+        last = i;
+    }
+
+    fprintf(stderr, "gc pauses: %ld, total %.2f ms, longest %.3f ms\n",
+            count, pauseTotal / 1000, pauseLongest / 1000);
+    for (int i = first; i <= last; i++)
+    {
+        if (i < GC_PAUSE_BUCKETS - 1)
+        {
+            fprintf(stderr, "  < %6d us %8ld\n", 2 << i, pauseCounts[i]);
+        }
+        else
+        {
+            fprintf(stderr, "  >= %5d us %8ld\n", 1 << i, pauseCounts[i]);
+        }
+    }
+
+    PrintTableStats("strings", &vm.strings);
+}
+
+static void FreeList(Obj* object)
 {
-    Obj* object = vm.objects;
     while (object != NULL)
     {
         Obj* next = object->next;
         FreeObject(object);
         object = next;
     }
+}
+
+void FreeObjects()
+{
+    FreeList(vm.objects);
+#ifdef GENERATIONAL_GC
+    FreeList(vm.youngObjects);
+    free(vm.remembered);
+#endif
 
     free(vm.grayStack);
+#ifdef PARALLEL_MARKING
+    for (int i = 0; i < GC_MAX_MARK_THREADS; i++)
+    {
+        free(markers[i].gray);
+        free(markers[i].shared);
+    }
+#endif
+#ifdef POOL_ALLOCATOR
+    FreePools();
+#endif
 }
@@ -19,10 +19,79 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
 	Reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Objects go through AllocateObjectMemory and FreeObjectMemory instead of
+// Reallocate, so that with POOL_ALLOCATOR they come from the pools.
+#define FREE_OBJ(type, pointer) FreeObjectMemory(pointer, sizeof(type))
+
+#if defined(GENERATIONAL_GC) || defined(INCREMENTAL_GC)
+// Outside a collection an object's mark bit doubles as its generation:
+// survivors stay marked (see VM.markValue), so marked objects are old and
+// unmarked ones were allocated since the last collection. A minor
+// collection only traces from the roots and the remembered set, so an old
+// object that gets a young object stored in it has to be remembered. Use
+// after the store, since the store itself may have triggered a collection
+// and promoted owner.
+//
+// While an incremental collection is marking, the same test catches an
+// object it has already reached being given one it hasn't, which it would
+// otherwise never see. RememberObject puts owner back on the gray stack.
+#define WRITE_BARRIER(owner, value) \
+    do \
+    { \
+        Obj* writtenObject = (Obj*)(owner); \
+        if (writtenObject->isMarked == vm.markValue && \
+            !writtenObject->isRemembered && \
+            IS_OBJ(value) && AS_OBJ(value)->isMarked != vm.markValue) \
+        { \
+            RememberObject(writtenObject); \
+        } \
+    } while (false)
+
+// For bulk writes, like copying a table, where checking each value isn't
+// worth it.
+#define WRITE_BARRIER_ALL(owner) \
+    do \
+    { \
+        Obj* writtenObject = (Obj*)(owner); \
+        if (writtenObject->isMarked == vm.markValue && \
+            !writtenObject->isRemembered) \
+        { \
+            RememberObject(writtenObject); \
+        } \
+    } while (false)
+#else
+#define WRITE_BARRIER(owner, value) ((void)0)
+#define WRITE_BARRIER_ALL(owner) ((void)0)
+#endif
+
+#ifdef GENERATIONAL_GC
+// Globals aren't an object, so they get a single flag instead. An
+// incremental collection doesn't need it: it marks the roots again before
+// it finishes.
+#define GLOBAL_WRITE_BARRIER(value) \
+    do \
+    { \
+        if (IS_OBJ(value) && AS_OBJ(value)->isMarked != vm.markValue) \
+        { \
+            vm.globalsRemembered = true; \
+        } \
+    } while (false)
+#else
+#define GLOBAL_WRITE_BARRIER(value) ((void)0)
+#endif
+
 void* Reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* AllocateObjectMemory(size_t size);
+void FreeObjectMemory(void* pointer, size_t size);
 void MarkObject(Obj* object);
 void MarkValue(Value value);
 void CollectGarbage();
+#if defined(GENERATIONAL_GC) || defined(INCREMENTAL_GC)
+void RememberObject(Obj* object);
+#endif
+// Writes a histogram of collection pause times to stderr, followed by
+// the state of the intern table the collector prunes.
+void PrintGCPauses();
 void FreeObjects();
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -10,14 +11,30 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)AllocateObject(sizeof(type), objectType)
 
+#define ALLOCATE_FAM(type, elementType, count, objectType) \
+    (type*)AllocateObject(sizeof(type) + sizeof(elementType) * (count), \
+                          objectType)
+
 static Obj* AllocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)Reallocate(NULL, 0, size);
+    Obj* object = (Obj*)AllocateObjectMemory(size);
     object->type = type;
-    object->isMarked = false;
+    object->isMarked = !vm.markValue;
+    object->isRemembered = false;
+#if defined(INCREMENTAL_GC) && !defined(GENERATIONAL_GC)
+    // Without a nursery this goes on the list being swept, so it has to
+    // look reached. Marking doesn't need this: a new object that matters
+    // is either on the stack or stored somewhere with a write barrier.
+    if (vm.gcPhase == GC_SWEEPING) { object->isMarked = vm.markValue; }
+#endif
 
+#ifdef GENERATIONAL_GC
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
+#else
     object->next = vm.objects;
     vm.objects = object;
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -39,6 +56,8 @@ ObjClass* NewClass(ObjString* name)
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     InitTable(&klass->methods);
+    klass->version = vm.nextClassVersion++;
+    klass->instanceSlots = 0;
     return klass;
 }
 
@@ -63,6 +82,11 @@ ObjFunction* NewFunction()
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->slotCount = 0;
+    function->pendingBody = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->aot = NULL;
     function->name = NULL;
     InitChunk(&function->chunk);
     return function;
@@ -70,9 +94,13 @@ ObjFunction* NewFunction()
 
 ObjInstance* NewInstance(ObjClass* klass)
 {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    ObjInstance* instance = ALLOCATE_FAM(ObjInstance, Value,
+                                         klass->instanceSlots, OBJ_INSTANCE);
     instance->klass = klass;
-    InitTable(&instance->fields);
+    instance->shape = vm.rootShape;
+    instance->fields = instance->inlineFields;
+    instance->capacity = klass->instanceSlots;
+    instance->inlineCapacity = klass->instanceSlots;
     return instance;
 }
 
@@ -83,44 +111,124 @@ ObjNative* NewNative(NativeFn function)
     return native;
 }
 
-static ObjString* AllocateString(char* chars, int length, uint32_t hash)
+ObjShape* NewShape(ObjShape* parent, ObjString* name)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    InitTable(&shape->transitions);
+    return shape;
+}
 
-    Push(OBJ_VAL(string));
-    TableSet(&vm.strings, string, NIL_VAL);
+ObjShape* ShapeTransition(ObjShape* shape, ObjString* name)
+{
+    Value child;
+    if (TableGet(&shape->transitions, name, &child))
+    {
+        return AS_SHAPE(child);
+    }
+
+    ObjShape* created = NewShape(shape, name);
+    Push(OBJ_VAL(created));
+    TableSet(&shape->transitions, name, OBJ_VAL(created));
+    WRITE_BARRIER(shape, OBJ_VAL(created));
     Pop();
+    return created;
+}
+
+int ShapeFindSlot(ObjShape* shape, ObjString* name)
+{
+    for (; shape->name != NULL; shape = shape->parent)
+    {
+        if (shape->name == name) { return shape->slotCount - 1; }
+    }
+
+    return -1;
+}
+
+// Appends value as the last field of shape, which must be a child of
+// instance's current shape. value has to be reachable by the GC because
+// growing the field array may trigger a collection.
+void AddField(ObjInstance* instance, ObjShape* shape, Value value)
+{
+    int slot = shape->slotCount - 1;
+    if (slot >= instance->capacity)
+    {
+        int capacity = GROW_CAPACITY(instance->capacity);
+        if (instance->fields == instance->inlineFields)
+        {
+            Value* fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->inlineFields,
+                   sizeof(Value) * instance->inlineCapacity);
+            instance->fields = fields;
+        }
+        else
+        {
+            instance->fields = GROW_ARRAY(Value, instance->fields,
+                                          instance->capacity, capacity);
+        }
+        instance->capacity = capacity;
+    }
 
+    instance->fields[slot] = value;
+    instance->shape = shape;
+    WRITE_BARRIER(instance, value);
+    WRITE_BARRIER(instance, OBJ_VAL(shape));
+
+    if (instance->klass->instanceSlots < shape->slotCount)
+    {
+        instance->klass->instanceSlots = shape->slotCount;
+    }
+}
+
+ObjString* AllocateString(int length)
+{
+    ObjString* string = ALLOCATE_FAM(ObjString, char, length + 1, OBJ_STRING);
+    string->length = length;
+    string->hash = 0;
+    string->isInterned = false;
+    string->chars[length] = '\0';
     return string;
 }
 
+// A multiply-and-shift mix over eight bytes at a time, in the style of
+// wyhash but without its 128-bit multiply, which MSVC's C compiler lacks.
+// Never returns 0, which ObjString.hash uses for "not computed yet".
 static uint32_t HashString(const char* key, int length)
 {
-    uint32_t hash = 2166136261u;
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ (uint64_t)length;
 
-    for (int i = 0; i < length; i++)
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+        hash ^= hash >> 31;
     }
 
-    return hash;
+    if (i < length)
+    {
+        uint64_t word = 0;
+        memcpy(&word, key + i, length - i);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+        hash ^= hash >> 31;
+    }
+
+    // Tables index with the low bits, so fold the high ones in.
+    hash *= 0x94d049bb133111ebu;
+    hash ^= hash >> 32;
+    return (uint32_t)hash != 0 ? (uint32_t)hash : 1;
 }
 
-ObjString* TakeString(char* chars, int length)
+static uint32_t StringHash(ObjString* string)
 {
-    uint32_t hash = HashString(chars, length);
-    ObjString* interned = TableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL)
+    if (string->hash == 0)
     {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+        string->hash = HashString(string->chars, string->length);
     }
-
-    return AllocateString(chars, length, hash);
+    return string->hash;
 }
 
 ObjString* CopyString(const char* chars, int length)
@@ -129,11 +237,140 @@ ObjString* CopyString(const char* chars, int length)
     ObjString* interned = TableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) { return interned; }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    ObjString* string = AllocateString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->isInterned = true;
 
-    return AllocateString(heapChars, length, hash);
+    Push(OBJ_VAL(string));
+    TableSet(&vm.strings, string, NIL_VAL);
+    Pop();
+
+    return string;
+}
+
+static int StringLength(Obj* string)
+{
+    return string->type == OBJ_STRING ? ((ObjString*)string)->length
+                                      : ((ObjRope*)string)->length;
+}
+
+ObjRope* NewRope(Obj* left, Obj* right)
+{
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = StringLength(left) + StringLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+// Calls visit with each flat piece of a rope, in order. Uses a stack of
+// its own, since a rope built up in a loop is as deep as the loop is long.
+// visit must not allocate.
+static void VisitPieces(ObjRope* rope,
+                        void (*visit)(ObjString* piece, void* context),
+                        void* context)
+{
+    Obj* initialStack[64];
+    Obj** stack = initialStack;
+    int capacity = 64;
+    int count = 0;
+
+    stack[count++] = (Obj*)rope;
+    while (count > 0)
+    {
+        Obj* node = stack[--count];
+        if (node->type == OBJ_STRING)
+        {
+            visit((ObjString*)node, context);
+            continue;
+        }
+
+        ObjRope* inner = (ObjRope*)node;
+        if (inner->flat != NULL)
+        {
+            visit(inner->flat, context);
+            continue;
+        }
+
+        if (capacity < count + 2)
+        {
+            capacity *= 2;
+            Obj** grown = (Obj**)malloc(sizeof(Obj*) * capacity);
+            if (grown == NULL) { exit(1); }
+            memcpy(grown, stack, sizeof(Obj*) * count);
+            if (stack != initialStack) { free(stack); }
+            stack = grown;
+        }
+        stack[count++] = inner->right;
+        stack[count++] = inner->left;
+    }
+
+    if (stack != initialStack) { free(stack); }
+}
+
+static void CopyPiece(ObjString* piece, void* context)
+{
+    char** end = (char**)context;
+    memcpy(*end, piece->chars, piece->length);
+    *end += piece->length;
+}
+
+ObjString* FlattenString(Value value)
+{
+    if (IS_STRING(value)) { return AS_STRING(value); }
+
+    ObjRope* rope = AS_ROPE(value);
+    if (rope->flat != NULL) { return rope->flat; }
+
+    Push(value);
+    ObjString* string = AllocateString(rope->length);
+    char* end = string->chars;
+    VisitPieces(rope, CopyPiece, &end);
+
+    // The pieces aren't needed any more.
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    WRITE_BARRIER(rope, OBJ_VAL(string));
+    Pop();
+
+    return string;
+}
+
+static bool StringsEqual(ObjString* a, ObjString* b)
+{
+    // Interned strings with the same characters are the same string.
+    if (a == b) { return true; }
+    if (a->isInterned && b->isInterned) { return false; }
+    return a->length == b->length && StringHash(a) == StringHash(b) &&
+           memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+bool ObjectsEqual(Obj* a, Obj* b)
+{
+    if (a->type == OBJ_STRING && b->type == OBJ_STRING)
+    {
+        return StringsEqual((ObjString*)a, (ObjString*)b);
+    }
+
+    if (!IS_ANY_STRING(OBJ_VAL(a)) || !IS_ANY_STRING(OBJ_VAL(b)) ||
+        StringLength(a) != StringLength(b))
+    {
+        return false;
+    }
+
+    // At least one is a rope. Flattening either one can collect, so keep
+    // both reachable until they have been compared.
+    Push(OBJ_VAL(a));
+    Push(OBJ_VAL(b));
+    ObjString* flatA = FlattenString(OBJ_VAL(a));
+    ObjString* flatB = FlattenString(OBJ_VAL(b));
+    Pop();
+    Pop();
+
+    return StringsEqual(flatA, flatB);
 }
 
 ObjUpvalue* NewUpvalue(Value* slot)
@@ -155,6 +392,11 @@ static void PrintFunction(ObjFunction* function)
     printf("<fn %s>", function->name->chars);
 }
 
+static void PrintPiece(ObjString* piece, void* context)
+{
+    printf("%.*s", piece->length, piece->chars);
+}
+
 void PrintObject(Value value)
 {
     switch (OBJ_TYPE(value))
@@ -177,6 +419,14 @@ void PrintObject(Value value)
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_ROPE:
+            // Written out piece by piece rather than flattened: printing
+            // must not allocate, since the GC logs objects with it.
+            VisitPieces(AS_ROPE(value), PrintPiece, NULL);
+            break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
@@ -14,7 +14,11 @@
 #define IS_FUNCTION(value)     IsObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     IsObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)       IsObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)         IsObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)        IsObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       IsObjType(value, OBJ_STRING)
+// Ropes are strings as far as Lox is concerned.
+#define IS_ANY_STRING(value)   (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -23,6 +27,8 @@
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -34,6 +40,8 @@ typedef enum
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SHAPE,
 	OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
@@ -42,6 +50,8 @@ struct Obj
 {
 	ObjType type;
     bool isMarked;
+    // Already in vm.remembered. Only used by GENERATIONAL_GC.
+    bool isRemembered;
     struct Obj* next;
 };
 
@@ -50,8 +60,24 @@ typedef struct
     Obj obj;
     int arity;
     int upvalueCount;
+    // Most values the frame holds on the stack at once: the callee slot,
+    // locals and temporaries.
+    int slotCount;
     Chunk chunk;
     ObjString* name;
+    // Functions loaded from a mapped image start out with only their code;
+    // this points at the rest of their record until the first call reads
+    // it. NULL once the chunk is complete.
+    const uint8_t* pendingBody;
+    // Calls plus loop back-edges run so far, counting up to JIT_THRESHOLD,
+    // then -1 once the function has been compiled or turned down.
+    int hotness;
+    // Machine code for the function, or NULL. Only used with JIT.
+    struct JitCode* jit;
+    // In programs built from --emit-c output, the C function the function
+    // was compiled to. It runs the top frame until it returns, and returns
+    // false after a runtime error.
+    bool (*aot)();
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -66,10 +92,30 @@ struct ObjString
 {
 	Obj obj;
 	int length;
-	char* chars;
+    // 0 until something needs it. Strings are only hashed up front when
+    // they are interned, which is only done for names and literals.
     uint32_t hash;
+    // Two different interned strings never have the same characters.
+    bool isInterned;
+    // length characters and a terminating '\0', stored in the object.
+    char chars[];
 };
 
+// The result of a concatenation whose characters haven't been needed yet,
+// so that building a string piece by piece doesn't copy it each time. A
+// rope is a string as far as Lox can tell; it is only flattened into an
+// ObjString when compared.
+typedef struct
+{
+    Obj obj;
+    int length;
+    // Each an ObjString or ObjRope, until the rope has been flattened.
+    Obj* left;
+    Obj* right;
+    // The flattened string once there is one, else NULL.
+    ObjString* flat;
+} ObjRope;
+
 typedef struct ObjUpvalue
 {
     Obj obj;
@@ -86,18 +132,44 @@ typedef struct
     int upvalueCount;
 } ObjClosure;
 
+// A hidden class. Instances that added the same fields in the same order
+// share a shape, and a field's slot in ObjInstance.fields is fixed by the
+// shape. Shapes form a tree rooted at vm.rootShape: each one is its
+// parent plus the field `name`, and transitions maps the next field name
+// to the child shape.
+struct ObjShape
+{
+    Obj obj;
+    ObjShape* parent;
+    ObjString* name;
+    int slotCount;
+    Table transitions;
+};
+
 typedef struct
 {
     Obj obj;
     ObjString* name;
     Table methods;
+    // Unique across every class and bumped whenever methods changes, so
+    // inline caches can tell a stale entry from a live one.
+    uint32_t version;
+    // How many field slots new instances get inline: the most fields any
+    // instance of this class has needed so far.
+    int instanceSlots;
 } ObjClass;
 
 typedef struct
 {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    // Points at inlineFields until the instance outgrows them, then at a
+    // separately allocated array of capacity values.
+    Value* fields;
+    int capacity;
+    int inlineCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct
@@ -114,8 +186,23 @@ ObjClosure* NewClosure(ObjFunction* function);
 ObjFunction* NewFunction();
 ObjInstance* NewInstance(ObjClass* klass);
 ObjNative* NewNative(NativeFn function);
-ObjString* TakeString(char* chars, int length);
+ObjShape* NewShape(ObjShape* parent, ObjString* name);
+ObjShape* ShapeTransition(ObjShape* shape, ObjString* name);
+int ShapeFindSlot(ObjShape* shape, ObjString* name);
+void AddField(ObjInstance* instance, ObjShape* shape, Value value);
+// Returns a string with room for length characters, for the caller to
+// fill in.
+ObjString* AllocateString(int length);
+// Returns the interned string with these characters. Table keys must be
+// interned, since tables compare keys by identity. Literals are too, so
+// that comparing them is a pointer comparison.
 ObjString* CopyString(const char* chars, int length);
+ObjRope* NewRope(Obj* left, Obj* right);
+// Returns a flat string with the characters of a string or rope.
+ObjString* FlattenString(Value value);
+// Compares two objects that aren't the same one, which can only be equal
+// if both are strings or ropes with the same characters.
+bool ObjectsEqual(Obj* a, Obj* b);
 ObjUpvalue* NewUpvalue(Value* slot);
 void PrintObject(Value value);
 
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// A jump in the rewritten code whose operand still has to be pointed at
+// the new location of its old target.
+typedef struct
+{
+    int offset;
+    int oldTarget;
+} JumpPatch;
+
+typedef struct
+{
+    Chunk* chunk;
+    bool* isTarget;
+    Chunk output;
+    JumpPatch* patches;
+    int patchCount;
+} Optimizer;
+
+int InstructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCAL_CONST:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+            return 5;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+            return 6;
+        case OP_INVOKE_LONG:
+            return 7;
+        case OP_CLOSURE:
+        {
+            ObjFunction* function = AS_FUNCTION(
+                chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE_LONG:
+        {
+            int constant = (chunk->code[offset + 1] << 16) |
+                           (chunk->code[offset + 2] << 8) |
+                           chunk->code[offset + 3];
+            ObjFunction* function = AS_FUNCTION(
+                chunk->constants.values[constant]);
+            return 4 + function->upvalueCount * 4;
+        }
+        default:
+            return 1;
+    }
+}
+
+static bool IsJump(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int JumpTarget(Chunk* chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP
+        ? offset + 3 - jump
+        : offset + 3 + jump;
+}
+
+// True if the instruction at offset is op and nothing jumps to it, so it
+// can be folded into the instruction before it.
+static bool Follows(Optimizer* optimizer, int offset, OpCode op)
+{
+    return offset < optimizer->chunk->count &&
+           !optimizer->isTarget[offset] &&
+           optimizer->chunk->code[offset] == op;
+}
+
+static void Emit(Optimizer* optimizer, uint8_t byte, int line)
+{
+    WriteChunk(&optimizer->output, byte, line);
+}
+
+static void EmitJump(Optimizer* optimizer, uint8_t instruction,
+                     int oldTarget, int line)
+{
+    JumpPatch* patch = &optimizer->patches[optimizer->patchCount++];
+    patch->offset = optimizer->output.count;
+    patch->oldTarget = oldTarget;
+
+    Emit(optimizer, instruction, line);
+    Emit(optimizer, 0xff, line);
+    Emit(optimizer, 0xff, line);
+}
+
+// GET_LOCAL x, CONSTANT k, ADD, SET_LOCAL x, POP
+// => ADD_LOCAL_CONST x k
+//
+// Only for numeric constants, which keeps the "two numbers or two
+// strings" check a single IS_NUMBER test on the local.
+static int FuseAddLocalConst(Optimizer* optimizer, int offset)
+{
+    Chunk* chunk = optimizer->chunk;
+    if (!Follows(optimizer, offset + 2, OP_CONSTANT) ||
+        !Follows(optimizer, offset + 4, OP_ADD) ||
+        !Follows(optimizer, offset + 5, OP_SET_LOCAL) ||
+        !Follows(optimizer, offset + 7, OP_POP))
+    {
+        return 0;
+    }
+
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    if (chunk->code[offset + 6] != slot ||
+        !IS_NUMBER(chunk->constants.values[constant]))
+    {
+        return 0;
+    }
+
+    // Errors come from the ADD, which may be on a later line than the
+    // local it reads.
+    int addLine = GetLine(chunk, offset + 4);
+    Emit(optimizer, OP_ADD_LOCAL_CONST, addLine);
+    Emit(optimizer, slot, addLine);
+    Emit(optimizer, constant, addLine);
+    return 8;
+}
+
+// EQUAL/LESS/GREATER, optionally followed by NOT, optionally followed by
+// JUMP_IF_FALSE and the POP of the condition.
+static int FuseComparison(Optimizer* optimizer, int offset, int line)
+{
+    Chunk* chunk = optimizer->chunk;
+    uint8_t compare;
+    uint8_t compareJump;
+    int length = 1;
+
+    switch (chunk->code[offset])
+    {
+        case OP_EQUAL:
+            compare = OP_EQUAL;
+            compareJump = OP_EQUAL_JUMP_IF_FALSE;
+            if (Follows(optimizer, offset + 1, OP_NOT))
+            {
+                compare = OP_NOT_EQUAL;
+                compareJump = OP_NOT_EQUAL_JUMP_IF_FALSE;
+                length = 2;
+            }
+            break;
+        case OP_LESS:
+            compare = OP_LESS;
+            compareJump = OP_LESS_JUMP_IF_FALSE;
+            if (Follows(optimizer, offset + 1, OP_NOT))
+            {
+                compare = OP_GREATER_EQUAL;
+                compareJump = OP_GREATER_EQUAL_JUMP_IF_FALSE;
+                length = 2;
+            }
+            break;
+        case OP_GREATER:
+            compare = OP_GREATER;
+            compareJump = OP_GREATER_JUMP_IF_FALSE;
+            if (Follows(optimizer, offset + 1, OP_NOT))
+            {
+                compare = OP_LESS_EQUAL;
+                compareJump = OP_LESS_EQUAL_JUMP_IF_FALSE;
+                length = 2;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    // JUMP_IF_FALSE leaves the condition on the stack, so both the
+    // fallthrough and the target start with a POP. The fused instruction
+    // pops the operands itself and lands just past the target's POP,
+    // which stays in place for any other jump that reaches it.
+    int jump = offset + length;
+    if (Follows(optimizer, jump, OP_JUMP_IF_FALSE) &&
+        Follows(optimizer, jump + 3, OP_POP))
+    {
+        int target = JumpTarget(chunk, jump);
+        if (target < chunk->count && chunk->code[target] == OP_POP)
+        {
+            EmitJump(optimizer, compareJump, target + 1, line);
+            return length + 4;
+        }
+    }
+
+    if (length == 1) { return 0; }
+
+    Emit(optimizer, compare, line);
+    return length;
+}
+
+void OptimizeChunk(Chunk* chunk)
+{
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    optimizer.isTarget = ALLOCATE(bool, chunk->count + 1);
+    optimizer.patches = ALLOCATE(JumpPatch, chunk->count);
+    optimizer.patchCount = 0;
+    InitChunk(&optimizer.output);
+
+    for (int offset = 0; offset <= chunk->count; offset++)
+    {
+        optimizer.isTarget[offset] = false;
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += InstructionLength(chunk, offset))
+    {
+        if (IsJump(chunk->code[offset]))
+        {
+            optimizer.isTarget[JumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    // Where each old instruction ended up. Only instruction starts and the
+    // end of the chunk are filled in, which is all a jump can target.
+    int* newOffsets = ALLOCATE(int, chunk->count + 1);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        newOffsets[offset] = optimizer.output.count;
+        int line = GetLine(chunk, offset);
+        uint8_t instruction = chunk->code[offset];
+
+        int fused = 0;
+        if (instruction == OP_GET_LOCAL)
+        {
+            fused = FuseAddLocalConst(&optimizer, offset);
+        }
+        else
+        {
+            fused = FuseComparison(&optimizer, offset, line);
+        }
+
+        if (fused > 0)
+        {
+            offset += fused;
+            continue;
+        }
+
+        int length = InstructionLength(chunk, offset);
+        if (IsJump(instruction))
+        {
+            EmitJump(&optimizer, instruction,
+                     JumpTarget(chunk, offset), line);
+        }
+        else
+        {
+            for (int i = 0; i < length; i++)
+            {
+                Emit(&optimizer, chunk->code[offset + i], line);
+            }
+        }
+        offset += length;
+    }
+    newOffsets[chunk->count] = optimizer.output.count;
+
+    // Fusing only ever removes bytes, so every patched jump is at most as
+    // long as it was and still fits in 16 bits.
+    Chunk* output = &optimizer.output;
+    for (int i = 0; i < optimizer.patchCount; i++)
+    {
+        JumpPatch* patch = &optimizer.patches[i];
+        int target = newOffsets[patch->oldTarget];
+        int jump = output->code[patch->offset] == OP_LOOP
+            ? patch->offset + 3 - target
+            : target - (patch->offset + 3);
+        output->code[patch->offset + 1] = (jump >> 8) & 0xff;
+        output->code[patch->offset + 2] = jump & 0xff;
+    }
+
+    FREE_ARRAY(int, newOffsets, chunk->count + 1);
+    FREE_ARRAY(JumpPatch, optimizer.patches, chunk->count);
+    FREE_ARRAY(bool, optimizer.isTarget, chunk->count + 1);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = output->code;
+    chunk->count = output->count;
+    chunk->capacity = output->capacity;
+    chunk->lines = output->lines;
+    chunk->lineCount = output->lineCount;
+    chunk->lineCapacity = output->lineCapacity;
+}
+
+// How far the instruction at offset moves the stack top.
+static int StackEffect(Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+            return -1;
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+            return -code[2];
+        case OP_INVOKE_LONG:
+            return -code[4];
+        // The superclass goes as well as the arguments.
+        case OP_SUPER_INVOKE:
+            return -code[2] - 1;
+        case OP_SUPER_INVOKE_LONG:
+            return -code[4] - 1;
+        default:
+            return 0;
+    }
+}
+
+int MaxStackDepth(Chunk* chunk, int startDepth)
+{
+    // The depth each jump expects to find at its target. Code is scanned
+    // in order, and every forward jump is seen before the code it lands
+    // on. Loops jump back to code that has already been scanned.
+    int* targetDepths = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++)
+    {
+        targetDepths[offset] = 0;
+    }
+
+    int depth = startDepth;
+    int maxDepth = startDepth;
+    for (int offset = 0; offset < chunk->count;
+         offset += InstructionLength(chunk, offset))
+    {
+        // Code straight after an unconditional jump or a return is only
+        // reached through a jump, and gets the depth that jump left.
+        if (targetDepths[offset] > depth) { depth = targetDepths[offset]; }
+
+        depth += StackEffect(chunk, offset);
+        if (depth > maxDepth) { maxDepth = depth; }
+
+        uint8_t instruction = chunk->code[offset];
+        if (instruction != OP_LOOP &&
+            (IsJump(instruction) ||
+             (instruction >= OP_EQUAL_JUMP_IF_FALSE &&
+              instruction <= OP_GREATER_EQUAL_JUMP_IF_FALSE)))
+        {
+            int target = JumpTarget(chunk, offset);
+            if (targetDepths[target] < depth) { targetDepths[target] = depth; }
+        }
+    }
+
+    FREE_ARRAY(int, targetDepths, chunk->count + 1);
+    return maxDepth;
+}
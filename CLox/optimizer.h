@@ -0,0 +1,12 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void OptimizeChunk(Chunk* chunk);
+int InstructionLength(Chunk* chunk, int offset);
+// The most values a frame running chunk has on the stack at once, counting
+// the startDepth it begins with (the callee and its arguments).
+int MaxStackDepth(Chunk* chunk, int startDepth);
+
+#endif
@@ -0,0 +1,799 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "registers.h"
+#include "vm.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// Translation walks the stack code once, keeping a model of the stack.
+// Each entry says where the value that the stack code would have at that
+// depth actually is. Values are only copied into their own register when
+// something needs them there: a jump, a call, or a write to the local
+// they were read from. Everything else reads them where they are, so
+// GET_LOCAL a, GET_LOCAL b, ADD, SET_LOCAL c, POP becomes ADD c, a, b.
+typedef enum
+{
+    // In the register at its own depth.
+    ENTRY_TEMP,
+    // Still in the register given, a local below it.
+    ENTRY_REGISTER,
+    // A constant that hasn't been loaded anywhere.
+    ENTRY_CONSTANT
+} EntryKind;
+
+typedef struct
+{
+    EntryKind kind;
+    uint32_t operand;
+} StackEntry;
+
+// A forward jump whose target unit isn't known yet.
+typedef struct
+{
+    int unit;
+    int oldTarget;
+} RegisterPatch;
+
+typedef struct
+{
+    Chunk* chunk;
+    RegisterCode* output;
+
+    StackEntry* stack;
+    int depth;
+    // No entry below this is anything but ENTRY_TEMP.
+    int pendingFrom;
+
+    // Where each stack instruction starts in the output, and the depth a
+    // forward jump to it arrives with, or -1.
+    int* newOffsets;
+    int* targetDepths;
+    bool* isTarget;
+    RegisterPatch* patches;
+    int patchCount;
+
+    // The destination operand of the last instruction, and the register
+    // it named, while that is still the top of the stack. A following
+    // SET_LOCAL can point the instruction at the local instead.
+    int lastDst;
+    int lastDstRegister;
+
+    int origin;
+    int nilConstant;
+    int trueConstant;
+    int falseConstant;
+} Translator;
+
+static void Emit(Translator* translator, uint32_t unit)
+{
+    RegisterCode* output = translator->output;
+    if (output->capacity < output->count + 1)
+    {
+        int oldCapacity = output->capacity;
+        output->capacity = GROW_CAPACITY(oldCapacity);
+        output->code = GROW_ARRAY(uint32_t, output->code,
+                                  oldCapacity, output->capacity);
+        output->origins = GROW_ARRAY(int, output->origins,
+                                     oldCapacity, output->capacity);
+    }
+
+    output->code[output->count] = unit;
+    output->origins[output->count] = translator->origin;
+    output->count++;
+}
+
+static void EmitOp(Translator* translator, RegisterOpCode op)
+{
+    translator->lastDst = -1;
+    Emit(translator, op);
+}
+
+// Emits the destination operand of an instruction that only writes that
+// register, so that it can be retargeted.
+static void EmitDst(Translator* translator, int reg)
+{
+    translator->lastDst = translator->output->count;
+    translator->lastDstRegister = reg;
+    Emit(translator, (uint32_t)reg);
+}
+
+static void EmitForwardJump(Translator* translator, int oldTarget)
+{
+    RegisterPatch* patch = &translator->patches[translator->patchCount++];
+    patch->unit = translator->output->count;
+    patch->oldTarget = oldTarget;
+    Emit(translator, 0);
+
+    translator->targetDepths[oldTarget] = translator->depth;
+}
+
+static uint32_t RK(Translator* translator, StackEntry* entry)
+{
+    switch (entry->kind)
+    {
+        case ENTRY_REGISTER: return entry->operand;
+        case ENTRY_CONSTANT: return entry->operand | RK_CONSTANT;
+        default:             return (uint32_t)(entry - translator->stack);
+    }
+}
+
+static void Materialize(Translator* translator, int index)
+{
+    StackEntry* entry = &translator->stack[index];
+    if (entry->kind == ENTRY_TEMP) { return; }
+
+    EmitOp(translator, REG_MOVE);
+    EmitDst(translator, index);
+    Emit(translator, RK(translator, entry));
+    entry->kind = ENTRY_TEMP;
+}
+
+// Puts every value below the top count entries in its own register, so
+// that all registers under them hold live values.
+static void MaterializeBelow(Translator* translator, int count)
+{
+    int end = translator->depth - count;
+    for (int i = translator->pendingFrom; i < end; i++)
+    {
+        Materialize(translator, i);
+    }
+    if (translator->pendingFrom < end) { translator->pendingFrom = end; }
+}
+
+static void MaterializeAll(Translator* translator)
+{
+    MaterializeBelow(translator, 0);
+}
+
+// Called before reg is written: nothing still pending may be reading it.
+static void WillWrite(Translator* translator, int reg, int except)
+{
+    for (int i = translator->pendingFrom; i < translator->depth; i++)
+    {
+        StackEntry* entry = &translator->stack[i];
+        if (i != except && entry->kind == ENTRY_REGISTER &&
+            entry->operand == (uint32_t)reg)
+        {
+            Materialize(translator, i);
+        }
+    }
+    translator->stack[reg].kind = ENTRY_TEMP;
+}
+
+static void PushEntry(Translator* translator, EntryKind kind, uint32_t operand)
+{
+    StackEntry* entry = &translator->stack[translator->depth];
+    entry->kind = kind;
+    entry->operand = operand;
+    if (kind != ENTRY_TEMP && translator->pendingFrom > translator->depth)
+    {
+        translator->pendingFrom = translator->depth;
+    }
+    translator->depth++;
+}
+
+static StackEntry* PopEntry(Translator* translator)
+{
+    translator->depth--;
+    if (translator->pendingFrom > translator->depth)
+    {
+        translator->pendingFrom = translator->depth;
+    }
+    return &translator->stack[translator->depth];
+}
+
+static StackEntry* PeekEntry(Translator* translator, int distance)
+{
+    return &translator->stack[translator->depth - 1 - distance];
+}
+
+static void PushLiteral(Translator* translator, int* constant, Value value)
+{
+    if (*constant == -1)
+    {
+        *constant = AddConstant(translator->chunk, value);
+    }
+    PushEntry(translator, ENTRY_CONSTANT, (uint32_t)*constant);
+}
+
+static void GetLocal(Translator* translator, int slot)
+{
+    Materialize(translator, slot);
+    PushEntry(translator, ENTRY_REGISTER, (uint32_t)slot);
+}
+
+static void SetLocal(Translator* translator, int slot)
+{
+    StackEntry* top = PeekEntry(translator, 0);
+    int topIndex = translator->depth - 1;
+    if (top->kind == ENTRY_REGISTER && top->operand == (uint32_t)slot)
+    {
+        return;
+    }
+
+    bool canRetarget = top->kind == ENTRY_TEMP &&
+                       translator->lastDst != -1 &&
+                       translator->lastDstRegister == topIndex;
+    for (int i = translator->pendingFrom; canRetarget && i < topIndex; i++)
+    {
+        StackEntry* entry = &translator->stack[i];
+        if (entry->kind == ENTRY_REGISTER && entry->operand == (uint32_t)slot)
+        {
+            canRetarget = false;
+        }
+    }
+
+    if (canRetarget)
+    {
+        translator->output->code[translator->lastDst] = (uint32_t)slot;
+        translator->stack[slot].kind = ENTRY_TEMP;
+        top->kind = ENTRY_REGISTER;
+        top->operand = (uint32_t)slot;
+        translator->lastDst = -1;
+        if (translator->pendingFrom > topIndex)
+        {
+            translator->pendingFrom = topIndex;
+        }
+        return;
+    }
+
+    uint32_t value = RK(translator, top);
+    WillWrite(translator, slot, topIndex);
+    EmitOp(translator, REG_MOVE);
+    Emit(translator, (uint32_t)slot);
+    Emit(translator, value);
+}
+
+// The result of a binary instruction goes where its left operand was.
+static void Binary(Translator* translator, RegisterOpCode op, bool canCollect)
+{
+    if (canCollect) { MaterializeBelow(translator, 2); }
+    uint32_t b = RK(translator, PopEntry(translator));
+    uint32_t a = RK(translator, PopEntry(translator));
+    int dst = translator->depth;
+
+    EmitOp(translator, op);
+    EmitDst(translator, dst);
+    Emit(translator, a);
+    Emit(translator, b);
+    if (canCollect) { Emit(translator, (uint32_t)dst); }
+    PushEntry(translator, ENTRY_TEMP, 0);
+}
+
+static void Unary(Translator* translator, RegisterOpCode op)
+{
+    uint32_t a = RK(translator, PopEntry(translator));
+    int dst = translator->depth;
+
+    EmitOp(translator, op);
+    EmitDst(translator, dst);
+    Emit(translator, a);
+    PushEntry(translator, ENTRY_TEMP, 0);
+}
+
+static void CompareJump(Translator* translator, RegisterOpCode op,
+                        bool canCollect, int target)
+{
+    // Both ways out see the same registers.
+    MaterializeBelow(translator, 2);
+    uint32_t b = RK(translator, PopEntry(translator));
+    uint32_t a = RK(translator, PopEntry(translator));
+
+    EmitOp(translator, op);
+    Emit(translator, a);
+    Emit(translator, b);
+    EmitForwardJump(translator, target);
+    if (canCollect) { Emit(translator, (uint32_t)translator->depth); }
+}
+
+static int ReadShort(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int ReadLong(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 16) |
+           (chunk->code[offset + 1] << 8) |
+           chunk->code[offset + 2];
+}
+
+// Where the jump at offset goes, or -1 if it isn't one.
+static int JumpTarget(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_LOOP:
+            return offset + 3 - ReadShort(chunk, offset + 1);
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            return offset + 3 + ReadShort(chunk, offset + 1);
+        default:
+            return -1;
+    }
+}
+
+static bool EndsBlock(uint8_t instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_LOOP ||
+           instruction == OP_RETURN;
+}
+
+// Marks the targets of the jumps that can run. A jump in dead code, like
+// one after a return, must not revive its target: nothing on the path
+// to it recorded the stack depth there.
+static void MarkLiveTargets(Chunk* chunk, bool* isTarget)
+{
+    bool* live = ALLOCATE(bool, chunk->count + 1);
+    int* pending = ALLOCATE(int, chunk->count + 1);
+    int pendingCount = 0;
+    for (int offset = 0; offset <= chunk->count; offset++)
+    {
+        live[offset] = false;
+    }
+
+    live[0] = true;
+    pending[pendingCount++] = 0;
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        while (offset < chunk->count)
+        {
+            int target = JumpTarget(chunk, offset);
+            if (target != -1)
+            {
+                isTarget[target] = true;
+                if (!live[target])
+                {
+                    live[target] = true;
+                    pending[pendingCount++] = target;
+                }
+            }
+            if (EndsBlock(chunk->code[offset])) { break; }
+
+            offset += InstructionLength(chunk, offset);
+            if (live[offset]) { break; }
+            live[offset] = true;
+        }
+    }
+
+    FREE_ARRAY(int, pending, chunk->count + 1);
+    FREE_ARRAY(bool, live, chunk->count + 1);
+}
+
+// Translates the instruction at offset and returns its length.
+static int TranslateInstruction(Translator* translator, int offset)
+{
+    Chunk* chunk = translator->chunk;
+    uint8_t* code = chunk->code + offset;
+    int length = InstructionLength(chunk, offset);
+    bool isLong = false;
+
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+            PushEntry(translator, ENTRY_CONSTANT, code[1]);
+            break;
+        case OP_CONSTANT_LONG:
+            PushEntry(translator, ENTRY_CONSTANT, (uint32_t)ReadLong(chunk, offset + 1));
+            break;
+        case OP_NIL:
+            PushLiteral(translator, &translator->nilConstant, NIL_VAL);
+            break;
+        case OP_TRUE:
+            PushLiteral(translator, &translator->trueConstant, BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            PushLiteral(translator, &translator->falseConstant,
+                        BOOL_VAL(false));
+            break;
+        case OP_POP:
+            PopEntry(translator);
+            break;
+
+        case OP_GET_LOCAL:      GetLocal(translator, code[1]); break;
+        case OP_GET_LOCAL_LONG: GetLocal(translator, ReadLong(chunk, offset + 1)); break;
+        case OP_SET_LOCAL:      SetLocal(translator, code[1]); break;
+        case OP_SET_LOCAL_LONG: SetLocal(translator, ReadLong(chunk, offset + 1)); break;
+
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        {
+            bool isGlobal = code[0] == OP_GET_GLOBAL ||
+                            code[0] == OP_GET_GLOBAL_LONG;
+            int dst = translator->depth;
+            EmitOp(translator, isGlobal ? REG_GET_GLOBAL : REG_GET_UPVALUE);
+            EmitDst(translator, dst);
+            Emit(translator, isLong ? ReadLong(chunk, offset + 1) : code[1]);
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        {
+            RegisterOpCode op;
+            switch (code[0])
+            {
+                case OP_DEFINE_GLOBAL:
+                case OP_DEFINE_GLOBAL_LONG: op = REG_DEFINE_GLOBAL; break;
+                case OP_SET_GLOBAL:
+                case OP_SET_GLOBAL_LONG:    op = REG_SET_GLOBAL; break;
+                default:                    op = REG_SET_UPVALUE; break;
+            }
+            EmitOp(translator, op);
+            Emit(translator, isLong ? ReadLong(chunk, offset + 1) : code[1]);
+            Emit(translator, RK(translator, PeekEntry(translator, 0)));
+            if (op == REG_DEFINE_GLOBAL) { PopEntry(translator); }
+            break;
+        }
+
+        case OP_GET_PROPERTY_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_GET_PROPERTY:
+        {
+            MaterializeBelow(translator, 1);
+            uint32_t object = RK(translator, PopEntry(translator));
+            int dst = translator->depth;
+            EmitOp(translator, REG_GET_PROPERTY);
+            EmitDst(translator, dst);
+            Emit(translator, object);
+            Emit(translator, isLong ? ReadLong(chunk, offset + 1) : code[1]);
+            Emit(translator, ReadShort(chunk, offset + (isLong ? 4 : 2)));
+            Emit(translator, (uint32_t)dst);
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_SET_PROPERTY_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_SET_PROPERTY:
+        {
+            MaterializeBelow(translator, 2);
+            uint32_t value = RK(translator, PopEntry(translator));
+            uint32_t object = RK(translator, PopEntry(translator));
+            EmitOp(translator, REG_SET_PROPERTY);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, object);
+            Emit(translator, value);
+            Emit(translator, isLong ? ReadLong(chunk, offset + 1) : code[1]);
+            Emit(translator, ReadShort(chunk, offset + (isLong ? 4 : 2)));
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_GET_SUPER_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_GET_SUPER:
+        {
+            MaterializeAll(translator);
+            PopEntry(translator);
+            PopEntry(translator);
+            EmitOp(translator, REG_GET_SUPER);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, isLong ? ReadLong(chunk, offset + 1) : code[1]);
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_EQUAL:         Binary(translator, REG_EQUAL, true); break;
+        case OP_NOT_EQUAL:     Binary(translator, REG_NOT_EQUAL, true); break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:   Binary(translator, REG_GREATER, false); break;
+        case OP_GREATER_EQUAL: Binary(translator, REG_GREATER_EQUAL, false); break;
+        case OP_LESS:
+        case OP_LESS_NUM:      Binary(translator, REG_LESS, false); break;
+        case OP_LESS_EQUAL:    Binary(translator, REG_LESS_EQUAL, false); break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:       Binary(translator, REG_ADD, true); break;
+        case OP_SUBTRACT:      Binary(translator, REG_SUBTRACT, false); break;
+        case OP_MULTIPLY:      Binary(translator, REG_MULTIPLY, false); break;
+        case OP_DIVIDE:        Binary(translator, REG_DIVIDE, false); break;
+        case OP_NOT:           Unary(translator, REG_NOT); break;
+        case OP_NEGATE:        Unary(translator, REG_NEGATE); break;
+
+        case OP_ADD_LOCAL_CONST:
+        {
+            // The constant is a number, so the add never concatenates
+            // and never collects.
+            int slot = code[1];
+            Materialize(translator, slot);
+            WillWrite(translator, slot, -1);
+            EmitOp(translator, REG_ADD);
+            Emit(translator, (uint32_t)slot);
+            Emit(translator, (uint32_t)slot);
+            Emit(translator, code[2] | RK_CONSTANT);
+            Emit(translator, (uint32_t)translator->depth);
+            break;
+        }
+
+        case OP_PRINT:
+            EmitOp(translator, REG_PRINT);
+            Emit(translator, RK(translator, PopEntry(translator)));
+            break;
+
+        case OP_JUMP:
+            MaterializeAll(translator);
+            EmitOp(translator, REG_JUMP);
+            EmitForwardJump(translator, JumpTarget(chunk, offset));
+            break;
+
+        case OP_LOOP:
+            MaterializeAll(translator);
+            EmitOp(translator, REG_JUMP);
+            Emit(translator, (uint32_t)translator->newOffsets[
+                JumpTarget(chunk, offset)]);
+            break;
+
+        case OP_JUMP_IF_FALSE:
+            MaterializeAll(translator);
+            EmitOp(translator, REG_JUMP_IF_FALSE);
+            Emit(translator, RK(translator, PeekEntry(translator, 0)));
+            EmitForwardJump(translator, JumpTarget(chunk, offset));
+            break;
+
+        case OP_EQUAL_JUMP_IF_FALSE:
+            CompareJump(translator, REG_EQUAL_JUMP_IF_FALSE, true,
+                        JumpTarget(chunk, offset));
+            break;
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            CompareJump(translator, REG_NOT_EQUAL_JUMP_IF_FALSE, true,
+                        JumpTarget(chunk, offset));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            CompareJump(translator, REG_LESS_JUMP_IF_FALSE, false,
+                        JumpTarget(chunk, offset));
+            break;
+        case OP_LESS_EQUAL_JUMP_IF_FALSE:
+            CompareJump(translator, REG_LESS_EQUAL_JUMP_IF_FALSE, false,
+                        JumpTarget(chunk, offset));
+            break;
+        case OP_GREATER_JUMP_IF_FALSE:
+            CompareJump(translator, REG_GREATER_JUMP_IF_FALSE, false,
+                        JumpTarget(chunk, offset));
+            break;
+        case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+            CompareJump(translator, REG_GREATER_EQUAL_JUMP_IF_FALSE, false,
+                        JumpTarget(chunk, offset));
+            break;
+
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            int argCount = code[1];
+            MaterializeAll(translator);
+            translator->depth -= argCount + 1;
+            EmitOp(translator, code[0] == OP_CALL ? REG_CALL : REG_TAIL_CALL);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, (uint32_t)argCount);
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        {
+            bool isSuper = code[0] == OP_SUPER_INVOKE ||
+                           code[0] == OP_SUPER_INVOKE_LONG;
+            int name = isLong ? ReadLong(chunk, offset + 1) : code[1];
+            int argCount = code[isLong ? 4 : 2];
+            MaterializeAll(translator);
+            // The superclass sits above the arguments.
+            translator->depth -= argCount + 1 + (isSuper ? 1 : 0);
+            EmitOp(translator, isSuper ? REG_SUPER_INVOKE : REG_INVOKE);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, (uint32_t)name);
+            Emit(translator, (uint32_t)argCount);
+            if (!isSuper)
+            {
+                Emit(translator, ReadShort(chunk, offset + (isLong ? 5 : 3)));
+            }
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_CLOSURE_LONG:
+            isLong = true;
+            // Fallthrough.
+        case OP_CLOSURE:
+        {
+            int constant = isLong ? ReadLong(chunk, offset + 1) : code[1];
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            MaterializeAll(translator);
+            EmitOp(translator, REG_CLOSURE);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, (uint32_t)constant);
+
+            int operand = offset + (isLong ? 4 : 2);
+            for (int i = 0; i < function->upvalueCount; i++)
+            {
+                Emit(translator, chunk->code[operand]);
+                Emit(translator, isLong ? ReadLong(chunk, operand + 1)
+                                        : chunk->code[operand + 1]);
+                operand += isLong ? 4 : 2;
+            }
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_CLOSE_UPVALUE:
+            MaterializeAll(translator);
+            PopEntry(translator);
+            EmitOp(translator, REG_CLOSE_UPVALUE);
+            Emit(translator, (uint32_t)translator->depth);
+            break;
+
+        case OP_RETURN:
+            EmitOp(translator, REG_RETURN);
+            Emit(translator, RK(translator, PopEntry(translator)));
+            break;
+
+        case OP_CLASS_LONG:
+        case OP_CLASS:
+        {
+            int name = code[0] == OP_CLASS_LONG ? ReadLong(chunk, offset + 1)
+                                                : code[1];
+            MaterializeAll(translator);
+            EmitOp(translator, REG_CLASS);
+            Emit(translator, (uint32_t)translator->depth);
+            Emit(translator, (uint32_t)name);
+            PushEntry(translator, ENTRY_TEMP, 0);
+            break;
+        }
+
+        case OP_INHERIT:
+            MaterializeAll(translator);
+            PopEntry(translator);
+            EmitOp(translator, REG_INHERIT);
+            Emit(translator, (uint32_t)translator->depth - 1);
+            break;
+
+        case OP_METHOD_LONG:
+        case OP_METHOD:
+        {
+            int name = code[0] == OP_METHOD_LONG ? ReadLong(chunk, offset + 1)
+                                                 : code[1];
+            MaterializeAll(translator);
+            PopEntry(translator);
+            EmitOp(translator, REG_METHOD);
+            Emit(translator, (uint32_t)translator->depth - 1);
+            Emit(translator, (uint32_t)name);
+            break;
+        }
+    }
+
+    return length;
+}
+
+void TranslateRegisters(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Translator translator;
+    translator.chunk = chunk;
+    translator.output = &chunk->registers;
+    // Each instruction pushes at most one value.
+    int stackSize = function->arity + 1 + chunk->count;
+    translator.stack = ALLOCATE(StackEntry, stackSize);
+    translator.depth = 0;
+    translator.pendingFrom = 0;
+    translator.newOffsets = ALLOCATE(int, chunk->count + 1);
+    translator.targetDepths = ALLOCATE(int, chunk->count + 1);
+    translator.isTarget = ALLOCATE(bool, chunk->count + 1);
+    translator.patches = ALLOCATE(RegisterPatch, chunk->count);
+    translator.patchCount = 0;
+    translator.lastDst = -1;
+    translator.lastDstRegister = -1;
+    translator.origin = 0;
+    translator.nilConstant = -1;
+    translator.trueConstant = -1;
+    translator.falseConstant = -1;
+
+    for (int offset = 0; offset <= chunk->count; offset++)
+    {
+        translator.targetDepths[offset] = -1;
+        translator.isTarget[offset] = false;
+    }
+
+    MarkLiveTargets(chunk, translator.isTarget);
+
+    // The callee and the arguments are already in place.
+    for (int i = 0; i <= function->arity; i++)
+    {
+        PushEntry(&translator, ENTRY_TEMP, 0);
+    }
+
+    bool reachable = true;
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        translator.origin = offset;
+        if (translator.isTarget[offset])
+        {
+            if (reachable)
+            {
+                MaterializeAll(&translator);
+            }
+            else
+            {
+                // Only reached by jumping, so the stack is as the jumps
+                // left it, all in registers. A target reached only by a
+                // later backward jump has no depth yet; it keeps the one
+                // its scope left behind.
+                int depth = translator.targetDepths[offset];
+                while (depth != -1 && translator.depth < depth)
+                {
+                    PushEntry(&translator, ENTRY_TEMP, 0);
+                }
+                if (depth != -1) { translator.depth = depth; }
+                for (int i = 0; i < translator.depth; i++)
+                {
+                    translator.stack[i].kind = ENTRY_TEMP;
+                }
+                translator.pendingFrom = translator.depth;
+            }
+            translator.lastDst = -1;
+            reachable = true;
+        }
+        translator.newOffsets[offset] = chunk->registers.count;
+
+        // Dead code, like the POP the compiler leaves after a loop's
+        // backward jump, is dropped: nothing could run it, and its stack
+        // effect would throw off the depth for the next target.
+        uint8_t instruction = chunk->code[offset];
+        if (!reachable)
+        {
+            offset += InstructionLength(chunk, offset);
+            continue;
+        }
+        offset += TranslateInstruction(&translator, offset);
+        reachable = !EndsBlock(instruction);
+    }
+    translator.newOffsets[chunk->count] = chunk->registers.count;
+
+    for (int i = 0; i < translator.patchCount; i++)
+    {
+        RegisterPatch* patch = &translator.patches[i];
+        chunk->registers.code[patch->unit] =
+            (uint32_t)translator.newOffsets[patch->oldTarget];
+    }
+
+    FREE_ARRAY(RegisterPatch, translator.patches, chunk->count);
+    FREE_ARRAY(bool, translator.isTarget, chunk->count + 1);
+    FREE_ARRAY(int, translator.targetDepths, chunk->count + 1);
+    FREE_ARRAY(int, translator.newOffsets, chunk->count + 1);
+    FREE_ARRAY(StackEntry, translator.stack, stackSize);
+
+#ifdef DEBUG_PRINT_CODE
+    DisassembleRegisters(chunk, function->name != NULL
+        ? function->name->chars : "<script>");
+#endif
+}
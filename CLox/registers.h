@@ -0,0 +1,9 @@
+#ifndef clox_registers_h
+#define clox_registers_h
+
+#include "object.h"
+
+// Builds function->chunk.registers from the function's stack code.
+void TranslateRegisters(ObjFunction* function);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -5,51 +6,196 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+#ifdef TABLE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define TABLE_MAX_LOAD 0.75
+// A table shrinks once fewer than this share of its entries are full. It
+// is well under half of TABLE_MAX_LOAD, so a table that has just grown or
+// shrunk doesn't immediately resize back.
+#define TABLE_MIN_LOAD 0.125
+
+// Tables smaller than this are probed one entry at a time, and their
+// entries are all a lookup touches. From this capacity up, where the
+// entries no longer stay in cache and linear probes run long, a table also
+// keeps control bytes and is probed a group at a time. It must be at least
+// GROUP_WIDTH.
+#define CONTROL_MIN_CAPACITY 4096
+
+// Control bytes are probed a group at a time. Full entries have a
+// non-negative byte, so the markers are negative: a probe stops at a group
+// with an empty entry and steps over tombstones.
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+// The hash picks the first group to look in with its high bits and goes
+// in the control byte with its low seven.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_CONTROL(hash) ((int8_t)((hash) & 0x7f))
+
+// Each returns a mask with bit i set if control byte i of the group
+// matches.
+#ifdef TABLE_SSE2
+
+static uint32_t MatchControl(const int8_t* group, int8_t control)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8(control)));
+}
+
+static uint32_t MatchFree(const int8_t* group)
+{
+    // Empty and deleted are the only bytes with the sign bit set.
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(bytes);
+}
+
+#else
+
+static uint32_t MatchControl(const int8_t* group, int8_t control)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] == control) { mask |= 1u << i; }
+    }
+    return mask;
+}
+
+static uint32_t MatchFree(const int8_t* group)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] < 0) { mask |= 1u << i; }
+    }
+    return mask;
+}
+
+#endif
+
+static int LowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static uint32_t GroupMask(int capacity)
+{
+    return (uint32_t)(capacity / GROUP_WIDTH - 1);
+}
+
+// A free entry in a table without control bytes has a NULL key, and a nil
+// value unless it is a tombstone.
+static bool IsEmpty(Entry* entry)
+{
+    return entry->key == NULL && IS_NIL(entry->value);
+}
 
 void InitTable(Table* table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void FreeTable(Table* table)
 {
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->control != NULL)
+    {
+        FREE_ARRAY(int8_t, table->control, table->capacity);
+    }
     InitTable(table);
 }
 
-static Entry* FindEntry(Entry* entries, int capacity, ObjString* key)
+static Entry* FindKeyLinear(Table* table, ObjString* key)
 {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = key->hash & mask;
 
     for (;;)
     {
-        Entry* entry = &entries[index];
+        Entry* entry = &table->entries[index];
+        if (entry->key == key) { return entry; }
+        if (IsEmpty(entry)) { return NULL; }
+        index = (index + 1) & mask;
+    }
+}
 
-        if (entry->key == NULL)
+// Groups are probed in triangular steps, which visits every group once
+// when the group count is a power of two. The probe ends at the first
+// group with an empty entry, because an insert would have stopped there.
+static Entry* FindKeyInGroups(Table* table, ObjString* key)
+{
+    uint32_t mask = GroupMask(table->capacity);
+    uint32_t group = HASH_GROUP(key->hash) & mask;
+    int8_t control = HASH_CONTROL(key->hash);
+
+    for (uint32_t step = 1;; step++)
+    {
+        const int8_t* bytes = &table->control[group * GROUP_WIDTH];
+        uint32_t matches = MatchControl(bytes, control);
+        while (matches != 0)
         {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // We found a bomstone.
-                if (tombstone == NULL) { tombstone = entry; }
-            }
+            Entry* entry =
+                &table->entries[group * GROUP_WIDTH + LowestBit(matches)];
+            if (entry->key == key) { return entry; }
+            matches &= matches - 1;
         }
-        else if (entry->key == key)
+
+        if (MatchControl(bytes, CONTROL_EMPTY) != 0) { return NULL; }
+        group = (group + step) & mask;
+    }
+}
+
+static inline Entry* FindKey(Table* table, ObjString* key)
+{
+    return table->control == NULL ? FindKeyLinear(table, key)
+                                  : FindKeyInGroups(table, key);
+}
+
+// Returns the first empty or deleted entry on the key's probe sequence.
+// Only called when the key isn't in the table.
+static int FindFree(Entry* entries, int8_t* control, int capacity,
+                    uint32_t hash)
+{
+    if (control == NULL)
+    {
+        uint32_t index = hash & (capacity - 1);
+        while (entries[index].key != NULL)
         {
-            // We found the key.
-            return entry;
+            index = (index + 1) & (capacity - 1);
         }
+        return (int)index;
+    }
+
+    uint32_t mask = GroupMask(capacity);
+    uint32_t group = HASH_GROUP(hash) & mask;
 
-        index = (index + 1) & (capacity - 1);
+    for (uint32_t step = 1;; step++)
+    {
+        uint32_t slots = MatchFree(&control[group * GROUP_WIDTH]);
+        if (slots != 0)
+        {
+            return (int)(group * GROUP_WIDTH) + LowestBit(slots);
+        }
+        group = (group + step) & mask;
     }
 }
 
@@ -57,8 +203,8 @@ bool TableGet(Table* table, ObjString* key, Value* value)
 {
     if (table->count == 0) { return false; }
 
-    Entry* entry = FindEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) { return false; }
+    Entry* entry = FindKey(table, key);
+    if (entry == NULL) { return false; }
 
     *value = entry->value;
     return true;
@@ -73,54 +219,150 @@ static void AdjustCapacity(Table* table, int capacity)
         entries[i].value = NIL_VAL;
     }
 
+    int8_t* control = NULL;
+    if (capacity >= CONTROL_MIN_CAPACITY)
+    {
+        control = ALLOCATE(int8_t, capacity);
+        memset(control, CONTROL_EMPTY, capacity);
+    }
+
     table->count = 0;
+    table->tombstones = 0;
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) { continue; }
 
-        Entry* dest = FindEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        uint32_t hash = entry->key->hash;
+        int index = FindFree(entries, control, capacity, hash);
+        if (control != NULL) { control[index] = HASH_CONTROL(hash); }
+        entries[index] = *entry;
         table->count++;
     }
 
+    if (table->control != NULL)
+    {
+        FREE_ARRAY(int8_t, table->control, table->capacity);
+    }
     FREE_ARRAY(Entry, table->entries, table->capacity);
 
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
+// The smallest capacity that holds count entries at half the maximum
+// load, leaving room to grow before the next resize.
+static int CapacityFor(int count)
+{
+    int capacity = GROW_CAPACITY(0);
+    while (count > capacity * TABLE_MAX_LOAD / 2)
+    {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    return capacity;
+}
+
+static bool IsSparse(Table* table)
+{
+    return table->capacity > GROW_CAPACITY(0) &&
+           table->count < table->capacity * TABLE_MIN_LOAD;
+}
+
 bool TableSet(Table *table, ObjString *key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (table->count > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        AdjustCapacity(table, capacity);
+        Entry* entry = FindKey(table, key);
+        if (entry != NULL)
+        {
+            entry->value = value;
+            return false;
+        }
     }
 
-    Entry* entry = FindEntry(table->entries, table->capacity, key);
+    if (table->count + table->tombstones + 1 >
+        table->capacity * TABLE_MAX_LOAD)
+    {
+        // When tombstones are at least half the load, clearing them out
+        // makes enough room without growing.
+        int capacity = table->capacity;
+        if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+        {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        AdjustCapacity(table, capacity);
+    }
+    else if (IsSparse(table))
+    {
+        // Shrinking waits for a TableSet or TableDelete because
+        // TableRemoveWhite runs inside the collector, which must not
+        // allocate.
+        AdjustCapacity(table, CapacityFor(table->count + 1));
+    }
 
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) { table->count++; }
+    int index = FindFree(table->entries, table->control, table->capacity,
+                         key->hash);
+    Entry* entry = &table->entries[index];
+    if (table->control == NULL)
+    {
+        if (!IS_NIL(entry->value)) { table->tombstones--; }
+    }
+    else
+    {
+        if (table->control[index] == CONTROL_DELETED) { table->tombstones--; }
+        table->control[index] = HASH_CONTROL(key->hash);
+    }
+    table->count++;
 
     entry->key = key;
     entry->value = value;
-    return isNewKey;
+    return true;
+}
+
+// A probe stops at an empty entry, or a group with one, anyway. So if the
+// next entry is empty, or this entry's group already has an empty one,
+// the entry can go straight back to empty. Otherwise it becomes a
+// tombstone, which keeps probes from stopping short of keys past it.
+static void DeleteEntry(Table* table, int index)
+{
+    Entry* entry = &table->entries[index];
+    entry->key = NULL;
+    entry->value = NIL_VAL;
+    table->count--;
+
+    if (table->control == NULL)
+    {
+        if (!IsEmpty(&table->entries[(index + 1) & (table->capacity - 1)]))
+        {
+            entry->value = BOOL_VAL(true);
+            table->tombstones++;
+        }
+    }
+    else if (MatchControl(&table->control[index & ~(GROUP_WIDTH - 1)],
+                          CONTROL_EMPTY) != 0)
+    {
+        table->control[index] = CONTROL_EMPTY;
+    }
+    else
+    {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
 }
 
 bool TableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) { return false; }
 
-    // Find the entry.
-    Entry* entry = FindEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) { return false; }
-
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    Entry* entry = FindKey(table, key);
+    if (entry == NULL) { return false; }
 
+    DeleteEntry(table, (int)(entry - table->entries));
+    if (IsSparse(table))
+    {
+        AdjustCapacity(table, CapacityFor(table->count));
+    }
     return true;
 }
 
@@ -136,41 +378,78 @@ void TableAddAll(Table *from, Table *to)
     }
 }
 
-ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t hash)
+static ObjString* FindStringLinear(Table* table, const char* chars,
+                                   int length, uint32_t hash)
 {
-    if (table->count == 0) { return NULL; }
-
-    uint32_t index = hash & (table->capacity - 1);
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
 
     for (;;)
     {
         Entry* entry = &table->entries[index];
-
         if (entry->key == NULL)
         {
-            // Stop if we find an empty noon-tombstone entry.
+            // Stop if we find an empty non-tombstone entry.
             if (IS_NIL(entry->value)) { return NULL; }
         }
-        else if (entry->key->length == length &&
-                entry->key->hash == hash &&
-                memcmp(entry->key->chars, chars, length) == 0)
+        else if (entry->key->hash == hash &&
+                 entry->key->length == length &&
+                 memcmp(entry->key->chars, chars, length) == 0)
         {
             // We found it.
             return entry->key;
         }
 
-        index = (index + 1) & (table->capacity - 1);
+        index = (index + 1) & mask;
     }
 }
 
+static ObjString* FindStringInGroups(Table* table, const char* chars,
+                                     int length, uint32_t hash)
+{
+    uint32_t mask = GroupMask(table->capacity);
+    uint32_t group = HASH_GROUP(hash) & mask;
+    int8_t control = HASH_CONTROL(hash);
+
+    for (uint32_t step = 1;; step++)
+    {
+        const int8_t* bytes = &table->control[group * GROUP_WIDTH];
+        uint32_t matches = MatchControl(bytes, control);
+        while (matches != 0)
+        {
+            ObjString* key =
+                table->entries[group * GROUP_WIDTH + LowestBit(matches)].key;
+            if (key->hash == hash && key->length == length &&
+                memcmp(key->chars, chars, length) == 0)
+            {
+                // We found it.
+                return key;
+            }
+            matches &= matches - 1;
+        }
+
+        if (MatchControl(bytes, CONTROL_EMPTY) != 0) { return NULL; }
+        group = (group + step) & mask;
+    }
+}
+
+ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t hash)
+{
+    if (table->count == 0) { return NULL; }
+
+    return table->control == NULL
+        ? FindStringLinear(table, chars, length, hash)
+        : FindStringInGroups(table, chars, length, hash);
+}
+
 void TableRemoveWhite(Table* table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        if (entry->key != NULL && entry->key->obj.isMarked != vm.markValue)
         {
-            TableDelete(table, entry->key);
+            DeleteEntry(table, i);
         }
     }
 }
@@ -180,7 +459,48 @@ void MarkTable(Table* table)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
+        if (entry->key == NULL) { continue; }
         MarkObject((Obj*)entry->key);
         MarkValue(entry->value);
     }
 }
+
+void PrintTableStats(const char* name, Table* table)
+{
+    // A key's probe length is the number of entries, or in a table with
+    // control bytes groups, from its first one to the one it is in.
+    long total = 0;
+    int longest = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        ObjString* key = table->entries[i].key;
+        if (key == NULL) { continue; }
+
+        int length = 1;
+        if (table->control == NULL)
+        {
+            uint32_t mask = (uint32_t)table->capacity - 1;
+            length += (int)((i - (key->hash & mask)) & mask);
+        }
+        else
+        {
+            uint32_t mask = GroupMask(table->capacity);
+            uint32_t group = HASH_GROUP(key->hash) & mask;
+            for (uint32_t step = 1; group != (uint32_t)i / GROUP_WIDTH;
+                 step++)
+            {
+                group = (group + step) & mask;
+                length++;
+            }
+        }
+
+        total += length;
+        if (longest < length) { longest = length; }
+    }
+
+    fprintf(stderr, "%s table: %d entries, %d tombstones, capacity %d, "
+            "%.2f %s per lookup, longest %d\n",
+            name, table->count, table->tombstones, table->capacity,
+            table->count > 0 ? (double)total / table->count : 0.0,
+            table->control == NULL ? "entries" : "groups", longest);
+}
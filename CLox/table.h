@@ -10,11 +10,22 @@ typedef struct
     Value value;
 } Entry;
 
+// Small tables are plain open addressing with linear probing. Large ones
+// are laid out after Swiss tables: alongside the entries is one control
+// byte per entry, so a lookup checks sixteen entries at a time against
+// the bytes and only touches the entries whose byte matches. Entries that
+// aren't full have a NULL key; their value is nil, except for tombstones
+// in a small table, which hold true.
 typedef struct
 {
     int count;
+    // Deleted entries, which still lengthen probes until the next rehash.
+    int tombstones;
     int capacity;
     Entry* entries;
+    // The low seven bits of the key's hash for a full entry, else one of
+    // the negative CONTROL_ values in table.c. NULL for a small table.
+    int8_t* control;
 } Table;
 
 void InitTable(Table* table);
@@ -26,5 +37,8 @@ void TableAddAll(Table* from, Table* to);
 ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void TableRemoveWhite(Table* table);
 void MarkTable(Table* table);
+// Writes the table's occupancy and how many entries, or groups, a lookup
+// of each key visits to stderr.
+void PrintTableStats(const char* name, Table* table);
 
 #endif
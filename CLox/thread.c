@@ -0,0 +1,68 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadMain(LPVOID param)
+{
+    Thread* thread = (Thread*)param;
+    thread->function(thread->arg);
+    return 0;
+}
+#else
+static void* ThreadMain(void* param)
+{
+    Thread* thread = (Thread*)param;
+    thread->function(thread->arg);
+    return NULL;
+}
+#endif
+
+bool StartThread(Thread* thread, void (*function)(void* arg), void* arg)
+{
+    thread->function = function;
+    thread->arg = arg;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, ThreadMain, thread, 0, NULL);
+    return thread->handle != NULL;
+#else
+    return pthread_create(&thread->handle, NULL, ThreadMain, thread) == 0;
+#endif
+}
+
+void JoinThread(Thread* thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+void YieldThread()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+int ProcessorCount()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
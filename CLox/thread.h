@@ -0,0 +1,66 @@
+#ifndef clox_thread_h
+#define clox_thread_h
+
+#include "common.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Just enough threading for the collector's marking threads.
+
+typedef struct
+{
+    void (*function)(void* arg);
+    void* arg;
+#ifdef _WIN32
+    void* handle;
+#else
+    pthread_t handle;
+#endif
+} Thread;
+
+// Runs function(arg) on a new thread. thread must stay in place until it
+// is joined. Returns false if the thread couldn't be started.
+bool StartThread(Thread* thread, void (*function)(void* arg), void* arg);
+void JoinThread(Thread* thread);
+// Gives the rest of this thread's time slice to another thread.
+void YieldThread();
+int ProcessorCount();
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define THREAD_LOCAL __declspec(thread)
+// Both return true if *pointer held expected and now holds desired.
+#define ATOMIC_CAS_BYTE(pointer, expected, desired) \
+    (_InterlockedCompareExchange8((volatile char*)(pointer), \
+        (char)(desired), (char)(expected)) == (char)(expected))
+#define ATOMIC_CAS_LONG(pointer, expected, desired) \
+    (_InterlockedCompareExchange((volatile long*)(pointer), \
+        (desired), (expected)) == (expected))
+#define ATOMIC_INCREMENT(pointer) _InterlockedIncrement((volatile long*)(pointer))
+#define ATOMIC_DECREMENT(pointer) _InterlockedDecrement((volatile long*)(pointer))
+// MSVC gives volatile loads acquire semantics on x86 and x64.
+#define ATOMIC_LOAD(pointer) (*(volatile long*)(pointer))
+#define ATOMIC_LOAD_BYTE(pointer) (*(volatile char*)(pointer))
+#define ATOMIC_STORE(pointer, value) \
+    _InterlockedExchange((volatile long*)(pointer), (value))
+#else
+#define THREAD_LOCAL _Thread_local
+#define ATOMIC_CAS_BYTE(pointer, expected, desired) \
+    __extension__ ({ \
+        __typeof__(*(pointer)) casExpected = (expected); \
+        __atomic_compare_exchange_n((pointer), &casExpected, (desired), \
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED); \
+    })
+#define ATOMIC_CAS_LONG ATOMIC_CAS_BYTE
+#define ATOMIC_INCREMENT(pointer) __atomic_add_fetch((pointer), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_DECREMENT(pointer) __atomic_sub_fetch((pointer), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+// Only a hint: anything it lets through is settled by a CAS.
+#define ATOMIC_LOAD_BYTE(pointer) __atomic_load_n((pointer), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(pointer, value) \
+    __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#endif
+
+#endif
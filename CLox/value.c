@@ -59,6 +59,7 @@ void PrintValue(Value value)
 		case VAL_NIL: printf("nil"); break;
 		case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: PrintObject(value); break;
+        case VAL_UNDEFINED: printf("undefined"); break;
 	}
 #endif
 }
@@ -70,7 +71,8 @@ bool ValuesEqual(Value a, Value b)
     {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) { return true; }
+    return IS_OBJ(a) && IS_OBJ(b) && ObjectsEqual(AS_OBJ(a), AS_OBJ(b));
 #else
 	if (a.type != b.type) { return false; }
 
@@ -79,7 +81,10 @@ bool ValuesEqual(Value a, Value b)
 		case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL:    return true;
 		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   ObjectsEqual(AS_OBJ(a), AS_OBJ(b));
+        case VAL_UNDEFINED: return true;
 		default:
 			return false; // Unreachable.
 	}
@@ -1,13 +1,18 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
+#include "jit.h"
 #include "memory.h"
+#include "registers.h"
+#include "thread.h"
 #include "vm.h"
 
 VM vm;
@@ -24,6 +29,47 @@ static void ResetStack()
     vm.openUpvalues = NULL;
 }
 
+// A stack trace shows this many of the innermost and of the outermost
+// frames, and only counts the ones in between.
+#define TRACE_FRAMES 10
+
+static void PrintFrame(CallFrame* frame)
+{
+    ObjFunction* function = frame->closure->function;
+    // -1 because the IP is sitting on the next instruction to be
+    // executed.
+    int instruction;
+    if (vm.useRegisters)
+    {
+        RegisterCode* registers = &function->chunk.registers;
+        instruction = registers->origins[frame->rip - registers->code - 1];
+    }
+    else
+    {
+        instruction = (int)(frame->ip - function->chunk.code - 1);
+    }
+    fprintf(stderr, "[line %d] in ", GetLine(&function->chunk, instruction));
+    if (function->name == NULL)
+    {
+        fprintf(stderr, "script\n");
+    }
+    else
+    {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+}
+
+// True if the interpreter would have replaced the frame with the one
+// above it: it made a tail call to a closure, and the call went ahead
+// without a bound method or initializer putting a receiver in its place.
+static bool IsReplaced(int i)
+{
+    if (i == vm.frameCount - 1 || !vm.frames[i].tailCalling) { return false; }
+    CallFrame* callee = &vm.frames[i + 1];
+    return IS_OBJ(callee->slots[0]) &&
+           AS_OBJ(callee->slots[0]) == (Obj*)callee->closure;
+}
+
 static void RuntimeError(const char* format, ...)
 {
 	va_list args;
@@ -32,67 +78,192 @@ static void RuntimeError(const char* format, ...)
 	va_end(args);
 	fputs("\n", stderr);
 
+    int frameCount = 0;
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        if (!IsReplaced(i)) { frameCount++; }
+    }
+
+    // Counted from the outermost frame.
+    int depth = frameCount;
     for (int i = vm.frameCount - 1; i >= 0; i--)
     {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-        // -1 because the IP is sitting on the next instruction to be
-        // executed.
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
-        if (function->name == NULL)
+        if (IsReplaced(i)) { continue; }
+        depth--;
+        if (depth < frameCount - TRACE_FRAMES && depth >= TRACE_FRAMES)
         {
-            fprintf(stderr, "script\n");
+            if (depth == frameCount - 1 - TRACE_FRAMES)
+            {
+                fprintf(stderr, "... %d more\n",
+                        frameCount - 2 * TRACE_FRAMES);
+            }
+            continue;
         }
-        else
+        PrintFrame(&vm.frames[i]);
+    }
+
+	ResetStack();
+}
+
+int ResolveGlobal(ObjString* name)
+{
+    Value slot;
+    if (TableGet(&vm.globalNames, name, &slot))
+    {
+        return (int)AS_NUMBER(slot);
+    }
+
+    Push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    WriteValueArray(&vm.globalValues, UNDEFINED_VAL);
+    TableSet(&vm.globalNames, name, NUMBER_VAL((double)index));
+    GLOBAL_WRITE_BARRIER(OBJ_VAL(name));
+    Pop();
+    return index;
+}
+
+ObjString* GlobalName(int slot)
+{
+    for (int i = 0; i < vm.globalNames.capacity; i++)
+    {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot)
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            return entry->key;
         }
     }
 
-	ResetStack();
+    return NULL; // Unreachable.
 }
 
 static void DefineNative(const char* name, NativeFn function)
 {
     Push(OBJ_VAL(CopyString(name, (int)strlen(name))));
     Push(OBJ_VAL(NewNative(function)));
-    TableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = ResolveGlobal(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    GLOBAL_WRITE_BARRIER(vm.stack[1]);
     Pop();
     Pop();
 }
 
 void InitVM()
 {
+    // Grown with the system allocator, like the gray stack, so that making
+    // room for a call never triggers a collection.
+    vm.frameCapacity = 16;
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+    vm.stackCapacity = 256;
+    vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+    if (vm.frames == NULL || vm.stack == NULL) { exit(1); }
+    vm.nativeDepth = 0;
 	ResetStack();
     vm.objects = NULL;
+    vm.markValue = true;
+#ifdef GENERATIONAL_GC
+    vm.youngObjects = NULL;
+    vm.nurseryBytes = 0;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.globalsRemembered = false;
+#endif
+#ifdef INCREMENTAL_GC
+    vm.gcPhase = GC_IDLE;
+    vm.stepBytes = 0;
+    vm.sweepLink = NULL;
+#endif
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+#ifdef PARALLEL_MARKING
+    vm.markThreads = ProcessorCount();
+    if (vm.markThreads > GC_MAX_MARK_THREADS)
+    {
+        vm.markThreads = GC_MAX_MARK_THREADS;
+    }
+#endif
+
+    vm.nextClassVersion = 1;
 
-    InitTable(&vm.globals);
+    InitTable(&vm.globalNames);
+    InitValueArray(&vm.globalValues);
     InitTable(&vm.strings);
 
+    vm.useRegisters = false;
+    vm.useJit = true;
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm.instructionCount = 0;
+#endif
+
     vm.initString = NULL;
+    vm.rootShape = NULL;
     vm.initString = CopyString("init", 4);
+    vm.rootShape = NewShape(NULL, NULL);
 
     DefineNative("clock", ClockNative);
 }
 
 void FreeVM()
 {
-    FreeTable(&vm.globals);
+    FreeTable(&vm.globalNames);
+    FreeValueArray(&vm.globalValues);
     FreeTable(&vm.strings);
     vm.initString = NULL;
+    vm.rootShape = NULL;
     FreeObjects();
+    free(vm.frames);
+    free(vm.stack);
+}
+
+// Moves the value stack somewhere with room for at least capacity values,
+// and everything that points into it along with it.
+static void GrowStack(size_t capacity)
+{
+    size_t newCapacity = vm.stackCapacity;
+    while (newCapacity < capacity) { newCapacity *= 2; }
+
+    // The new block is filled in before the old one is freed, so every
+    // pointer into the old one can still be turned into an offset.
+    Value* stack = (Value*)malloc(sizeof(Value) * newCapacity);
+    if (stack == NULL) { exit(1); }
+    memcpy(stack, vm.stack, sizeof(Value) * vm.stackCapacity);
+
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next)
+    {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = (int)newCapacity;
+}
+
+static void GrowFrames()
+{
+    vm.frameCapacity *= 2;
+    vm.frames = (CallFrame*)realloc(vm.frames,
+                                    sizeof(CallFrame) * vm.frameCapacity);
+    if (vm.frames == NULL) { exit(1); }
 }
 
 void Push(Value value)
 {
+    // Call() makes room for everything a frame pushes, so this only grows
+    // the stack for values pushed outside of any call.
+    if (vm.stackTop == vm.stack + vm.stackCapacity)
+    {
+        GrowStack(vm.stackCapacity + 1);
+    }
 	*vm.stackTop = value;
 	vm.stackTop++;
 }
@@ -108,6 +279,11 @@ static Value Peek(int distance)
 	return vm.stackTop[-1 - distance];
 }
 
+static InterpretResult Run(int baseFrame);
+#ifdef JIT
+static bool RunCompiled(CallFrame* frame, int offset);
+#endif
+
 static bool Call(ObjClosure* closure, int argCount)
 {
     if (argCount != closure->function->arity)
@@ -117,17 +293,65 @@ static bool Call(ObjClosure* closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    // Room for the callee's whole frame, plus the few values the runtime
+    // pushes on top of it to keep new objects alive, so that nothing has
+    // to grow the stack while the frame runs.
+    size_t needed = (size_t)(vm.stackTop - vm.stack) - argCount - 1 +
+                    closure->function->slotCount + STACK_HEADROOM;
+    if (vm.frameCount == FRAMES_MAX || needed > STACK_MAX)
     {
         RuntimeError("Stack overflow.");
         return false;
     }
+    if (vm.frameCount == vm.frameCapacity) { GrowFrames(); }
+    if (needed > (size_t)vm.stackCapacity) { GrowStack(needed); }
+
+    // The closure is still in the callee slot, which keeps the function
+    // alive while its body is allocated.
+    if (closure->function->pendingBody != NULL &&
+        !LoadPendingBody(closure->function))
+    {
+        RuntimeError("Compiled file is truncated or corrupt.");
+        return false;
+    }
+
+    if (vm.useRegisters && closure->function->chunk.registers.code == NULL)
+    {
+        TranslateRegisters(closure->function);
+    }
+
+#ifdef JIT
+    ObjFunction* function = closure->function;
+    if (function->hotness >= 0 && vm.useJit &&
+        ++function->hotness >= JIT_THRESHOLD)
+    {
+        function->hotness = -1;
+        CompileJit(function);
+    }
+#endif
 
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
+    frame->rip = closure->function->chunk.registers.code;
 
     frame->slots = vm.stackTop - argCount - 1;
+    frame->tailCalling = false;
+
+    // Compiled functions run to completion here, so callers see a call
+    // that has already returned. Past NATIVE_DEPTH_MAX they are left to
+    // the interpreter, which keeps deep recursion off the C stack.
+    if (vm.nativeDepth >= NATIVE_DEPTH_MAX) { return true; }
+    if (closure->function->aot != NULL)
+    {
+        vm.nativeDepth++;
+        bool result = closure->function->aot();
+        vm.nativeDepth--;
+        return result;
+    }
+#ifdef JIT
+    if (function->jit != NULL) { return RunCompiled(frame, 0); }
+#endif
     return true;
 }
 
@@ -188,7 +412,107 @@ static bool InvokeFromClass(ObjClass* klass, ObjString* name, int argCount)
     return Call(AS_CLOSURE(method), argCount);
 }
 
-static bool Invoke(ObjString* name, int argCount)
+static CacheEntry* NewCacheEntry(InlineCache* cache)
+{
+    if (cache->count == INLINE_CACHE_WAYS)
+    {
+        // Megamorphic: forget the oldest receiver.
+        memmove(&cache->entries[0], &cache->entries[1],
+                sizeof(CacheEntry) * (INLINE_CACHE_WAYS - 1));
+        cache->count--;
+    }
+
+    return &cache->entries[cache->count++];
+}
+
+// Resolves name on instance for a get or invoke site. On success *slot is
+// the field slot, or -1 with the class's method in *method.
+static bool LookupProperty(InlineCache* cache, ObjInstance* instance,
+                           ObjString* name, int* slot, Value* method)
+{
+    ObjClass* klass = instance->klass;
+
+    for (int i = 0; i < cache->count; i++)
+    {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape != instance->shape) { continue; }
+
+        if (entry->slot >= 0)
+        {
+            *slot = entry->slot;
+            return true;
+        }
+
+        // The shape proves there is no field shadowing the method.
+        if (entry->version == klass->version)
+        {
+            *slot = -1;
+            *method = entry->method;
+            return true;
+        }
+    }
+
+    *slot = ShapeFindSlot(instance->shape, name);
+    if (*slot == -1 && !TableGet(&klass->methods, name, method))
+    {
+        return false;
+    }
+
+    CacheEntry* entry = NewCacheEntry(cache);
+    entry->shape = instance->shape;
+    entry->transition = NULL;
+    entry->version = klass->version;
+    entry->slot = *slot;
+    entry->method = *slot == -1 ? *method : NIL_VAL;
+    return true;
+}
+
+// value must be on the stack: adding a field may allocate.
+static void SetProperty(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name, Value value)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape != instance->shape) { continue; }
+
+        if (entry->transition == NULL)
+        {
+            instance->fields[entry->slot] = value;
+            WRITE_BARRIER(instance, value);
+        }
+        else
+        {
+            AddField(instance, entry->transition, value);
+        }
+        return;
+    }
+
+    ObjShape* shape = instance->shape;
+    int slot = ShapeFindSlot(shape, name);
+    ObjShape* transition = NULL;
+
+    if (slot != -1)
+    {
+        instance->fields[slot] = value;
+        WRITE_BARRIER(instance, value);
+    }
+    else
+    {
+        transition = ShapeTransition(shape, name);
+        AddField(instance, transition, value);
+        slot = transition->slotCount - 1;
+    }
+
+    CacheEntry* entry = NewCacheEntry(cache);
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->version = 0;
+    entry->slot = slot;
+    entry->method = NIL_VAL;
+}
+
+static bool Invoke(ObjString* name, int argCount, InlineCache* cache)
 {
     Value receiver = Peek(argCount);
 
@@ -200,14 +524,22 @@ static bool Invoke(ObjString* name, int argCount)
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
-    Value value;
-    if (TableGet(&instance->fields, name, &value))
+    int slot;
+    Value method;
+    if (!LookupProperty(cache, instance, name, &slot, &method))
+    {
+        RuntimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (slot != -1)
     {
+        Value value = instance->fields[slot];
         vm.stackTop[-argCount - 1] = value;
         return CallValue(value, argCount);
     }
 
-    return InvokeFromClass(instance->klass, name, argCount);
+    return Call(AS_CLOSURE(method), argCount);
 }
 
 static bool BindMethod(ObjClass* klass, ObjString* name)
@@ -265,6 +597,7 @@ static void CloseUpvalues(Value* last)
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -274,6 +607,8 @@ static void DefineMethod(ObjString* name)
     Value method = Peek(0);
     ObjClass* klass = AS_CLASS(Peek(1));
     TableSet(&klass->methods, name, method);
+    WRITE_BARRIER(klass, method);
+    klass->version = vm.nextClassVersion++;
     Pop();
 }
 
@@ -282,375 +617,1754 @@ static bool IsFalsey(Value value)
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Concatenations shorter than this are copied straight away, since for
+// short strings a copy is cheaper than a rope.
+#define ROPE_MIN_LENGTH 64
+
 static void Concatenate()
 {
-    ObjString* b = AS_STRING(Peek(0));
-    ObjString* a = AS_STRING(Peek(1));
+    Value b = Peek(0);
+    Value a = Peek(1);
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Obj* result;
+    if (IS_STRING(a) && IS_STRING(b) &&
+        AS_STRING(a)->length + AS_STRING(b)->length < ROPE_MIN_LENGTH)
+    {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        ObjString* string = AllocateString(left->length + right->length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        result = (Obj*)string;
+    }
+    else
+    {
+        result = (Obj*)NewRope(AS_OBJ(a), AS_OBJ(b));
+    }
 
-    ObjString* result = TakeString(chars, length);
     Pop();
     Pop();
     Push(OBJ_VAL(result));
 }
 
-static InterpretResult Run()
+#ifdef JIT
+static bool RunCompiled(CallFrame* frame, int offset)
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    vm.nativeDepth++;
+    JitStatus status = RunJit(frame, offset);
+    vm.nativeDepth--;
+    switch (status)
+    {
+        case JIT_RETURNED:
+            return true;
+        case JIT_DEOPTIMIZED:
+            // Finish the frame in the interpreter, from where the compiled
+            // code stopped.
+            return Run(vm.frameCount - 1) == INTERPRET_OK;
+        default:
+            return false;
+    }
+}
+#endif
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// A call from compiled code to a function that isn't compiled only pushes
+// its frame. Run it here, so the compiled caller gets its result back.
+static bool FinishCall(int frameCount)
+{
+    if (vm.frameCount == frameCount) { return true; }
+    return Run(frameCount) == INTERPRET_OK;
+}
 
-#define BINARY_OP(valueType, op) \
-	do { \
-		if (!IS_NUMBER(Peek(0)) || !IS_NUMBER(Peek(1))) \
-		{ \
-			RuntimeError("Operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR; \
-		} \
-		double b = AS_NUMBER(Pop()); \
-		double a = AS_NUMBER(Pop()); \
-		Push(valueType(a op b)); \
-	} while (false)
+bool JitError(const char* message)
+{
+    RuntimeError("%s", message);
+    return false;
+}
 
-	for (;;)
-	{
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-		{
-			printf("[ ");
-			PrintValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
+bool JitUndefinedVariable(int slot)
+{
+    RuntimeError("Undefined variable '%s'.", GlobalName(slot)->chars);
+    return false;
+}
 
-		DisassembleInstruction(&frame->closure->function->chunk,
-                (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-		uint8_t intruction;
-		switch (intruction = READ_BYTE())
-		{
-			case OP_CONSTANT:
-			{
-				Value constant = READ_CONSTANT();
-				Push(constant);
-				break;
-			}
-			case OP_NIL: Push(NIL_VAL); break;
-			case OP_TRUE: Push(BOOL_VAL(true)); break;
-			case OP_FALSE: Push(BOOL_VAL(false)); break;
-            case OP_POP: Pop(); break;
+void JitDefineGlobal(int slot)
+{
+    Value value = Pop();
+    vm.globalValues.values[slot] = value;
+    GLOBAL_WRITE_BARRIER(value);
+}
 
-            case OP_GET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                Push(frame->slots[slot]);
-                break;
-            }
+bool JitSetGlobal(int slot)
+{
+    if (IS_UNDEFINED(vm.globalValues.values[slot]))
+    {
+        return JitUndefinedVariable(slot);
+    }
+    vm.globalValues.values[slot] = Peek(0);
+    GLOBAL_WRITE_BARRIER(Peek(0));
+    return true;
+}
 
-            case OP_SET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = Peek(0);
-                break;
-            }
+void JitSetUpvalue(int index)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjUpvalue* upvalue = frame->closure->upvalues[index];
+    *upvalue->location = Peek(0);
+    WRITE_BARRIER(upvalue, Peek(0));
+}
 
-            case OP_GET_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!TableGet(&vm.globals, name, &value))
-                {
-                    RuntimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                Push(value);
-                break;
-            }
+bool JitGetProperty(ObjString* name, InlineCache* cache)
+{
+    if (!IS_INSTANCE(Peek(0)))
+    {
+        RuntimeError("Only instances have properties.");
+        return false;
+    }
 
-            case OP_DEFINE_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                TableSet(&vm.globals, name, Peek(0));
-                Pop();
-                break;
-            }
+    ObjInstance* instance = AS_INSTANCE(Peek(0));
+    int slot;
+    Value method;
+    if (!LookupProperty(cache, instance, name, &slot, &method))
+    {
+        RuntimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
 
-            case OP_SET_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                if (TableSet(&vm.globals, name, Peek(0)))
-                {
-                    TableDelete(&vm.globals, name);
-                    RuntimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+    if (slot != -1)
+    {
+        vm.stackTop[-1] = instance->fields[slot];
+        return true;
+    }
 
-            case OP_GET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                Push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
+    ObjBoundMethod* bound = NewBoundMethod(Peek(0), AS_CLOSURE(method));
+    vm.stackTop[-1] = OBJ_VAL(bound);
+    return true;
+}
 
-            case OP_SET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = Peek(0);
-                break;
-            }
+bool JitSetProperty(ObjString* name, InlineCache* cache)
+{
+    if (!IS_INSTANCE(Peek(1)))
+    {
+        RuntimeError("Only instances have fields.");
+        return false;
+    }
 
-            case OP_GET_PROPERTY:
-            {
-                if (!IS_INSTANCE(Peek(0)))
-                {
-                    RuntimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+    SetProperty(cache, AS_INSTANCE(Peek(1)), name, Peek(0));
+    Value value = Pop();
+    vm.stackTop[-1] = value;
+    return true;
+}
 
-                ObjInstance* instance = AS_INSTANCE(Peek(0));
-                ObjString* name = READ_STRING();
+bool JitValuesEqual()
+{
+    bool equal = ValuesEqual(Peek(1), Peek(0));
+    vm.stackTop -= 2;
+    return equal;
+}
 
-                Value value;
-                if (TableGet(&instance->fields, name, &value))
-                {
-                    Pop(); // Instance.
-                    Push(value);
-                    break;
-                }
+bool JitAdd()
+{
+    if (IS_ANY_STRING(Peek(0)) && IS_ANY_STRING(Peek(1)))
+    {
+        Concatenate();
+        return true;
+    }
 
-                if (!BindMethod(instance->klass, name))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+    RuntimeError("Operands must be two numbers or two strings.");
+    return false;
+}
 
-            case OP_SET_PROPERTY:
-            {
-                if (!IS_INSTANCE(Peek(1)))
-                {
-                    RuntimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+void JitPrint()
+{
+    PrintValue(Pop());
+    printf("\n");
+}
 
-                ObjInstance* instance = AS_INSTANCE(Peek(1));
-                TableSet(&instance->fields, READ_STRING(), Peek(0));
+bool JitCall(int argCount)
+{
+    int frameCount = vm.frameCount;
+    if (!CallValue(Peek(argCount), argCount)) { return false; }
+    return FinishCall(frameCount);
+}
 
-                Value value = Pop();
-                Pop();
-                Push(value);
-                break;
-            }
+bool JitInvoke(ObjString* name, int argCount, InlineCache* cache)
+{
+    int frameCount = vm.frameCount;
+    if (!Invoke(name, argCount, cache)) { return false; }
+    return FinishCall(frameCount);
+}
 
-            case OP_GET_SUPER:
-            {
-                ObjString* name = READ_STRING();
-                ObjClass* superClass = AS_CLASS(Pop());
-                if (!BindMethod(superClass, name))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+bool JitFinishFrame()
+{
+    return Run(vm.frameCount - 1) == INTERPRET_OK;
+}
+
+void JitClosure(const uint8_t* instruction)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    Value* constants = frame->closure->function->chunk.constants.values;
+    bool isLong = instruction[0] == OP_CLOSURE_LONG;
+    const uint8_t* operand = instruction + 1;
+
+    uint32_t constant = isLong
+        ? (uint32_t)((operand[0] << 16) | (operand[1] << 8) | operand[2])
+        : operand[0];
+    operand += isLong ? 3 : 1;
+
+    ObjClosure* closure = NewClosure(AS_FUNCTION(constants[constant]));
+    Push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        uint8_t isLocal = operand[0];
+        uint32_t index = isLong
+            ? (uint32_t)((operand[1] << 16) | (operand[2] << 8) | operand[3])
+            : operand[1];
+        operand += isLong ? 4 : 2;
+        if (isLocal)
+        {
+            closure->upvalues[i] = CaptureUpvalue(frame->slots + index);
+        }
+        else
+        {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
+    }
+}
+
+void JitCloseUpvalue()
+{
+    CloseUpvalues(vm.stackTop - 1);
+    Pop();
+}
+
+void JitReturn()
+{
+    Value result = Pop();
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    if (vm.openUpvalues != NULL) { CloseUpvalues(frame->slots); }
+
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+    Push(result);
+}
+
+bool JitGetSuper(ObjString* name)
+{
+    ObjClass* superclass = AS_CLASS(Pop());
+    return BindMethod(superclass, name);
+}
+
+bool JitSuperInvoke(ObjString* name, int argCount)
+{
+    int frameCount = vm.frameCount;
+    ObjClass* superclass = AS_CLASS(Pop());
+    if (!InvokeFromClass(superclass, name, argCount)) { return false; }
+    return FinishCall(frameCount);
+}
+
+void JitClass(ObjString* name)
+{
+    Push(OBJ_VAL(NewClass(name)));
+}
+
+bool JitInherit()
+{
+    Value superclass = Peek(1);
+    if (!IS_CLASS(superclass))
+    {
+        RuntimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass* subclass = AS_CLASS(Peek(0));
+    TableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    WRITE_BARRIER_ALL(subclass);
+    subclass->version = vm.nextClassVersion++;
+    Pop(); // Subclass.
+    return true;
+}
+
+void JitMethod(ObjString* name)
+{
+    DefineMethod(name);
+}
+
+// Runs the top frame and whatever it calls, until a return brings the
+// frame count down to baseFrame. The value returned is then on the stack
+// where the callee was.
+static InterpretResult Run(int baseFrame)
+{
+    // The hot parts of the current frame and the stack top live in locals
+    // so the compiler can keep them in registers. They are written back
+    // with STORE_FRAME() before anything that can look at them from the
+    // outside (calls, allocations that may trigger a GC, runtime errors)
+    // and picked up again with LOAD_FRAME() afterwards.
+    CallFrame* frame;
+    register uint8_t* ip;
+    register Value* stackTop;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+
+#define STORE_FRAME() \
+    do { \
+        frame->ip = ip; \
+        vm.stackTop = stackTop; \
+    } while (false)
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches; \
+        stackTop = vm.stackTop; \
+    } while (false)
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+    (ip += 3, \
+    (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+// The colder instructions share one handler between their narrow and
+// wide forms and pick the operand width from the opcode.
+#define READ_OPERAND(longOp) \
+    (instruction == (longOp) ? READ_LONG() : READ_BYTE())
+#define READ_STRING_OPERAND(longOp) \
+    AS_STRING(constants[READ_OPERAND(longOp)])
+
+#define BINARY_OP(valueType, op) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+		{ \
+			STORE_FRAME(); \
+			RuntimeError("Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		PUSH(valueType(a op b)); \
+	} while (false)
+
+// Fused comparison and JUMP_IF_FALSE. The jump is taken when
+// (a op b) == negated, so the NOT-based forms keep the exact result of
+// the unfused sequence, NaN included.
+#define COMPARE_JUMP(op, negated) \
+    do { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+        { \
+            STORE_FRAME(); \
+            RuntimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        uint16_t offset = READ_SHORT(); \
+        if ((a op b) == (negated)) { ip += offset; } \
+    } while (false)
+
+// Rewrites the one-byte instruction being run. A quickened instruction
+// whose guard fails puts the generic one back and runs that instead. Code
+// borrowed from a mapped image is read-only, so it is never quickened and
+// never holds a quickened instruction to put back.
+#ifdef QUICKENING
+#define QUICKEN(op) \
+    do { \
+        if (!frame->closure->function->chunk.borrowsCode) { ip[-1] = (op); } \
+    } while (false)
+#else
+#define QUICKEN(op) do { } while (false)
+#endif
+#define DEQUICKEN(op) \
+    do { \
+        ip[-1] = (op); \
+        ip--; \
+        DISPATCH(); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    do { \
+        printf("          "); \
+        for (Value* slot = vm.stack; slot < stackTop; slot++) \
+        { \
+            printf("[ "); \
+            PrintValue(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        DisassembleInstruction(&frame->closure->function->chunk, \
+                (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Direct-threaded dispatch: every handler ends with its own indirect
+    // jump, so the branch predictor gets one history slot per opcode
+    // instead of sharing the single jump at the top of a switch.
+    static void* dispatchTable[] =
+    {
+        [OP_CONSTANT]                    = &&op_OP_CONSTANT,
+        [OP_NIL]                         = &&op_OP_NIL,
+        [OP_TRUE]                        = &&op_OP_TRUE,
+        [OP_FALSE]                       = &&op_OP_FALSE,
+        [OP_POP]                         = &&op_OP_POP,
+        [OP_GET_LOCAL]                   = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL]                   = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL]                  = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL]               = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]                  = &&op_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE]                 = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]                 = &&op_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]                = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]                = &&op_OP_SET_PROPERTY,
+        [OP_GET_SUPER]                   = &&op_OP_GET_SUPER,
+        [OP_EQUAL]                       = &&op_OP_EQUAL,
+        [OP_GREATER]                     = &&op_OP_GREATER,
+        [OP_LESS]                        = &&op_OP_LESS,
+        [OP_ADD]                         = &&op_OP_ADD,
+        [OP_SUBTRACT]                    = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY]                    = &&op_OP_MULTIPLY,
+        [OP_DIVIDE]                      = &&op_OP_DIVIDE,
+        [OP_NOT]                         = &&op_OP_NOT,
+        [OP_NEGATE]                      = &&op_OP_NEGATE,
+        [OP_PRINT]                       = &&op_OP_PRINT,
+        [OP_JUMP]                        = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE]               = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                        = &&op_OP_LOOP,
+        [OP_CALL]                        = &&op_OP_CALL,
+        [OP_TAIL_CALL]                   = &&op_OP_TAIL_CALL,
+        [OP_INVOKE]                      = &&op_OP_INVOKE,
+        [OP_SUPER_INVOKE]                = &&op_OP_SUPER_INVOKE,
+        [OP_CLOSURE]                     = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]               = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN]                      = &&op_OP_RETURN,
+        [OP_CLASS]                       = &&op_OP_CLASS,
+        [OP_INHERIT]                     = &&op_OP_INHERIT,
+        [OP_METHOD]                      = &&op_OP_METHOD,
+        [OP_CONSTANT_LONG]               = &&op_OP_CONSTANT_LONG,
+        [OP_GET_LOCAL_LONG]              = &&op_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG]              = &&op_OP_SET_LOCAL_LONG,
+        [OP_GET_GLOBAL_LONG]             = &&op_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG]          = &&op_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]             = &&op_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE_LONG]            = &&op_OP_GET_UPVALUE_LONG,
+        [OP_SET_UPVALUE_LONG]            = &&op_OP_SET_UPVALUE_LONG,
+        [OP_GET_PROPERTY_LONG]           = &&op_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY_LONG]           = &&op_OP_SET_PROPERTY_LONG,
+        [OP_GET_SUPER_LONG]              = &&op_OP_GET_SUPER_LONG,
+        [OP_INVOKE_LONG]                 = &&op_OP_INVOKE_LONG,
+        [OP_SUPER_INVOKE_LONG]           = &&op_OP_SUPER_INVOKE_LONG,
+        [OP_CLOSURE_LONG]                = &&op_OP_CLOSURE_LONG,
+        [OP_CLASS_LONG]                  = &&op_OP_CLASS_LONG,
+        [OP_METHOD_LONG]                 = &&op_OP_METHOD_LONG,
+        [OP_NOT_EQUAL]                   = &&op_OP_NOT_EQUAL,
+        [OP_LESS_EQUAL]                  = &&op_OP_LESS_EQUAL,
+        [OP_GREATER_EQUAL]               = &&op_OP_GREATER_EQUAL,
+        [OP_ADD_LOCAL_CONST]             = &&op_OP_ADD_LOCAL_CONST,
+        [OP_EQUAL_JUMP_IF_FALSE]         = &&op_OP_EQUAL_JUMP_IF_FALSE,
+        [OP_NOT_EQUAL_JUMP_IF_FALSE]     = &&op_OP_NOT_EQUAL_JUMP_IF_FALSE,
+        [OP_LESS_JUMP_IF_FALSE]          = &&op_OP_LESS_JUMP_IF_FALSE,
+        [OP_LESS_EQUAL_JUMP_IF_FALSE]    = &&op_OP_LESS_EQUAL_JUMP_IF_FALSE,
+        [OP_GREATER_JUMP_IF_FALSE]       = &&op_OP_GREATER_JUMP_IF_FALSE,
+        [OP_GREATER_EQUAL_JUMP_IF_FALSE] = &&op_OP_GREATER_EQUAL_JUMP_IF_FALSE,
+        [OP_ADD_NUM]                     = &&op_OP_ADD_NUM,
+        [OP_ADD_STR]                     = &&op_OP_ADD_STR,
+        [OP_LESS_NUM]                    = &&op_OP_LESS_NUM,
+        [OP_GREATER_NUM]                 = &&op_OP_GREATER_NUM
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_EXECUTION(); \
+        COUNT_INSTRUCTION(); \
+        switch (instruction = READ_BYTE())
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    LOAD_FRAME();
+
+    uint8_t instruction;
+	INTERPRET_LOOP
+	{
+		CASE(OP_CONSTANT):
+		{
+			Value constant = READ_CONSTANT();
+			PUSH(constant);
+			DISPATCH();
+		}
+		CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+		CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+		CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): DROP(); DISPATCH();
+
+        CASE(OP_GET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
 
-			case OP_EQUAL:
+        CASE(OP_GET_GLOBAL):
+        {
+            uint8_t slot = READ_BYTE();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
+            {
+                STORE_FRAME();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+
+        CASE(OP_DEFINE_GLOBAL):
+        {
+            uint8_t slot = READ_BYTE();
+            Value value = POP();
+            vm.globalValues.values[slot] = value;
+            GLOBAL_WRITE_BARRIER(value);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_GLOBAL):
+        {
+            uint8_t slot = READ_BYTE();
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
+            {
+                STORE_FRAME();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = PEEK(0);
+            GLOBAL_WRITE_BARRIER(PEEK(0));
+            DISPATCH();
+        }
+
+        CASE(OP_GET_UPVALUE):
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_UPVALUE):
+        {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            WRITE_BARRIER(upvalue, PEEK(0));
+            DISPATCH();
+        }
+
+        CASE(OP_GET_PROPERTY_LONG):
+        CASE(OP_GET_PROPERTY):
+        {
+            if (!IS_INSTANCE(PEEK(0)))
+            {
+                STORE_FRAME();
+                RuntimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            ObjString* name = READ_STRING_OPERAND(OP_GET_PROPERTY_LONG);
+            InlineCache* cache = &caches[READ_SHORT()];
+
+            int slot;
+            Value method;
+            if (!LookupProperty(cache, instance, name, &slot, &method))
+            {
+                STORE_FRAME();
+                RuntimeError("Undefined property '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            if (slot != -1)
+            {
+                stackTop[-1] = instance->fields[slot];
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            ObjBoundMethod* bound = NewBoundMethod(PEEK(0),
+                                                   AS_CLOSURE(method));
+            stackTop[-1] = OBJ_VAL(bound);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_PROPERTY_LONG):
+        CASE(OP_SET_PROPERTY):
+        {
+            if (!IS_INSTANCE(PEEK(1)))
+            {
+                STORE_FRAME();
+                RuntimeError("Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            ObjString* name = READ_STRING_OPERAND(OP_SET_PROPERTY_LONG);
+            InlineCache* cache = &caches[READ_SHORT()];
+            STORE_FRAME();
+            SetProperty(cache, instance, name, PEEK(0));
+
+            Value value = POP();
+            stackTop[-1] = value;
+            DISPATCH();
+        }
+
+        CASE(OP_GET_SUPER_LONG):
+        CASE(OP_GET_SUPER):
+        {
+            ObjString* name = READ_STRING_OPERAND(OP_GET_SUPER_LONG);
+            ObjClass* superClass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!BindMethod(superClass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+		CASE(OP_EQUAL):
+		{
+            // Comparing a rope flattens it, which allocates and pushes.
+            // The operands stay on the stack until the comparison is done,
+            // so they are still roots and the pushes land above them.
+            STORE_FRAME();
+            bool equal = ValuesEqual(PEEK(1), PEEK(0));
+            DROP();
+            stackTop[-1] = BOOL_VAL(equal);
+			DISPATCH();
+		}
+
+        CASE(OP_GREATER):
+        {
+            BINARY_OP(BOOL_VAL, >);
+            QUICKEN(OP_GREATER_NUM);
+            DISPATCH();
+        }
+        CASE(OP_LESS):
+        {
+            BINARY_OP(BOOL_VAL, <);
+            QUICKEN(OP_LESS_NUM);
+            DISPATCH();
+        }
+
+        // Superinstructions from the peephole pass. The comparisons stand
+        // for OP_GREATER/OP_LESS followed by OP_NOT and compute exactly
+        // that, rather than <= and >=, which differ on NaN.
+        CASE(OP_NOT_EQUAL):
+        {
+            STORE_FRAME();
+            bool equal = ValuesEqual(PEEK(1), PEEK(0));
+            DROP();
+            stackTop[-1] = BOOL_VAL(!equal);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL):
+        {
+            BINARY_OP(BOOL_VAL, >);
+            stackTop[-1] = BOOL_VAL(!AS_BOOL(stackTop[-1]));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL):
+        {
+            BINARY_OP(BOOL_VAL, <);
+            stackTop[-1] = BOOL_VAL(!AS_BOOL(stackTop[-1]));
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONST):
+        {
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            if (!IS_NUMBER(slots[slot]))
+            {
+                STORE_FRAME();
+                RuntimeError(
+                    "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) +
+                                     AS_NUMBER(constant));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            STORE_FRAME();
+            bool equal = ValuesEqual(PEEK(1), PEEK(0));
+            stackTop -= 2;
+            if (!equal) { ip += offset; }
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            STORE_FRAME();
+            bool equal = ValuesEqual(PEEK(1), PEEK(0));
+            stackTop -= 2;
+            if (equal) { ip += offset; }
+            DISPATCH();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, false);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, true);
+            DISPATCH();
+        CASE(OP_GREATER_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, false);
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, true);
+            DISPATCH();
+		CASE(OP_ADD):
+        {
+            if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1)))
+            {
+                QUICKEN(OP_ADD_STR);
+                STORE_FRAME();
+                Concatenate();
+                LOAD_FRAME();
+            }
+            else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+            {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            }
+            else
+            {
+                STORE_FRAME();
+                RuntimeError(
+                    "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM):
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            {
+                DEQUICKEN(OP_ADD);
+            }
+            double b = AS_NUMBER(POP());
+            stackTop[-1] = NUMBER_VAL(AS_NUMBER(stackTop[-1]) + b);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR):
+        {
+            if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1)))
+            {
+                DEQUICKEN(OP_ADD);
+            }
+            STORE_FRAME();
+            Concatenate();
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_LESS_NUM):
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            {
+                DEQUICKEN(OP_LESS);
+            }
+            double b = AS_NUMBER(POP());
+            stackTop[-1] = BOOL_VAL(AS_NUMBER(stackTop[-1]) < b);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NUM):
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            {
+                DEQUICKEN(OP_GREATER);
+            }
+            double b = AS_NUMBER(POP());
+            stackTop[-1] = BOOL_VAL(AS_NUMBER(stackTop[-1]) > b);
+            DISPATCH();
+        }
+		CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL,  -); DISPATCH();
+		CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+		CASE(OP_DIVIDE):	  BINARY_OP(NUMBER_VAL, /); DISPATCH();
+		CASE(OP_NOT):
+			stackTop[-1] = BOOL_VAL(IsFalsey(stackTop[-1]));
+			DISPATCH();
+		CASE(OP_NEGATE):
+			if (!IS_NUMBER(PEEK(0)))
 			{
-				Value b = Pop();
-				Value a = Pop();
-				Push(BOOL_VAL(ValuesEqual(a, b)));
-				break;
+				STORE_FRAME();
+				RuntimeError("Operand must be a number.");
+				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-			case OP_ADD:
+			stackTop[-1] = NUMBER_VAL(-AS_NUMBER(stackTop[-1]));
+			DISPATCH();
+
+        CASE(OP_PRINT):
+        {
+            PrintValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (IsFalsey(PEEK(0))) { ip += offset; }
+            DISPATCH();
+        }
+
+        CASE(OP_LOOP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+#ifdef JIT
+            ObjFunction* function = frame->closure->function;
+            if (function->hotness >= 0 && vm.useJit &&
+                vm.nativeDepth < NATIVE_DEPTH_MAX &&
+                ++function->hotness >= JIT_THRESHOLD)
+            {
+                function->hotness = -1;
+                STORE_FRAME();
+                if (CompileJit(function))
+                {
+                    // Carry on in compiled code from the top of the loop.
+                    if (!RunCompiled(frame, (int)(ip - function->chunk.code)))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if (vm.frameCount == baseFrame) { return INTERPRET_OK; }
+                    LOAD_FRAME();
+                }
+            }
+#endif
+            DISPATCH();
+        }
+
+        CASE(OP_CALL):
+        {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!CallValue(PEEK(argCount), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_TAIL_CALL):
+        {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            STORE_FRAME();
+            if (!IS_CLOSURE(callee) ||
+                AS_CLOSURE(callee)->function->arity != argCount)
             {
-                if (IS_STRING(Peek(0)) && IS_STRING(Peek(1)))
+                // An ordinary call, whose result the OP_RETURN after it
+                // returns. That also reports a wrong argument count from
+                // this frame.
+                if (!CallValue(callee, argCount))
                 {
-                    Concatenate();
+                    return INTERPRET_RUNTIME_ERROR;
                 }
-                else if (IS_NUMBER(Peek(0)) && IS_NUMBER(Peek(1)))
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            // The callee and its arguments take the place of this frame's
+            // window, and the callee's frame the place of this one.
+            if (vm.openUpvalues != NULL) { CloseUpvalues(slots); }
+            memmove(slots, stackTop - argCount - 1,
+                    sizeof(Value) * (argCount + 1));
+            vm.stackTop = slots + argCount + 1;
+            vm.frameCount--;
+            if (!Call(AS_CLOSURE(callee), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // A compiled callee has already returned, into our caller.
+            if (vm.frameCount == baseFrame) { return INTERPRET_OK; }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_INVOKE_LONG):
+        CASE(OP_INVOKE):
+        {
+            ObjString* method = READ_STRING_OPERAND(OP_INVOKE_LONG);
+            int argCount = READ_BYTE();
+            InlineCache* cache = &caches[READ_SHORT()];
+            STORE_FRAME();
+            if (!Invoke(method, argCount, cache))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_SUPER_INVOKE_LONG):
+        CASE(OP_SUPER_INVOKE):
+        {
+            ObjString* method = READ_STRING_OPERAND(OP_SUPER_INVOKE_LONG);
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!InvokeFromClass(superclass, method, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_CLOSURE_LONG):
+        CASE(OP_CLOSURE):
+        {
+            bool isLong = instruction == OP_CLOSURE_LONG;
+            ObjFunction* function =
+                AS_FUNCTION(constants[READ_OPERAND(OP_CLOSURE_LONG)]);
+            STORE_FRAME();
+            ObjClosure* closure = NewClosure(function);
+            PUSH(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                uint8_t isLocal = READ_BYTE();
+                uint32_t index = isLong ? READ_LONG() : READ_BYTE();
+                if (isLocal)
                 {
-                    double b = AS_NUMBER(Pop());
-                    double a = AS_NUMBER(Pop());
-                    Push(NUMBER_VAL(a + b));
+                    STORE_FRAME();
+                    closure->upvalues[i] = CaptureUpvalue(slots + index);
                 }
                 else
                 {
-                    RuntimeError(
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
+                WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
             }
-			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL,  -); break;
-			case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIVIDE:	  BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT:
-				Push(BOOL_VAL(IsFalsey(Pop())));
-				break;
-			case OP_NEGATE:
-				if (!IS_NUMBER(Peek(0)))
-				{
-					RuntimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
-				}
-
-				Push(NUMBER_VAL(-AS_NUMBER(Pop())));
-				break;
-
-            case OP_PRINT:
-            {
-                PrintValue(Pop());
-                printf("\n");
-                break;
+            DISPATCH();
+        }
+
+        CASE(OP_CLOSE_UPVALUE):
+            CloseUpvalues(stackTop - 1);
+            DROP();
+            DISPATCH();
+
+		CASE(OP_RETURN):
+		{
+            Value result = POP();
+
+            // Most returns have nothing to close. Checking here keeps them
+            // from paying for a call now that closing has a write barrier.
+            if (vm.openUpvalues != NULL) { CloseUpvalues(slots); }
+
+            vm.frameCount--;
+            vm.stackTop = slots;
+            if (vm.frameCount == baseFrame)
+            {
+                Push(result);
+                return INTERPRET_OK;
             }
 
-            case OP_JUMP:
+            LOAD_FRAME();
+            PUSH(result);
+            DISPATCH();
+		}
+
+        CASE(OP_CLASS_LONG):
+        CASE(OP_CLASS):
+        {
+            ObjString* name = READ_STRING_OPERAND(OP_CLASS_LONG);
+            STORE_FRAME();
+            PUSH(OBJ_VAL(NewClass(name)));
+            DISPATCH();
+        }
+
+        CASE(OP_INHERIT):
+        {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass))
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                STORE_FRAME();
+                RuntimeError("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
             }
 
-            case OP_JUMP_IF_FALSE:
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            STORE_FRAME();
+            TableAddAll(&AS_CLASS(superclass)->methods,
+                        &subclass->methods);
+            WRITE_BARRIER_ALL(subclass);
+            subclass->version = vm.nextClassVersion++;
+            DROP(); // Subclass.
+            DISPATCH();
+        }
+
+        CASE(OP_METHOD_LONG):
+        CASE(OP_METHOD):
+        {
+            ObjString* name = READ_STRING_OPERAND(OP_METHOD_LONG);
+            STORE_FRAME();
+            DefineMethod(name);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        // Wide forms of the hot instructions. They are kept down here,
+        // away from the narrow handlers, so they don't get in the way of
+        // how the compiler lays out the common path.
+        CASE(OP_CONSTANT_LONG):
+        {
+            Value constant = constants[READ_LONG()];
+            PUSH(constant);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_LOCAL_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_GLOBAL_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
             {
-                uint16_t offset = READ_SHORT();
-                if (IsFalsey(Peek(0))) { frame->ip += offset; }
-                break;
+                STORE_FRAME();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            PUSH(value);
+            DISPATCH();
+        }
 
-            case OP_LOOP:
+        CASE(OP_DEFINE_GLOBAL_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            Value value = POP();
+            vm.globalValues.values[slot] = value;
+            GLOBAL_WRITE_BARRIER(value);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_GLOBAL_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                STORE_FRAME();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            vm.globalValues.values[slot] = PEEK(0);
+            GLOBAL_WRITE_BARRIER(PEEK(0));
+            DISPATCH();
+        }
+
+        CASE(OP_GET_UPVALUE_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_UPVALUE_LONG):
+        {
+            uint32_t slot = READ_LONG();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            WRITE_BARRIER(upvalue, PEEK(0));
+            DISPATCH();
+        }
+	}
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
 
-            case OP_CALL:
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_OPERAND
+#undef READ_STRING_OPERAND
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+static inline Value ReadRK(uint32_t operand, Value* slots, Value* constants)
+{
+    return (operand & RK_CONSTANT) ? constants[operand & ~RK_CONSTANT]
+                                   : slots[operand];
+}
+
+// Runs the register form of the code built by registers.c. Locals and
+// temporaries are read and written in place in the frame's slots instead
+// of being pushed and popped, so vm.stackTop is only brought up to date
+// (from the instruction's "top" or call base) before something that can
+// collect or call.
+static InterpretResult RunRegisters()
+{
+    CallFrame* frame;
+    register uint32_t* ip;
+    uint32_t* code;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+
+#define STORE_IP() (frame->rip = ip)
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->rip; \
+        code = frame->closure->function->chunk.registers.code; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches; \
+    } while (false)
+
+#define READ() (*ip++)
+#define RK(operand) ReadRK((operand), slots, constants)
+#define READ_STRING() AS_STRING(constants[READ()])
+
+// The <= and >= forms compute !(a > b) and !(a < b) through
+// NOT_BOOL_VAL, like the stack loop, so NaN compares the same in both.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+#define BINARY_OP(valueType, op) \
+    do { \
+        uint32_t dst = READ(); \
+        Value a = RK(READ()); \
+        Value b = RK(READ()); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+        { \
+            STORE_IP(); \
+            RuntimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+// Same convention as the stack loop: jump when (a op b) == negated.
+#define COMPARE_JUMP(op, negated) \
+    do { \
+        Value a = RK(READ()); \
+        Value b = RK(READ()); \
+        uint32_t target = READ(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+        { \
+            STORE_IP(); \
+            RuntimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if ((AS_NUMBER(a) op AS_NUMBER(b)) == (negated)) \
+        { \
+            ip = code + target; \
+        } \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    DisassembleRegisterInstruction(&frame->closure->function->chunk, \
+                                   (int)(ip - code))
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] =
+    {
+        [REG_MOVE]                        = &&op_REG_MOVE,
+        [REG_GET_GLOBAL]                  = &&op_REG_GET_GLOBAL,
+        [REG_DEFINE_GLOBAL]               = &&op_REG_DEFINE_GLOBAL,
+        [REG_SET_GLOBAL]                  = &&op_REG_SET_GLOBAL,
+        [REG_GET_UPVALUE]                 = &&op_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE]                 = &&op_REG_SET_UPVALUE,
+        [REG_GET_PROPERTY]                = &&op_REG_GET_PROPERTY,
+        [REG_SET_PROPERTY]                = &&op_REG_SET_PROPERTY,
+        [REG_GET_SUPER]                   = &&op_REG_GET_SUPER,
+        [REG_EQUAL]                       = &&op_REG_EQUAL,
+        [REG_NOT_EQUAL]                   = &&op_REG_NOT_EQUAL,
+        [REG_GREATER]                     = &&op_REG_GREATER,
+        [REG_GREATER_EQUAL]               = &&op_REG_GREATER_EQUAL,
+        [REG_LESS]                        = &&op_REG_LESS,
+        [REG_LESS_EQUAL]                  = &&op_REG_LESS_EQUAL,
+        [REG_ADD]                         = &&op_REG_ADD,
+        [REG_SUBTRACT]                    = &&op_REG_SUBTRACT,
+        [REG_MULTIPLY]                    = &&op_REG_MULTIPLY,
+        [REG_DIVIDE]                      = &&op_REG_DIVIDE,
+        [REG_NOT]                         = &&op_REG_NOT,
+        [REG_NEGATE]                      = &&op_REG_NEGATE,
+        [REG_PRINT]                       = &&op_REG_PRINT,
+        [REG_JUMP]                        = &&op_REG_JUMP,
+        [REG_JUMP_IF_FALSE]               = &&op_REG_JUMP_IF_FALSE,
+        [REG_EQUAL_JUMP_IF_FALSE]         = &&op_REG_EQUAL_JUMP_IF_FALSE,
+        [REG_NOT_EQUAL_JUMP_IF_FALSE]     = &&op_REG_NOT_EQUAL_JUMP_IF_FALSE,
+        [REG_LESS_JUMP_IF_FALSE]          = &&op_REG_LESS_JUMP_IF_FALSE,
+        [REG_LESS_EQUAL_JUMP_IF_FALSE]    = &&op_REG_LESS_EQUAL_JUMP_IF_FALSE,
+        [REG_GREATER_JUMP_IF_FALSE]       = &&op_REG_GREATER_JUMP_IF_FALSE,
+        [REG_GREATER_EQUAL_JUMP_IF_FALSE] = &&op_REG_GREATER_EQUAL_JUMP_IF_FALSE,
+        [REG_CALL]                        = &&op_REG_CALL,
+        [REG_TAIL_CALL]                   = &&op_REG_TAIL_CALL,
+        [REG_INVOKE]                      = &&op_REG_INVOKE,
+        [REG_SUPER_INVOKE]                = &&op_REG_SUPER_INVOKE,
+        [REG_CLOSURE]                     = &&op_REG_CLOSURE,
+        [REG_CLOSE_UPVALUE]               = &&op_REG_CLOSE_UPVALUE,
+        [REG_RETURN]                      = &&op_REG_RETURN,
+        [REG_CLASS]                       = &&op_REG_CLASS,
+        [REG_INHERIT]                     = &&op_REG_INHERIT,
+        [REG_METHOD]                      = &&op_REG_METHOD
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatchTable[READ()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_EXECUTION(); \
+        COUNT_INSTRUCTION(); \
+        switch (READ())
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(REG_MOVE):
+        {
+            uint32_t dst = READ();
+            slots[dst] = RK(READ());
+            DISPATCH();
+        }
+
+        CASE(REG_GET_GLOBAL):
+        {
+            uint32_t dst = READ();
+            uint32_t slot = READ();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
             {
-                int argCount = READ_BYTE();
-                if (!CallValue(Peek(argCount), argCount))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                STORE_IP();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            slots[dst] = value;
+            DISPATCH();
+        }
+
+        CASE(REG_DEFINE_GLOBAL):
+        {
+            uint32_t slot = READ();
+            Value value = RK(READ());
+            vm.globalValues.values[slot] = value;
+            GLOBAL_WRITE_BARRIER(value);
+            DISPATCH();
+        }
 
-            case OP_INVOKE:
+        CASE(REG_SET_GLOBAL):
+        {
+            uint32_t slot = READ();
+            Value value = RK(READ());
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
             {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!Invoke(method, argCount))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                STORE_IP();
+                RuntimeError("Undefined variable '%s'.",
+                             GlobalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = value;
+            GLOBAL_WRITE_BARRIER(value);
+            DISPATCH();
+        }
+
+        CASE(REG_GET_UPVALUE):
+        {
+            uint32_t dst = READ();
+            uint32_t index = READ();
+            slots[dst] = *frame->closure->upvalues[index]->location;
+            DISPATCH();
+        }
+
+        CASE(REG_SET_UPVALUE):
+        {
+            uint32_t index = READ();
+            Value value = RK(READ());
+            ObjUpvalue* upvalue = frame->closure->upvalues[index];
+            *upvalue->location = value;
+            WRITE_BARRIER(upvalue, value);
+            DISPATCH();
+        }
+
+        CASE(REG_GET_PROPERTY):
+        {
+            uint32_t dst = READ();
+            Value object = RK(READ());
+            ObjString* name = READ_STRING();
+            InlineCache* cache = &caches[READ()];
+            uint32_t top = READ();
+            if (!IS_INSTANCE(object))
+            {
+                STORE_IP();
+                RuntimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            ObjInstance* instance = AS_INSTANCE(object);
+            int slot;
+            Value method;
+            if (!LookupProperty(cache, instance, name, &slot, &method))
+            {
+                STORE_IP();
+                RuntimeError("Undefined property '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            if (slot != -1)
+            {
+                slots[dst] = instance->fields[slot];
+                DISPATCH();
+            }
+
+            vm.stackTop = slots + top;
+            Push(object);
+            ObjBoundMethod* bound = NewBoundMethod(object,
+                                                   AS_CLOSURE(method));
+            Pop();
+            slots[dst] = OBJ_VAL(bound);
+            DISPATCH();
+        }
+
+        CASE(REG_SET_PROPERTY):
+        {
+            uint32_t dst = READ();
+            Value object = RK(READ());
+            Value value = RK(READ());
+            ObjString* name = READ_STRING();
+            InlineCache* cache = &caches[READ()];
+            if (!IS_INSTANCE(object))
+            {
+                STORE_IP();
+                RuntimeError("Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // The object and value are exactly what the stack code has in
+            // dst and dst + 1 here, so putting them there keeps both
+            // reachable while adding the field allocates.
+            vm.stackTop = slots + dst;
+            Push(object);
+            Push(value);
+            SetProperty(cache, AS_INSTANCE(object), name, value);
+            slots[dst] = value;
+            DISPATCH();
+        }
+
+        CASE(REG_GET_SUPER):
+        {
+            uint32_t base = READ();
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(slots[base + 1]);
+            STORE_IP();
+            vm.stackTop = slots + base + 1;
+            if (!BindMethod(superclass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+
+        CASE(REG_EQUAL):
+        {
+            uint32_t dst = READ();
+            Value a = RK(READ());
+            Value b = RK(READ());
+            vm.stackTop = slots + READ();
+            slots[dst] = BOOL_VAL(ValuesEqual(a, b));
+            DISPATCH();
+        }
+        CASE(REG_NOT_EQUAL):
+        {
+            uint32_t dst = READ();
+            Value a = RK(READ());
+            Value b = RK(READ());
+            vm.stackTop = slots + READ();
+            slots[dst] = BOOL_VAL(!ValuesEqual(a, b));
+            DISPATCH();
+        }
+
+        CASE(REG_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(REG_LESS):    BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(REG_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <); DISPATCH();
+        CASE(REG_LESS_EQUAL):    BINARY_OP(NOT_BOOL_VAL, >); DISPATCH();
+
+        CASE(REG_ADD):
+        {
+            uint32_t dst = READ();
+            Value a = RK(READ());
+            Value b = RK(READ());
+            uint32_t top = READ();
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            }
+            else if (IS_ANY_STRING(a) && IS_ANY_STRING(b))
+            {
+                vm.stackTop = slots + top;
+                Push(a);
+                Push(b);
+                Concatenate();
+                slots[dst] = Pop();
             }
+            else
+            {
+                STORE_IP();
+                RuntimeError(
+                    "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(REG_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(REG_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(REG_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
 
-            case OP_SUPER_INVOKE:
+        CASE(REG_NOT):
+        {
+            uint32_t dst = READ();
+            slots[dst] = BOOL_VAL(IsFalsey(RK(READ())));
+            DISPATCH();
+        }
+        CASE(REG_NEGATE):
+        {
+            uint32_t dst = READ();
+            Value value = RK(READ());
+            if (!IS_NUMBER(value))
             {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(Pop());
-                if (!InvokeFromClass(superclass, method, argCount))
+                STORE_IP();
+                RuntimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[dst] = NUMBER_VAL(-AS_NUMBER(value));
+            DISPATCH();
+        }
+
+        CASE(REG_PRINT):
+        {
+            PrintValue(RK(READ()));
+            printf("\n");
+            DISPATCH();
+        }
+
+        CASE(REG_JUMP):
+        {
+            uint32_t target = READ();
+            ip = code + target;
+            DISPATCH();
+        }
+
+        CASE(REG_JUMP_IF_FALSE):
+        {
+            Value value = RK(READ());
+            uint32_t target = READ();
+            if (IsFalsey(value)) { ip = code + target; }
+            DISPATCH();
+        }
+
+        CASE(REG_EQUAL_JUMP_IF_FALSE):
+        {
+            Value a = RK(READ());
+            Value b = RK(READ());
+            uint32_t target = READ();
+            vm.stackTop = slots + READ();
+            if (!ValuesEqual(a, b)) { ip = code + target; }
+            DISPATCH();
+        }
+        CASE(REG_NOT_EQUAL_JUMP_IF_FALSE):
+        {
+            Value a = RK(READ());
+            Value b = RK(READ());
+            uint32_t target = READ();
+            vm.stackTop = slots + READ();
+            if (ValuesEqual(a, b)) { ip = code + target; }
+            DISPATCH();
+        }
+        CASE(REG_LESS_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, false);
+            DISPATCH();
+        CASE(REG_LESS_EQUAL_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, true);
+            DISPATCH();
+        CASE(REG_GREATER_JUMP_IF_FALSE):
+            COMPARE_JUMP(>, false);
+            DISPATCH();
+        CASE(REG_GREATER_EQUAL_JUMP_IF_FALSE):
+            COMPARE_JUMP(<, true);
+            DISPATCH();
+
+        CASE(REG_CALL):
+        {
+            uint32_t base = READ();
+            int argCount = (int)READ();
+            STORE_IP();
+            vm.stackTop = slots + base + argCount + 1;
+            if (!CallValue(slots[base], argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(REG_TAIL_CALL):
+        {
+            uint32_t base = READ();
+            int argCount = (int)READ();
+            Value callee = slots[base];
+            STORE_IP();
+            if (!IS_CLOSURE(callee) ||
+                AS_CLOSURE(callee)->function->arity != argCount)
+            {
+                vm.stackTop = slots + base + argCount + 1;
+                if (!CallValue(callee, argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
 
-            case OP_CLOSURE:
+            if (vm.openUpvalues != NULL) { CloseUpvalues(slots); }
+            memmove(slots, slots + base, sizeof(Value) * (argCount + 1));
+            vm.stackTop = slots + argCount + 1;
+            vm.frameCount--;
+            if (!Call(AS_CLOSURE(callee), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(REG_INVOKE):
+        {
+            uint32_t base = READ();
+            ObjString* method = READ_STRING();
+            int argCount = (int)READ();
+            InlineCache* cache = &caches[READ()];
+            STORE_IP();
+            vm.stackTop = slots + base + argCount + 1;
+            if (!Invoke(method, argCount, cache))
             {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = NewClosure(function);
-                Push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++)
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(REG_SUPER_INVOKE):
+        {
+            uint32_t base = READ();
+            ObjString* method = READ_STRING();
+            int argCount = (int)READ();
+            ObjClass* superclass = AS_CLASS(slots[base + argCount + 1]);
+            STORE_IP();
+            vm.stackTop = slots + base + argCount + 1;
+            if (!InvokeFromClass(superclass, method, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(REG_CLOSURE):
+        {
+            uint32_t dst = READ();
+            ObjFunction* function = AS_FUNCTION(constants[READ()]);
+            vm.stackTop = slots + dst;
+            ObjClosure* closure = NewClosure(function);
+            Push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                uint32_t isLocal = READ();
+                uint32_t index = READ();
+                if (isLocal)
                 {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal)
-                    {
-                        closure->upvalues[i] =
-                            CaptureUpvalue(frame->slots + index);
-                    }
-                    else
-                    {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+                    closure->upvalues[i] = CaptureUpvalue(slots + index);
                 }
-                break;
+                else
+                {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                }
+                WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
             }
+            DISPATCH();
+        }
 
-            case OP_CLOSE_UPVALUE:
-                CloseUpvalues(vm.stackTop - 1);
-                Pop();
-                break;
+        CASE(REG_CLOSE_UPVALUE):
+            CloseUpvalues(slots + READ());
+            DISPATCH();
 
-			case OP_RETURN:
-			{
-                Value result = Pop();
+        CASE(REG_RETURN):
+        {
+            Value result = RK(READ());
 
-                CloseUpvalues(frame->slots);
+            if (vm.openUpvalues != NULL) { CloseUpvalues(slots); }
 
-                vm.frameCount--;
-                if (vm.frameCount == 0)
-                {
-                    Pop();
-                    return INTERPRET_OK;
-                }
+            vm.frameCount--;
+            if (vm.frameCount == 0)
+            {
+                vm.stackTop = slots;
+                return INTERPRET_OK;
+            }
 
-                vm.stackTop = frame->slots;
-                Push(result);
+            slots[0] = result;
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-			}
+        CASE(REG_CLASS):
+        {
+            uint32_t dst = READ();
+            ObjString* name = READ_STRING();
+            vm.stackTop = slots + dst;
+            slots[dst] = OBJ_VAL(NewClass(name));
+            DISPATCH();
+        }
 
-            case OP_CLASS:
-                Push(OBJ_VAL(NewClass(READ_STRING())));
-                break;
-            case OP_INHERIT:
-                Value superclass = Peek(1);
-                if (!IS_CLASS(superclass))
-                {
-                    RuntimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(REG_INHERIT):
+        {
+            uint32_t base = READ();
+            Value superclass = slots[base];
+            if (!IS_CLASS(superclass))
+            {
+                STORE_IP();
+                RuntimeError("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                ObjClass* subclass = AS_CLASS(Peek(0));
-                TableAddAll(&AS_CLASS(superclass)->methods,
-                            &subclass->methods);
-                Pop(); // Subclass.
-                break;
-            case OP_METHOD:
-                DefineMethod(READ_STRING());
-                break;
-		}
-	}
+            ObjClass* subclass = AS_CLASS(slots[base + 1]);
+            vm.stackTop = slots + base + 2;
+            TableAddAll(&AS_CLASS(superclass)->methods,
+                        &subclass->methods);
+            WRITE_BARRIER_ALL(subclass);
+            subclass->version = vm.nextClassVersion++;
+            DISPATCH();
+        }
 
-#undef READ_BYTE
-#undef READ_SHORT
+        CASE(REG_METHOD):
+        {
+            uint32_t base = READ();
+            ObjString* name = READ_STRING();
+            vm.stackTop = slots + base + 2;
+            DefineMethod(name);
+            DISPATCH();
+        }
+    }
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
+
+#undef STORE_IP
+#undef LOAD_FRAME
+#undef READ
+#undef RK
 #undef READ_STRING
-#undef READ_CONSTANT
+#undef NOT_BOOL_VAL
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult Interpret(const char* source)
@@ -658,11 +2372,29 @@ InterpretResult Interpret(const char* source)
     ObjFunction* function = Compile(source);
     if (function == NULL) { return INTERPRET_COMPILE_ERROR; }
 
+    return InterpretFunction(function);
+}
+
+InterpretResult InterpretFunction(ObjFunction* function)
+{
     Push(OBJ_VAL(function));
     ObjClosure* closure = NewClosure(function);
     Pop();
     Push(OBJ_VAL(closure));
-    CallValue(OBJ_VAL(closure), 0);
+    if (!CallValue(OBJ_VAL(closure), 0)) { return INTERPRET_RUNTIME_ERROR; }
+
+    if (vm.useRegisters) { return RunRegisters(); }
+
+    // A compiled script has already run to completion inside the call.
+    InterpretResult result = vm.frameCount > 0 ? Run(0) : INTERPRET_OK;
+    // Drop the script's return value.
+    if (result == INTERPRET_OK) { Pop(); }
+    return result;
+}
 
-    return Run();
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+void PrintInstructionCount()
+{
+    fprintf(stderr, "%lld instructions\n", vm.instructionCount);
 }
+#endif
@@ -5,35 +5,105 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// The frame and value stacks start small and grow as calls need them, up
+// to these limits.
+#define FRAMES_MAX (1 << 16)
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Values the runtime may push above a frame's own slots while it runs.
+#define STACK_HEADROOM 8
+
+// Compiled code, from the JIT or --emit-c, calls compiled functions on the
+// C stack. Calls nested deeper than this are interpreted instead.
+#define NATIVE_DEPTH_MAX 1000
 
 typedef struct
 {
     ObjClosure* closure;
     uint8_t* ip;
+    // Used instead of ip when running the register form of the chunk.
+    uint32_t* rip;
     Value* slots;
+    // Set by compiled code making a tail call, which it does as an
+    // ordinary call. Traces leave out the frame the interpreter would
+    // have replaced.
+    bool tailCalling;
 } CallFrame;
 
+#ifdef INCREMENTAL_GC
+typedef enum
+{
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GCPhase;
+#endif
+
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    // Both stacks move when they grow, so pointers into them have to be
+    // picked up again after every call.
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    // Compiled frames running on the C stack.
+    int nativeDepth;
+    // Run the register form of each function instead of its stack code.
+    bool useRegisters;
+    // Compile hot functions to machine code. Only used with JIT.
+    bool useJit;
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    long long instructionCount;
+#endif
 
-	Value stack[STACK_MAX];
+	Value* stack;
 	Value* stackTop;
-    Table globals;
+    int stackCapacity;
+    // Globals are resolved to slots at compile time. globalNames maps each
+    // name to its slot, and a slot holds UNDEFINED_VAL until the variable
+    // is defined.
+    Table globalNames;
+    ValueArray globalValues;
     Table strings;
     ObjString* initString;
+    ObjShape* rootShape;
     ObjUpvalue* openUpvalues;
+    uint32_t nextClassVersion;
 
     size_t bytesAllocated;
     size_t nextGC;
 
     Obj* objects;
+    // What isMarked holds for a marked object. Flipping it unmarks every
+    // object at once, so marks never have to be cleared one by one.
+    bool markValue;
+#ifdef GENERATIONAL_GC
+    // The nursery: objects allocated since the last collection. objects
+    // only holds the old generation.
+    Obj* youngObjects;
+    size_t nurseryBytes;
+    // Old objects that have had a young object stored in them since the
+    // last collection, and whether the globals have.
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    bool globalsRemembered;
+#endif
+#ifdef INCREMENTAL_GC
+    // How far the full collection in progress has got. stepBytes counts
+    // allocation since its last step, and sweepLink points at the link to
+    // the next object to sweep.
+    GCPhase gcPhase;
+    size_t stepBytes;
+    Obj** sweepLink;
+#endif
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+#ifdef PARALLEL_MARKING
+    // Threads, including this one, that trace the heap in a collection's
+    // pauses. 1 keeps marking on this thread alone.
+    int markThreads;
+#endif
 } VM;
 
 typedef enum
@@ -48,7 +118,43 @@ extern VM vm;
 void InitVM();
 void FreeVM();
 InterpretResult Interpret(const char* source);
+InterpretResult InterpretFunction(ObjFunction* function);
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+void PrintInstructionCount();
+#endif
 void Push(Value value);
 Value Pop();
+int ResolveGlobal(ObjString* name);
+ObjString* GlobalName(int slot);
+
+// Compiled code, from the JIT or from --emit-c, does the common cases of
+// the simple instructions itself and calls these for everything else.
+// They work on vm.stackTop and the top frame the way the matching handlers
+// in Run() do. Those returning bool return false after reporting a runtime
+// error.
+bool JitError(const char* message);
+bool JitUndefinedVariable(int slot);
+void JitDefineGlobal(int slot);
+bool JitSetGlobal(int slot);
+void JitSetUpvalue(int index);
+bool JitGetProperty(ObjString* name, InlineCache* cache);
+bool JitSetProperty(ObjString* name, InlineCache* cache);
+bool JitGetSuper(ObjString* name);
+// Pops two values and returns whether they are equal.
+bool JitValuesEqual();
+bool JitAdd();
+void JitPrint();
+bool JitCall(int argCount);
+bool JitInvoke(ObjString* name, int argCount, InlineCache* cache);
+// Finishes the top frame in the interpreter after its compiled code
+// deoptimized, for a caller that called that code itself.
+bool JitFinishFrame();
+bool JitSuperInvoke(ObjString* name, int argCount);
+void JitClosure(const uint8_t* instruction);
+void JitCloseUpvalue();
+void JitReturn();
+void JitClass(ObjString* name);
+bool JitInherit();
+void JitMethod(ObjString* name);
 
 #endif